@@ -221,6 +221,13 @@ DEFINE_SYSOP_TYPE_FUNC(dmb, oshst)
 DEFINE_SYSOP_TYPE_FUNC(isb, sy)
 DEFINE_SYSOP_FUNC(isb)
 
+/* Generic Timer counter and frequency */
+DEFINE_SYSREG_READ_FUNC(cntvct_el0)
+DEFINE_SYSREG_READ_FUNC(cntfrq_el0)
+
+/* Cache type */
+DEFINE_SYSREG_READ_FUNC(ctr_el0)
+
 // tmp
 extern uint32_t arm64_read_cpuid (void);
 extern uint32_t arm64_read_icc_iar1_el1 (void);
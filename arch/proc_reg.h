@@ -644,6 +644,12 @@
 #define TTE_ENTRY_INVALID		0x0000000000000000ULL		/* invalid entry */
 #define TTE_ENTRY_VALID			0x0000000000000001ULL		/* valid entry */
 
+/* Block and Page TTE attributes */
+#define TTE_AP_MASK				0x00000000000000c0ULL		/* mask to extract access permissions, AP[2:1] */
+#define TTE_AP_READONLY			0x0000000000000080ULL		/* AP[2], entry is read-only */
+#define TTE_CONTIGUOUS			0x0010000000000000ULL		/* bit 52, entry is one of an aligned contiguous run */
+#define TTE_SW_COPY_ON_WRITE	0x0080000000000000ULL		/* software bit 55, entry is copy-on-write */
+
 /* Level 0 General Values */
 #define TT_L0_INDEX_MASK		0x0000ff8000000000ULL		/* mask to extract L0 table index from VA */
 #define TT_L0_SIZE				0x0000008000000000ULL		/* size of memory covered by a TTE */
@@ -825,6 +831,24 @@
 #define MPIDR_AFFLVL3_VAL(mpidr) \
 		(0)
 
+/*******************************************************************************
+ * Name:	Cache Type Register
+*******************************************************************************/
+
+/**
+ * ARM:		D19-7010
+ * Field:	DminLine, Bits [19:16]
+ * Desc:	Log2 of the number of words in the smallest data or unified cache
+ * 			line of all the caches controlled by the PE.
+*/
+#define CTR_DMINLINE_SHIFT		16
+#define CTR_DMINLINE_WIDTH		4
+#define CTR_DMINLINE_MASK		(((1 << CTR_DMINLINE_WIDTH) - 1) << CTR_DMINLINE_SHIFT)
+
+/* Smallest data cache line size, in bytes */
+#define CTR_DMINLINE_SIZE(ctr)	\
+		(4UL << (((ctr) & CTR_DMINLINE_MASK) >> CTR_DMINLINE_SHIFT))
+
 /*******************************************************************************
  * Name:	Virtual Timer Definitions
 *******************************************************************************/
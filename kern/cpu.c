@@ -29,6 +29,9 @@
 #include <kern/machine.h>
 #include <kern/vm/pmap.h>
 
+#include <arch/arch.h>
+#include <arch/proc_reg.h>
+
 /**
  * List of active CPUs. This array is allocated to the maximum number of allowed
  * CPUs (DEFAULTS_MACHINE_MAX_CPUS), and is updated as each CPU becomes active.
@@ -47,6 +50,26 @@ cpu_t cpu_get_id (unsigned int id)
 	return (cpu_t) CpuDataEntries[id];
 }
 
+/**
+ * Fetch the number of the current CPU, used to index per-CPU data. This reads
+ * the hardware CPU number rather than the cpu_t, as only the boot CPU's cpu_t
+ * has been filled in so far.
+ */
+cpu_number_t cpu_get_current_num ()
+{
+	return (cpu_number_t) machine_get_cpu_num();
+}
+
+/**
+ * Fetch the size, in bytes, of the smallest data cache line from CTR_EL0. This
+ * is the granule that data structures should be aligned to, to avoid sharing
+ * a line between CPUs.
+ */
+uint32_t cpu_get_cache_line_size ()
+{
+	return CTR_DMINLINE_SIZE (arm64_read_ctr_el0 ());
+}
+
 kern_return_t cpu_data_init (cpu_t *cpu_data_ptr)
 {
 	cpu_data_ptr->cpu_num = 0;
@@ -26,7 +26,7 @@
  *
  */
 
-#ifndef __KERN_CPU_H_
+#ifndef __KERN_CPU_H__
 #define __KERN_CPU_H__
 
 #include <kern/defaults.h>
@@ -99,6 +99,8 @@ kern_return_t 	cpu_set_boot_cpu (cpu_t *cpu_data_ptr);
 
 cpu_t			cpu_get_current ();
 cpu_t			cpu_get_id (unsigned int id);
+cpu_number_t	cpu_get_current_num ();
+uint32_t		cpu_get_cache_line_size ();
 
 kern_return_t	cpu_init (void);
 void			cpu_halt (void);
@@ -46,6 +46,8 @@
 #define DEFAULTS_KERNEL_VM_PAGE_SIZE		TT_PAGE_SIZE
 #define DEFAULTS_KERNEL_VM_VIRT_BASE		UL(0xfffffff000000000)
 #define DEFAULTS_KERNEL_VM_PERIPH_BASE		UL(0xffffffff10000000)
+#define DEFAULTS_KERNEL_VM_WINDOW_BASE		UL(0xffffffff20000000)
+#define DEFAULTS_KERNEL_VM_TABLE_BASE		UL(0xffffffff40000000)
 
 #define DEFAULTS_KERNEL_VM_USE_L3_TABLE		DEFAULTS_DISABLE
 
@@ -59,9 +61,6 @@
 
 #define DEFAULTS_MACHINE_LIBFDT_WORKAROUND	DEFAULTS_ENABLE
 
-/* Platform */
-#define DEFAULTS_PLAT_DEVICETREE_CELL_SIZE	2
-
 /* Boot Arguments */
 #define DEFAULTS_BA_OFFSET_VIRTBASE			UL(8)
 #define DEFAULTS_BA_OFFSET_PHYSBASE			UL(16)
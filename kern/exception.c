@@ -33,7 +33,10 @@
 #include <kern/defaults.h>
 #include <kern/kprintf.h>
 #include <kern/vm/vm.h>
+#include <kern/vm/pmap.h>
+#include <kern/vm/vm_map.h>
 #include <kern/task.h>
+#include <kern/mm/zalloc.h>
 #include <kern/cpu.h>
 
 #include <arch/arch.h>
@@ -65,23 +68,24 @@ static void handle_svc (arm64_exception_frame_t *);
 /**
  * The Abort inspector determines the type of Abort that has occured, and the
  * handler is then dispatched to deal with the exception. From the First-stage
- * exception handler, we just call handle_abort().
+ * exception handler, we just call handle_abort(). Handlers return
+ * KERN_RETURN_SUCCESS if the fault was resolved and execution can continue.
 */
 typedef void (*abort_inspector_t)	(fault_status_t *, fault_type_t *, uint32_t);
-typedef void (*abort_handler_t)		(arm64_exception_frame_t *, fault_status_t, fault_status_t);
+typedef kern_return_t (*abort_handler_t)	(arm64_exception_frame_t *, fault_address_t, fault_status_t, fault_type_t);
 
 /* Abort Inspectors */
 static void inspect_data_abort (fault_status_t *, fault_type_t *, uint32_t);
 static void inspect_instruction_abort (fault_status_t *, fault_type_t *, uint32_t);
 
 /* Abort type handlers */
-static void handle_data_abort (arm64_exception_frame_t *, fault_address_t, fault_status_t);
-static void handle_instruction_abort (arm64_exception_frame_t *, fault_address_t, fault_status_t);
+static kern_return_t handle_data_abort (arm64_exception_frame_t *, fault_address_t, fault_status_t, fault_type_t);
+static kern_return_t handle_instruction_abort (arm64_exception_frame_t *, fault_address_t, fault_status_t, fault_type_t);
 static void handle_prefetch_abort (arm64_exception_frame_t *, fault_address_t, fault_status_t);
 static void handle_msr_trap (arm64_exception_frame_t *);
 
 /* General Abort handler */
-static void handle_abort (arm64_exception_frame_t *, abort_handler_t, abort_inspector_t);
+static kern_return_t handle_abort (arm64_exception_frame_t *, abort_handler_t, abort_inspector_t);
 
 /**
  * Panic message
@@ -265,19 +269,45 @@ static void inspect_instruction_abort (fault_status_t *fault_code,
 */
 
 __KERNEL_ABORT_HANDLER
-void handle_data_abort (arm64_exception_frame_t *frame, 
-		fault_address_t fault_address, fault_status_t fault_status)
+kern_return_t handle_data_abort (arm64_exception_frame_t *frame, 
+		fault_address_t fault_address, fault_status_t fault_status,
+		fault_type_t fault_type)
 {
+	vm_map_t *map;
+
+	/**
+	 * A write to a copy-on-write page raises a Permission Fault, which is
+	 * resolved by giving the writer its own copy of the page.
+	*/
+	if (is_permission_fault (fault_status) && (fault_type & VM_PROT_WRITE)) {
+		if (pmap_fault_copy_on_write (fault_address) == PMAP_RETURN_SUCCESS)
+			return KERN_RETURN_SUCCESS;
+	}
 
 	/**
 	 * Panic with a virtual memory Translation Fault, and fetch the level at
 	 * which the fault occured.
 	*/
 	if (is_translation_fault (fault_status)) {
+		/**
+		 * The first access to a page of a lazy allocation is resolved by
+		 * backing it. The upper half of the address space is the kernel's.
+		*/
+		map = (fault_address & (1UL << 63)) ? vm_get_kernel_map () :
+			get_current_task ()->map;
+		if (map && vm_map_fault (map, fault_address) == KERN_RETURN_SUCCESS)
+			return KERN_RETURN_SUCCESS;
+
+		/* report accesses to the guard pages of sampled zone elements */
+		if (zone_guard_report (fault_address) == KERN_RETURN_SUCCESS) {
+			panic_with_thread_state (frame, fault_address, "Data Abort - Zone Guard Fault");
+			return KERN_RETURN_FAIL;
+		}
+
 		/** TOOD: There is more handling to do here then just printing the fault type */
 		panic_with_thread_state (frame, fault_address, "Data Abort - Translation Fault Level %d", 
 			vm_fault_get_level (fault_status));
-		return;
+		return KERN_RETURN_FAIL;
 	}
 
 	/**
@@ -287,7 +317,7 @@ void handle_data_abort (arm64_exception_frame_t *frame,
 	if (is_permission_fault (fault_status)) {
 		panic_with_thread_state (frame, fault_address, "Data Abort - Permissions Fault, Level %d",
 			vm_fault_get_level (fault_status));
-		return;
+		return KERN_RETURN_FAIL;
 	}
 
 	/**
@@ -295,7 +325,7 @@ void handle_data_abort (arm64_exception_frame_t *frame,
 	*/
 	if (is_alignment_fault (fault_status)) {
 		panic_with_thread_state (frame, fault_address, "Alignment Fault");
-		return;
+		return KERN_RETURN_FAIL;
 	}
 
 	/**
@@ -304,16 +334,18 @@ void handle_data_abort (arm64_exception_frame_t *frame,
 	if (is_address_size_fault (fault_status)) {
 		panic_with_thread_state (frame, fault_address, "Data Abort - Address Size Fault, Level %d",
 			vm_fault_get_level (fault_status));
-		return;
+		return KERN_RETURN_FAIL;
 	}
 
 	panic_with_thread_state (frame, frame->far, "Data Abort - Unknown (0x%lx)",
 		fault_status);
+	return KERN_RETURN_FAIL;
 }
 
 __KERNEL_ABORT_HANDLER
-void handle_instruction_abort (arm64_exception_frame_t *frame,
-		fault_address_t fault_address, fault_status_t fault_status)
+kern_return_t handle_instruction_abort (arm64_exception_frame_t *frame,
+		fault_address_t fault_address, fault_status_t fault_status,
+		fault_type_t fault_type)
 {
 
 	/**
@@ -322,11 +354,12 @@ void handle_instruction_abort (arm64_exception_frame_t *frame,
 	if (is_translation_fault (fault_status)) {
 		panic_with_thread_state (frame, fault_address, "Kernel Instruction Abort - Translation Fault, Level %d",
 			vm_fault_get_level (fault_status));
-		return;
+		return KERN_RETURN_FAIL;
 	}
 
 	panic_with_thread_state (frame, frame->far, "Kernel Instruction Abort - Unknwon (0x%x)",
 		fault_status);
+	return KERN_RETURN_FAIL;
 }
 
 
@@ -525,15 +558,16 @@ void handle_svc (arm64_exception_frame_t *frame)
  * Desc:	Handle an Abort exception (Data, Instruction, Prefetch)
 */
 __KERNEL_FAULT_HANDLER
-void handle_abort (arm64_exception_frame_t *frame, abort_handler_t handler, abort_inspector_t inspect)
+kern_return_t handle_abort (arm64_exception_frame_t *frame, abort_handler_t handler, abort_inspector_t inspect)
 {
 	fault_address_t		fault_address;
 	fault_status_t		fault_code;
 	fault_type_t		fault_type;
 
 	/* Inspect the fault, and then call the handler */
+	fault_address = frame->far;
 	inspect(&fault_code, &fault_type, ESR_ISS(frame->esr));
-	handler (frame, fault_address, fault_code);
+	return handler (frame, fault_address, fault_code, fault_type);
 }
 
 /**
@@ -570,8 +604,8 @@ void arm64_handler_synchronous (arm64_exception_frame_t *frame)
 		/* Data Abort (EL0 and EL1) */
 		case ESR_EC_DABORT_EL0:
 		case ESR_EC_DABORT_EL1:
-			handle_abort (frame, (abort_handler_t) handle_data_abort, inspect_data_abort);
-			cpu_halt ();
+			if (handle_abort (frame, handle_data_abort, inspect_data_abort) != KERN_RETURN_SUCCESS)
+				cpu_halt ();
 			break;
 
 		/* Breakpoint */
@@ -594,8 +628,8 @@ void arm64_handler_synchronous (arm64_exception_frame_t *frame)
 		/* Instruction Abort (EL0 and EL1) */
 		case ESR_EC_IABORT_EL1:
 		case ESR_EC_IABORT_EL0:
-			handle_abort (frame, (abort_handler_t) handle_instruction_abort, inspect_instruction_abort);
-			cpu_halt ();
+			if (handle_abort (frame, handle_instruction_abort, inspect_instruction_abort) != KERN_RETURN_SUCCESS)
+				cpu_halt ();
 			break;
 
 		/* Unknown Exception*/
@@ -26,10 +26,12 @@ KERNEL_SOURCES	+=	kern/main.o						\
 					kern/exception.o				\
 					kern/machine.o					\
 					kern/mm/zalloc.o				\
+					kern/mm/kalloc.o				\
 					kern/vm/vm.o					\
 					kern/vm/vm_walk.o				\
 					kern/vm/vm_page.o				\
 					kern/vm/vm_map.o				\
+					kern/vm/vmem.o					\
 					kern/vm/pmap.o					\
 					kern/machine/machine_timer.o	\
 					kern/machine/machine-irq.o
@@ -59,6 +59,14 @@ unsigned int machine_get_num_clusters () {return topology_info.num_clusters;}
 unsigned int machine_get_max_cpu_num () {return topology_info.max_cpu_id;}
 unsigned int machine_get_num_cpus () {return topology_info.num_cpus;}
 
+/* numa node of a cpu, cpus without a numa-node-id are on node 0 */
+unsigned int machine_get_cpu_node (cpu_number_t cpu)
+{
+	if (cpu < 0 || cpu >= topology_info.num_cpus)
+		return 0;
+	return topology_info.cpus[cpu].numa_node;
+}
+
 /*****************************************************************************/
 
 cpu_number_t machine_get_cpu_num ()
@@ -175,6 +183,9 @@ kern_return_t machine_parse_cpu_topology (void)
 			DeviceTreeLookupNodeByPhandle (__bswap_32 (*(__uint32_t *) entry), &cpu_node);
 			cpu.cpu_phys_id = (uint32_t) machine_read_prop (cpu_node, "reg");
 
+			if (DeviceTreeLookupPropertyU32 (cpu_node, "numa-node-id", &cpu.numa_node))
+				cpu.numa_node = 0;
+
 			if (cpu.cpu_id == boot_cpu) {
 				topology_info.boot_cpu = &cpus[topology_info.num_cpus];
 				topology_info.boot_cluster = &clusters[topology_info.num_clusters];
@@ -47,6 +47,7 @@ typedef struct machine_topology_cpu
 	unsigned int				cpu_phys_id;
 	unsigned int				cpu_id;
 	unsigned int				cluster_id;
+	unsigned int				numa_node;
 	cpu_type_t					cpu_type_t;
 } machine_topology_cpu_t;
 
@@ -76,6 +77,7 @@ unsigned int	machine_get_boot_cpu_num ();
 unsigned int	machine_get_max_cpu_num ();
 unsigned int	machine_get_num_cpus ();
 unsigned int	machine_get_num_clusters ();
+unsigned int	machine_get_cpu_node (cpu_number_t cpu);
 
 /**
  *	machine_parse_cpu_topology
@@ -32,13 +32,14 @@
 #include <libkern/assert.h>
 
 #include <kern/vm/pmap.h>
+#include <kern/vm/vm.h>
 
 
 kern_return_t
 machine_init_interrupts ()
 {
 	vm_address_t gic_region_virt_base, gicd_virt_base, gicr_virt_base;
-	phys_addr_t gic_region_base, gicd_phys_base, gicr_phys_base;
+	phys_addr_t gic_region_base, gic_region_end, gicd_phys_base, gicr_phys_base;
 	uint64_t gicd_size, gicr_size;
 
 	/**
@@ -64,29 +65,28 @@ machine_init_interrupts ()
 	 * }
 	*/
 
-	gic_region_virt_base = 0xffffffff11000000;
 	gic_region_base = (phys_addr_t) 0x8000000;
 
-	gicd_virt_base = (vm_address_t) (gic_region_virt_base + 0x0);
 	gicd_phys_base = (phys_addr_t) (gic_region_base + 0x0);
 	gicd_size = 0x10000;
 
-	gicr_virt_base = (vm_address_t) (gic_region_virt_base + 0xa0000);
 	gicr_phys_base = (phys_addr_t) (gic_region_base + 0xa0000);
 	gicr_size = 0xf60000;
 
-	/**
-	 * TODO: 	Use proper mapping api
-	 * 
-	 * By the time machine_init_interrupts is called, we should have both vm_page
-	 * and vm_map running. Therefore, we should instead do something like
-	 * 	vm_map_peripheral()
-	 * 
-	 * or whatever the api ends up being, rather than directly calling the pmap
-	 * api.
-	*/
-	pmap_tt_create_tte (kernel_tte, gicd_phys_base, gicd_virt_base, gicd_size);
-	pmap_tt_create_tte (kernel_tte, gicr_phys_base, gicr_virt_base, gicr_size);
+	/* map the distributor and redistributors together, as one region */
+	gic_region_end = gicd_phys_base + gicd_size;
+	if (gicr_phys_base + gicr_size > gic_region_end)
+		gic_region_end = gicr_phys_base + gicr_size;
+
+	gic_region_virt_base = vm_map_peripheral (gic_region_base,
+		gic_region_end - gic_region_base);
+	if (gic_region_virt_base == 0)
+		return KERN_RETURN_FAIL;
+
+	gicd_virt_base = (vm_address_t) (gic_region_virt_base +
+		(gicd_phys_base - gic_region_base));
+	gicr_virt_base = (vm_address_t) (gic_region_virt_base +
+		(gicr_phys_base - gic_region_base));
 
 	gic_interface_init (gicd_virt_base, gicr_virt_base);
 	return KERN_RETURN_SUCCESS;
@@ -44,4 +44,25 @@ kern_return_t
 machine_timer_reset(uint64_t reset)
 {
 	arm64_timer_reset(reset);
+}
+
+uint64_t
+machine_timer_get_ticks ()
+{
+	/* the isb stops the counter being read early, out of order */
+	isb ();
+	return arm64_read_cntvct_el0 ();
+}
+
+uint64_t
+machine_timer_ticks_to_us (uint64_t ticks)
+{
+	uint64_t freq;
+
+	freq = arm64_read_cntfrq_el0 ();
+	if (freq == 0)
+		return 0;
+
+	/* split the conversion so long intervals don't overflow */
+	return ((ticks / freq) * 1000000) + (((ticks % freq) * 1000000) / freq);
 }
\ No newline at end of file
@@ -46,4 +46,8 @@
 extern kern_return_t machine_init_timers ();
 extern kern_return_t machine_timer_reset(uint64_t reset);
 
+/* Virtual counter, used for timing */
+extern uint64_t machine_timer_get_ticks ();
+extern uint64_t machine_timer_ticks_to_us (uint64_t ticks);
+
 #endif /* __machine_timer_h__ */
\ No newline at end of file
@@ -39,8 +39,13 @@
 /* kernel */
 #include <kern/machine.h>
 #include <kern/machine/machine-irq.h>
+#include <kern/machine/machine_timer.h>
 #include <kern/vm/vm.h>
 #include <kern/vm/pmap.h>
+#include <kern/vm/vm_page.h>
+#include <kern/vm/vm_map.h>
+#include <kern/mm/zalloc.h>
+#include <kern/mm/kalloc.h>
 #include <kern/task.h>
 
 /* platform */
@@ -75,6 +80,11 @@ void kernel_init (struct boot_args *boot_args, uint64_t x1, uint64_t x2)
 	phys_addr_t membase;
 	phys_size_t memsize;
 	cpu_t boot_cpu;
+	uint64_t boot_ticks, vm_init_ticks, vm_config_ticks;
+	uint64_t task_init_ticks, task_ticks;
+
+	/* the counter runs from reset, so this also covers time spent in tBoot */
+	boot_ticks = machine_timer_get_ticks ();
 
 	/* initialise the cpu_data for the boot cpu */
 	cpu_data_init (&boot_cpu);
@@ -101,6 +111,7 @@ void kernel_init (struct boot_args *boot_args, uint64_t x1, uint64_t x2)
 	/* fetch platform memory layout and setup virtual memory */
 	platform_get_memory (&membase, &memsize);
 	arm_vm_init (boot_args, membase, memsize);
+	vm_init_ticks = machine_timer_get_ticks ();
 
 	/* initialise the console and enable kprintf */
 	kprintf_init ();
@@ -128,6 +139,13 @@ void kernel_init (struct boot_args *boot_args, uint64_t x1, uint64_t x2)
 	/* configure remaining virtual memory subsystems */
 	vm_configure ();
 
+	/* initialise the zone allocator, and the vm_map, vmem and kalloc zones */
+	zone_init ();
+	vm_map_init ();
+	vmem_init ();
+	kalloc_init ();
+	vm_config_ticks = machine_timer_get_ticks ();
+
 	/* configure the interrupt controller */
 	machine_init_interrupts ();
 
@@ -135,12 +153,19 @@ void kernel_init (struct boot_args *boot_args, uint64_t x1, uint64_t x2)
 	machine_init_timers();
 
 	/* create the kernel task */
+	task_init_ticks = machine_timer_get_ticks ();
 	task_init();
 	kernel_task_create (kernel_task, kernel_task_test, vm_get_kernel_map (), 
 		((vm_address_t) kernel_task + sizeof(task_t)));
 	kprintf ("kernel_task: 0x%lx\n", kernel_task);
+	task_ticks = machine_timer_get_ticks ();
 
 	kprintf("minimal kernel startup complete\n");
+	kprintf ("boot timings: reset %dus, arm_vm_init %dus, vm_configure %dus, "
+		"task_init %dus\n", machine_timer_ticks_to_us (boot_ticks),
+		machine_timer_ticks_to_us (vm_init_ticks - boot_ticks),
+		machine_timer_ticks_to_us (vm_config_ticks - vm_init_ticks),
+		machine_timer_ticks_to_us (task_ticks - task_init_ticks));
 
 	task_t test_task;
 	uint64_t res = __fork64_switch(kernel_task, kernel_task);
@@ -176,7 +201,17 @@ void kernel_init (struct boot_args *boot_args, uint64_t x1, uint64_t x2)
 	kprintf("kernel_init complete\n");
 
 	//__asm__ volatile ("brk #1");
-	__asm__ volatile ("b .");
+
+	/**
+	 * nothing left to run, use idle time to finish initialising the page
+	 * metadata and then to pre-zero pages.
+	*/
+	while (1) {
+		if (vm_page_deferred_init (1))
+			continue;
+		if (!vm_page_zero_pool_refill (VM_PAGE_ZERO_POOL_BATCH))
+			__asm__ volatile ("wfi");
+	}
 }
 
 void print_boot_banner (const DTNode *dt_root, cpu_number_t cpu_num, 
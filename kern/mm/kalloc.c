@@ -0,0 +1,163 @@
+//===----------------------------------------------------------------------===//
+//
+//                                  tinyOS
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//	Copyright (C) 2024, Harry Moulton <me@h3adsh0tzz.com>
+//
+//===----------------------------------------------------------------------===//
+
+#include <tinylibc/string.h>
+
+#include <kern/vm/vm_types.h>
+#include <kern/vm/vm_page.h>
+#include <kern/vm/vm_map.h>
+#include <kern/vm/pmap.h>
+#include <kern/vm/vm.h>
+#include <kern/mm/zalloc.h>
+#include <kern/mm/kalloc.h>
+
+#include <libkern/panic.h>
+
+/* maximum size of each size class zone */
+#define KALLOC_ZONE_MAX_SIZE		(256 * VM_PAGE_SIZE)
+
+/**
+ * Size classes, and the zone backing each one. The names are kept here as the
+ * zone only holds a pointer to them.
+*/
+static const struct kalloc_class {
+	vm_size_t		size;
+	const char		*name;
+} kalloc_classes[KALLOC_NUM_CLASSES] = {
+	{ 16,	"kalloc.16" },
+	{ 32,	"kalloc.32" },
+	{ 48,	"kalloc.48" },
+	{ 64,	"kalloc.64" },
+	{ 96,	"kalloc.96" },
+	{ 128,	"kalloc.128" },
+	{ 192,	"kalloc.192" },
+	{ 256,	"kalloc.256" },
+	{ 384,	"kalloc.384" },
+	{ 512,	"kalloc.512" },
+	{ 768,	"kalloc.768" },
+	{ 1024,	"kalloc.1024" },
+};
+
+static zone_t	*kalloc_zones[KALLOC_NUM_CLASSES];
+
+/**
+ * Size class for each KALLOC_LOOKUP_SHIFT sized step, so a size is mapped to
+ * its zone with a single table lookup rather than a search.
+*/
+static uint8_t	kalloc_lookup[KALLOC_LOOKUP_SIZE];
+
+/* large allocations, which are backed by pages */
+static uint64_t	kalloc_large_count;
+static uint64_t	kalloc_large_size;
+
+#define __kalloc_lookup_idx(_size)	\
+	(((_size) + (1 << KALLOC_LOOKUP_SHIFT) - 1) >> KALLOC_LOOKUP_SHIFT)
+
+/**
+ * kalloc_init
+ * 
+ * Create the zones for each size class, and build the size lookup table. The
+ * zone allocator must already be initialised.
+*/
+kern_return_t kalloc_init()
+{
+	int class = 0;
+
+	for (int i = 0; i < KALLOC_NUM_CLASSES; i++) {
+		kalloc_zones[i] = zone_create(kalloc_classes[i].size,
+			KALLOC_ZONE_MAX_SIZE, kalloc_classes[i].name);
+	}
+
+	/* each lookup entry is the smallest class which can hold that size */
+	for (int i = 0; i < KALLOC_LOOKUP_SIZE; i++) {
+		while (kalloc_classes[class].size < (i << KALLOC_LOOKUP_SHIFT))
+			class += 1;
+		kalloc_lookup[i] = class;
+	}
+
+	kalloc_log("created '%d' size classes, up to '%d' bytes\n",
+		KALLOC_NUM_CLASSES, KALLOC_MAX_SIZE);
+	return KERN_RETURN_SUCCESS;
+}
+
+/**
+ * kalloc
+ * 
+ * Allocate zeroed kernel memory of at least the given size, or return NULL if
+ * the allocation could not be made. Small allocations are taken from the size
+ * class zones, and anything larger than KALLOC_MAX_SIZE is given whole pages.
+*/
+void *kalloc(vm_size_t size)
+{
+	vm_address_t addr;
+
+	if (size == 0)
+		return NULL;
+
+	if (size <= KALLOC_MAX_SIZE)
+		return zalloc(kalloc_zones[kalloc_lookup[__kalloc_lookup_idx(size)]]);
+
+	addr = vm_map_alloc(vm_get_kernel_map(), VM_PAGE_ROUND(size), VM_NULL);
+	if (vm_is_address_valid(addr) != KERN_RETURN_SUCCESS)
+		return NULL;
+
+	kalloc_large_count += 1;
+	kalloc_large_size += VM_PAGE_ROUND(size);
+	return (void *) addr;
+}
+
+/**
+ * kfree
+ * 
+ * Free memory allocated by kalloc. The size must be the same as was passed to
+ * kalloc, as it decides which zone the memory is returned to.
+*/
+void kfree(void *addr, vm_size_t size)
+{
+	if (addr == NULL || size == 0)
+		return;
+
+	if (size <= KALLOC_MAX_SIZE) {
+		zfree(kalloc_zones[kalloc_lookup[__kalloc_lookup_idx(size)]],
+			(vm_address_t) addr);
+		return;
+	}
+
+	vm_map_deallocate(vm_get_kernel_map(), (vm_address_t) addr,
+		VM_PAGE_ROUND(size));
+
+	kalloc_large_count -= 1;
+	kalloc_large_size -= VM_PAGE_ROUND(size);
+}
+
+/**
+ * kalloc_dump
+ * 
+ * Dump each size class zone, and the large allocations.
+*/
+void kalloc_dump()
+{
+	for (int i = 0; i < KALLOC_NUM_CLASSES; i++)
+		zone_dump(kalloc_zones[i]);
+
+	kprintf("kalloc large: '%d' allocations, '%d' bytes\n",
+		kalloc_large_count, kalloc_large_size);
+}
@@ -0,0 +1,62 @@
+//===----------------------------------------------------------------------===//
+//
+//                                  tinyOS
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//	Copyright (C) 2024, Harry Moulton <me@h3adsh0tzz.com>
+//
+//===----------------------------------------------------------------------===//
+
+/**
+ * Name:	kalloc.h
+ * Desc:	General purpose kernel memory allocator. Small allocations are
+ * 			served from a set of size class zones, and larger ones are given
+ * 			whole pages from the kernel vm_map. Based on Mach's kalloc.h
+*/
+
+#ifndef __KERN_KALLOC_H__
+#define __KERN_KALLOC_H__
+
+#include <tinylibc/stdint.h>
+
+#include <libkern/types.h>
+
+#include <kern/kprintf.h>
+#include <kern/vm/vm_types.h>
+
+/* Interface logger */
+#define kalloc_log(fmt, ...)		interface_log("kalloc", fmt, ##__VA_ARGS__)
+
+/**
+ * Size classes are powers of two from KALLOC_MIN_SIZE, with a class half way
+ * between each pair above 32 bytes, so no more than a third of an element is
+ * wasted. Requests larger than KALLOC_MAX_SIZE are rounded up to pages.
+*/
+#define KALLOC_MIN_SIZE				16
+#define KALLOC_MAX_SIZE				1024
+#define KALLOC_NUM_CLASSES			12
+
+/* Sizes are mapped to classes with a lookup table at this granularity */
+#define KALLOC_LOOKUP_SHIFT			4
+#define KALLOC_LOOKUP_SIZE			((KALLOC_MAX_SIZE >> KALLOC_LOOKUP_SHIFT) + 1)
+
+extern kern_return_t kalloc_init();
+
+extern void *kalloc(vm_size_t size);
+extern void kfree(void *addr, vm_size_t size);
+
+extern void kalloc_dump();
+
+#endif /* __kern_kalloc_h__ */
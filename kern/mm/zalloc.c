@@ -19,36 +19,75 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <tinylibc/string.h>
+
 #include <kern/vm/vm_types.h>
 #include <kern/vm/vm_page.h>
 #include <kern/vm/vm_map.h>
+#include <kern/vm/pmap.h>
 #include <kern/mm/zalloc.h>
+#include <kern/cpu.h>
+#include <kern/machine/machine_timer.h>
 
 #include <libkern/bitmap.h>
 #include <libkern/panic.h>
 
 unsigned int	num_zones_used;
+static integer_t	zone_next_index;
+
+/* data cache line size, from CTR_EL0 */
+static vm_size_t	zone_cache_line;
+
+/* registry of every zone, including the bootstrap zones */
+static list_t	zones;
+
+/**
+ * Bootstrap zones. Zone descriptors and magazines are allocated from these two
+ * zones, which are themselves static and never have magazines of their own.
+*/
+static zone_t	zone_zone;
+static zone_t	magazine_zone;
+
+#define ZONE_ZONE_MAX_SIZE			(64 * VM_PAGE_SIZE)
+#define MAGAZINE_ZONE_MAX_SIZE		(512 * VM_PAGE_SIZE)
+
+/**
+ * zone_gc is the page allocator's reclaim callback, so it can be called while
+ * a zone is growing or while zone_gc itself is freeing pages. It does nothing
+ * while this is non-zero.
+*/
+static uint32_t	zone_gc_busy;
+
+#if ZALLOC_GUARD_SAMPLING
+/**
+ * Guarded allocation slots, and the range of virtual memory they cover, so zfree
+ * can tell whether an element was sampled with a single range check.
+*/
+static zone_guard_slot_t	zone_guard_slots[ZALLOC_GUARD_SLOTS];
+static uint32_t				zone_guard_next;
+static vm_address_t			zone_guard_lo, zone_guard_hi;
 
-#define MAX_NUM_ZONES	12
-static zone_t	zone_array[MAX_NUM_ZONES];
+/* allocations per sample, and a countdown to the next sample for each cpu */
+static uint32_t				zone_guard_rate = ZALLOC_GUARD_DEFAULT_RATE;
+static struct {
+	uint32_t	countdown;
+} __attribute__((aligned(ZONE_CPU_CACHE_ALIGN))) zone_guard_cpu[DEFAULTS_MACHINE_MAX_CPUS];
+#endif
 
 static void zone_dump_all()
 {
-	zalloc_log("dumping '%d' zones:\n", num_zones_used);
-	for (int i = 0; i < MAX_NUM_ZONES; i++) {
-		zone_t *tmp = &(zone_array[i]);
-		if (tmp->state == ZONE_STATE_UNUSED)
-			continue;
+	zone_t *tmp;
 
+	zalloc_log("dumping '%d' zones:\n", num_zones_used);
+	list_for_each_entry(tmp, &zones, link)
 		zone_dump(tmp);
-	}
 }
 
 void zalloc_tests()
 {
 	zalloc_log("starting zone allocator tests:\n");
 
-	kprintf("zone_alloc_metadata size: 0x%x\n", sizeof(struct zone_alloc_metadata));
+	kprintf("zone element minimum size: 0x%x\n", ZONE_ELEM_MIN_SIZE);
 
 	struct element_test {
 		uint64_t val_1;
@@ -84,11 +123,22 @@ void zalloc_tests()
 	zone_dump_all();
 
 	// be awkward and free the middle one
-	zfree(test_zone, elem_2);
+	zfree(test_zone, (vm_address_t) elem_2);
 
 	// dump the zones again
 	zone_dump_all();
 
+	// free the rest, and return the now empty pages
+	zfree(test_zone, (vm_address_t) elem_1);
+	zfree(test_zone, (vm_address_t) elem_3);
+	kprintf("zone_gc freed '%d' pages\n", zone_gc());
+	zone_dump_all();
+	zone_dump_summary();
+
+	// find a zone by name, then destroy the empty one
+	kprintf("zone_find: 0x%lx\n", zone_find("test_element2"));
+	kprintf("zone_destroy: %d\n", zone_destroy(test_zone_2));
+
 	// try and free a zone that is already free
 //	kprintf ("double free'ing zone element: 0x%lx\n", elem_2);
 //	zfree(test_zone, elem_2);
@@ -96,55 +146,287 @@ void zalloc_tests()
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/* free list link, and the free cookie after it, of an element */
+#define __zone_elem_link(_zone, _elem)	\
+	((vm_address_t *) ((_elem) + (_zone)->link_offset))
+
+/* push an element onto a page's free list, marking it as free */
+static inline void __zone_free_push(zone_t *zone, zone_page_t *page,
+									vm_address_t elem)
+{
+	__zone_elem_link(zone, elem)[0] = page->free_head;
+#if ZALLOC_CHECK_DOUBLE_FREE
+	__zone_elem_link(zone, elem)[1] = ZONE_ELEM_FREE_MAGIC ^ elem;
+#endif
+	page->free_head = elem;
+	page->count_free += 1;
+}
+
+/* find the page header for an element */
+static inline zone_page_t *__zone_page_get(vm_address_t elem)
+{
+	return (zone_page_t *) (elem & ~(VM_PAGE_SIZE - 1));
+}
+
+/* sum the per-cpu allocation, free, failure and cached element counts */
+static void __zone_count_ops(zone_t *zone, uint64_t *allocs, uint64_t *frees,
+								uint64_t *fails, uint64_t *cached)
+{
+	*allocs = *frees = *fails = *cached = 0;
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++) {
+		zone_cpu_cache_t *cache = &zone->cpu_caches[i];
+
+		*allocs += cache->hits + cache->misses;
+		*frees += cache->frees;
+		*fails += cache->fails;
+		if (cache->loaded)
+			*cached += cache->loaded->count + cache->previous->count;
+	}
+}
+
+#if ZALLOC_STATS_LATENCY
+/* sum the per-cpu latency histograms for a zone */
+static void __zone_sum_latency(zone_t *zone, uint32_t *alloc, uint32_t *free)
+{
+	memset(alloc, 0, sizeof(uint32_t) * ZONE_LATENCY_BUCKETS);
+	memset(free, 0, sizeof(uint32_t) * ZONE_LATENCY_BUCKETS);
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++) {
+		zone_cpu_cache_t *cache = &zone->cpu_caches[i];
+
+		for (int j = 0; j < ZONE_LATENCY_BUCKETS; j++) {
+			alloc[j] += cache->alloc_latency[j];
+			free[j] += cache->free_latency[j];
+		}
+	}
+}
+
+/* upper bound, in ticks, of the bucket holding the given percentile */
+static uint64_t __zone_latency_percentile(uint32_t *hist, int pct)
+{
+	uint64_t total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < ZONE_LATENCY_BUCKETS; i++)
+		total += hist[i];
+
+	for (i = 0; i < ZONE_LATENCY_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen * 100 >= total * pct)
+			break;
+	}
+	return (1UL << i) - 1;
+}
+
+static void __zone_dump_latency(const char *op, uint32_t *hist)
+{
+	kprintf("  %s latency (ticks):", op);
+	for (int i = 0; i < ZONE_LATENCY_BUCKETS; i++)
+		if (hist[i])
+			kprintf(" <%d: %d", 1 << i, hist[i]);
+	kprintf("\n");
+}
+#endif
+
 /**
- * zone_debug_dump
+ * zone_dump
  * 
- * Dump the contents of a specified zone
+ * Dump the contents and statistics of a specified zone
 */
 void zone_dump(zone_t *zone)
 {
-	struct zone_alloc_metadata *meta;
-	vm_size_t msize;
+	zone_page_t *page;
+	uint64_t allocs, frees, fails, cached;
+#if ZALLOC_STATS_LATENCY
+	uint32_t alloc_latency[ZONE_LATENCY_BUCKETS];
+	uint32_t free_latency[ZONE_LATENCY_BUCKETS];
+#endif
+
+	kprintf("zone[%d]: '%s', size: %d/%d, element size: %d\n", zone->index,
+		zone->name, zone->size, zone->max_size, zone->elem_size);
+	kprintf("  free: '%d', alloc: '%d', pages: '%d' (%d elements each)\n",
+		zone->count_free, zone->count, zone->page_count, zone->page_elems);
+	kprintf("  alignment: '%d', first element: '0x%x', colours: '%d'\n",
+		zone->elem_align, zone->elem_offset,
+		(zone->colour_max / zone->elem_align) + 1);
 
-	msize = sizeof(struct zone_alloc_metadata);
+	__zone_count_ops(zone, &allocs, &frees, &fails, &cached);
+	kprintf("  allocs: '%d', frees: '%d', failed: '%d', cached: '%d', high "
+		"water: '%d' elements, '%d' pages\n", allocs, frees, fails,
+		cached, zone->high_water, zone->page_high_water);
+	kprintf("  guarded samples: '%d'\n", zone->guard_samples);
+#if ZALLOC_STATS_LATENCY
+	__zone_sum_latency(zone, alloc_latency, free_latency);
+	__zone_dump_latency("alloc", alloc_latency);
+	__zone_dump_latency("free", free_latency);
+#endif
 
-	kprintf("zone[%d]: '%s', size: %d\n", zone->index, zone->name, zone->max_size);
-	kprintf("  free: '%d':\n", zone->count_free);
-	list_for_each_entry(meta, &zone->free_elems, alloc) {
-		vm_address_t addr = meta;
-		kprintf("    meta: 0x%lx | element: 0x%lx\n", meta, addr + msize);
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++) {
+		zone_cpu_cache_t *cache = &zone->cpu_caches[i];
+		if (cache->loaded == NULL)
+			continue;
+
+		kprintf("    cpu %d: magazines: %d/%d, hits: %d, misses: %d, "
+			"frees: %d\n", i, cache->loaded->count, cache->previous->count,
+			cache->hits, cache->misses, cache->frees);
 	}
 
-	kprintf("  alloc: '%d':\n", zone->count);
-	list_for_each_entry(meta, &zone->used_elems, alloc) {
-		vm_address_t addr = meta;
-		kprintf("    meta: 0x%lx | element: 0x%lx\n", meta, addr + msize);
+	list_for_each_entry(page, &zone->pages_partial, link)
+		kprintf("    partial page: 0x%lx, %d free\n", page, page->count_free);
+	list_for_each_entry(page, &zone->pages_full, link)
+		kprintf("    full page: 0x%lx\n", page);
+	list_for_each_entry(page, &zone->pages_empty, link)
+		kprintf("    empty page: 0x%lx\n", page);
+}
+
+/**
+ * zone_dump_summary
+ * 
+ * Dump one line of statistics for every zone. The peak element count includes
+ * elements cached in magazines, and latencies are the p50/p99 histogram bucket
+ * bounds.
+*/
+void zone_dump_summary()
+{
+	uint64_t allocs, frees, fails, cached;
+#if ZALLOC_STATS_LATENCY
+	uint32_t alloc_latency[ZONE_LATENCY_BUCKETS];
+	uint32_t free_latency[ZONE_LATENCY_BUCKETS];
+#endif
+	zone_t *zone;
+
+	kprintf("%-16s %-6s %-8s %-8s %-8s %-8s %-6s %-6s %-10s %-10s %-6s %s\n",
+		"zone", "size", "inuse", "cached", "free", "peak", "pages", "peak",
+		"allocs", "frees", "fails", "latency alloc/free");
+
+	list_for_each_entry(zone, &zones, link) {
+		__zone_count_ops(zone, &allocs, &frees, &fails, &cached);
+		kprintf("%-16s %-6d %-8d %-8d %-8d %-8d %-6d %-6d %-10d %-10d %-6d ",
+			zone->name, zone->elem_size, zone->count - cached, cached,
+			zone->count_free, zone->high_water, zone->page_count,
+			zone->page_high_water, allocs, frees, fails);
+#if ZALLOC_STATS_LATENCY
+		__zone_sum_latency(zone, alloc_latency, free_latency);
+		kprintf("%d/%d %d/%d\n",
+			__zone_latency_percentile(alloc_latency, 50),
+			__zone_latency_percentile(alloc_latency, 99),
+			__zone_latency_percentile(free_latency, 50),
+			__zone_latency_percentile(free_latency, 99));
+#else
+		kprintf("-\n");
+#endif
 	}
 }
 
+/* round a size up to an alignment, which must be a power of two */
+#define __zone_align(_size, _align)		(((_size) + (_align) - 1) & ~((_align) - 1))
+
+/* resolve ZONE_ALIGN_CACHE_LINE, and keep the free list links aligned */
+static inline vm_size_t __zone_resolve_align(vm_size_t align)
+{
+	if (align == ZONE_ALIGN_CACHE_LINE)
+		align = zone_cache_line;
+	return (align < ZONE_ALIGN_DEFAULT) ? ZONE_ALIGN_DEFAULT : align;
+}
+
+/**
+ * round an element size up, so it can hold the free list link and cookie. if
+ * the object is kept constructed, the link goes after it instead of over it.
+*/
+static inline vm_size_t __zone_elem_size(vm_size_t size, vm_size_t align,
+											int constructed)
+{
+	if (constructed)
+		size = __zone_align(size, ZONE_ALIGN_DEFAULT) + ZONE_ELEM_MIN_SIZE;
+	else if (size < ZONE_ELEM_MIN_SIZE)
+		size = ZONE_ELEM_MIN_SIZE;
+	return __zone_align(size, align);
+}
+
+/* work out where elements go within a zone page */
+static void __zone_layout(zone_t *zone)
+{
+	int constructed = (zone->ctor || zone->dtor);
+
+	zone->elem_size = __zone_elem_size(zone->obj_size, zone->elem_align,
+		constructed);
+	zone->link_offset = (constructed) ?
+		__zone_align(zone->obj_size, ZONE_ALIGN_DEFAULT) : 0;
+
+	zone->elem_offset = __zone_align(ZONE_PAGE_HEADER_SIZE, zone->elem_align);
+	zone->page_elems = (VM_PAGE_SIZE - zone->elem_offset) / zone->elem_size;
+
+	/* whatever's left at the end of a page is used for colouring */
+	zone->colour_max = VM_PAGE_SIZE - zone->elem_offset -
+		(zone->page_elems * zone->elem_size);
+	zone->colour_next = 0;
+}
+
+/* set up a zone descriptor, and add it to the registry */
+static void __zone_init_desc(zone_t *zone, vm_size_t size, vm_size_t max,
+								vm_size_t align, const char *name)
+{
+	memset(zone, '\0', sizeof(zone_t));
+
+	zone->obj_size = size;
+	zone->elem_align = align;
+	__zone_layout(zone);
+
+	/* the zone grows until it can hold max_size bytes of elements */
+	zone->max_size = max;
+
+	INIT_LIST_HEAD(&zone->pages_partial);
+	INIT_LIST_HEAD(&zone->pages_full);
+	INIT_LIST_HEAD(&zone->pages_empty);
+
+	/* magazines are allocated when each cpu first uses the zone */
+	zone->mag_depth = ZONE_MAGAZINE_DEFAULT_DEPTH;
+
+	zone->index = zone_next_index++;
+	zone->name = name;
+
+	zone->state = ZONE_STATE_USED;
+	list_add_tail(&zone->link, &zones);
+	num_zones_used += 1;
+}
+
 /**
  * zone_init
  * 
- * Initialise the zone_array with empty zone_t's with their states set to
- * ZONE_STATE_UNUSED. When a zone is created, it will go from 0..N and use the
- * first unused zone structure, so they need to be initialised.
+ * Initialise the zone registry, and the bootstrap zones which every other zone
+ * descriptor, and every magazine, are allocated from.
  */
 kern_return_t zone_init()
 {
+	vm_size_t align;
+
 	/**
 	 * we track the number of used zones, although there isn't much use for this
 	 * tracking yet.
 	*/
 	num_zones_used = 0;
+	zone_next_index = 0;
+	INIT_LIST_HEAD(&zones);
 
-	/* init each zone */
-	for (int i = 0; i < MAX_NUM_ZONES; i++) {
-		zone_t *zone = &(zone_array[i]);
+	zone_cache_line = cpu_get_cache_line_size();
 
-		/* memset each zone, and only set it's 'state' flag */
-		memset(zone, '\0', sizeof(zone_t));
-		zone->state = ZONE_STATE_UNUSED;
-	}
+	/**
+	 * the bootstrap zones can't have magazines, as they would be recursive.
+	 * zone descriptors must also be aligned for their per-cpu caches.
+	*/
+	align = __zone_resolve_align(ZONE_ALIGN_CACHE_LINE);
+
+	__zone_init_desc(&zone_zone, sizeof(zone_t), ZONE_ZONE_MAX_SIZE,
+		(align < __alignof__(zone_t)) ? __alignof__(zone_t) : align, "zones");
+	zone_zone.mag_depth = 0;
+
+	__zone_init_desc(&magazine_zone, sizeof(zone_magazine_t),
+		MAGAZINE_ZONE_MAX_SIZE, align, "zone.magazines");
+	magazine_zone.mag_depth = 0;
+
+	zone_guard_set_rate(ZALLOC_GUARD_DEFAULT_RATE);
+
+	/* empty zone pages are returned when the page allocator runs out */
+	vm_page_set_reclaim(zone_gc);
 
 	return KERN_RETURN_SUCCESS;
 }
@@ -152,132 +434,571 @@ kern_return_t zone_init()
 /**
  * zone_create
  * 
- * Creates a new zone for the specified data structure size, and allocates enough
- * pages for the desired zone size, plus metadata structures.
+ * Creates a new, empty zone for the specified data structure size, with the
+ * default alignment. Memory is only allocated for the zone once elements are
+ * allocated from it. The name isn't copied, so it must outlive the zone.
 */
 zone_t *zone_create(vm_size_t size, vm_size_t max, const char *name)
 {
-	vm_address_t	zone_page_base;
-	vm_size_t		zone_block_size;
-	zone_t			*zone;
-	int				zidx;
-
-	zalloc_log("creating zone '%s' for alloc size '%d', and max size '%d'\n",
-		name, size, max);
+	return zone_create_aligned(size, max, ZONE_ALIGN_DEFAULT, name);
+}
 
-	/* find the first available zone descriptor */
-	for (zidx = 0; zidx < MAX_NUM_ZONES; zidx++) {
-		zone = &(zone_array[zidx]);
-		if (zone->state == ZONE_STATE_UNUSED)
-			break;
+/**
+ * zone_create_aligned
+ * 
+ * Creates a new, empty zone as with zone_create, with every element aligned to
+ * the given power of two, or the data cache line size for ZONE_ALIGN_CACHE_LINE.
+*/
+zone_t *zone_create_aligned(vm_size_t size, vm_size_t max, vm_size_t align,
+							const char *name)
+{
+	zone_t			*zone;
 
-		/* if one wasn't found, reset the zone to ZONE_NULL */
-		zone = ZONE_NULL;
-	}
+	zalloc_log("creating zone '%s' for alloc size '%d', max size '%d', and "
+		"alignment '%d'\n", name, size, max, align);
 
-	/* ensure that a zone was found */
-	if (zone == ZONE_NULL) {
-		panic("failed to allocate a zone for '%s': no available zones\n", name);
+	/* ensure the alignment is valid */
+	align = __zone_resolve_align(align);
+	if (align & (align - 1)) {
+		panic("failed to allocate a zone for '%s': invalid alignment: %d\n",
+			name, align);
 		return ZONE_NULL;
 	}
 
-	/* ensure the element size is valid */
-	if (size == 0) {
-		panic("failed to allocate a zoen for '%s': invalid element size: %d\n",
-			size);
+	/* ensure the element size is valid, and at least one fits in a page */
+	if (size == 0 || __zone_align(ZONE_PAGE_HEADER_SIZE, align) +
+		__zone_elem_size(size, align, 0) > VM_PAGE_SIZE) {
+		panic("failed to allocate a zone for '%s': invalid element size: %d\n",
+			name, size);
 		return ZONE_NULL;
 	}
 
 	/* ensure the maximum zone size is valid */
 	if (max == 0) {
 		panic("failed to allocate a zone for '%s': invalid max zone size: %d\n",
-			max);
+			name, max);
 		return ZONE_NULL;
 	}
 
-	zone->elem_size = size;
-	zone->count_free = (max / zone->elem_size);
-	zone->count = 0;
+	/* allocate the descriptor from the zone of zones */
+	zone = zalloc(&zone_zone);
+	if (zone == ZONE_NULL) {
+		panic("failed to allocate a zone for '%s': no available zones\n", name);
+		return ZONE_NULL;
+	}
 
-	/**
-	 * the maximum zone size is calculated without taking into account the zone
-	 * element metadata, it only represents how much pure data is contained in
-	 * the zone.
-	*/
-	zone->max_size = zone->count_free * zone->elem_size;
-	zone->size = 0;
+	__zone_init_desc(zone, size, max, align, name);
+	return zone;
+}
+
+/**
+ * zone_set_ctor
+ * 
+ * Set the object constructor and destructor for a zone. Either may be NULL.
+ * This changes the layout of the zone's pages, so it must be done before the
+ * zone has any pages.
+*/
+kern_return_t zone_set_ctor(zone_t *zone, zone_ctor_t ctor, zone_dtor_t dtor)
+{
+	if (zone->page_count != 0) {
+		zalloc_log("error: cannot set constructor for zone '%s': zone is in use\n",
+			zone->name);
+		return KERN_RETURN_FAIL;
+	}
+
+	zone->ctor = ctor;
+	zone->dtor = dtor;
+	__zone_layout(zone);
+
+	if (zone->page_elems == 0) {
+		panic("failed to set constructor for zone '%s': element size '%d' "
+			"too large\n", zone->name, zone->elem_size);
+	}
+	return KERN_RETURN_SUCCESS;
+}
+
+/**
+ * zone_find
+ * 
+ * Find a zone by name, or return ZONE_NULL if there isn't one.
+*/
+zone_t *zone_find(const char *name)
+{
+	zone_t *zone;
+
+	list_for_each_entry(zone, &zones, link)
+		if (strcmp(zone->name, name) == 0)
+			return zone;
+
+	return ZONE_NULL;
+}
+
+/**
+ * zone_grow
+ * 
+ * Add a new page of free elements to a zone, unless the zone has reached its
+ * maximum size. The page is added to the zone's empty list.
+*/
+static kern_return_t zone_grow(zone_t *zone)
+{
+	vm_address_t	base;
+	zone_page_t		*page;
+
+	if ((zone->count + zone->count_free) * zone->elem_size >= zone->max_size)
+		return KERN_RETURN_FAIL;
+
+	/* the kernel map is part way through an update until vm_map_alloc returns */
+	zone_gc_busy += 1;
+	base = vm_map_alloc(vm_get_kernel_map(), VM_PAGE_SIZE, VM_NULL);
+	zone_gc_busy -= 1;
+
+	if (vm_is_address_valid(base) != KERN_RETURN_SUCCESS)
+		return KERN_RETURN_FAIL;
+
+	page = (zone_page_t *) base;
+	page->zone = zone;
+	page->free_head = 0;
+	page->count_free = 0;
+
+	/* offset this page's elements by the next colour */
+	base += zone->elem_offset + zone->colour_next;
+	zone->colour_next += zone->elem_align;
+	if (zone->colour_next > zone->colour_max)
+		zone->colour_next = 0;
 
 	/**
-	 * when calculating the number of pages, we do need to take into account the
-	 * zone metadata structures. this is the number of pages we need to request
-	 * from the vm allocator.
-	 * 
-	 * If the total required size, divided by the page size comes to less than
-	 * one page, use one page as a minimum.
+	 * thread every element onto the free list. they're pushed in reverse so
+	 * the first allocation gets the lowest address.
 	*/
-	zone->page_count = (zone->max_size + 
-		(max * sizeof(struct zone_alloc_metadata))) / VM_PAGE_SIZE;
-	if (zone->page_count == 0)
-		zone->page_count = 1;
+	for (int i = zone->page_elems - 1; i >= 0; i--)
+		__zone_free_push(zone, page, base + (i * zone->elem_size));
 
-	/* initialise the free and used lists */
-	INIT_LIST_HEAD(&zone->free_elems);
-	INIT_LIST_HEAD(&zone->used_elems);
+	/* construct every object once, as the page is added */
+	if (zone->ctor)
+		for (int i = 0; i < zone->page_elems; i++)
+			zone->ctor((void *) (base + (i * zone->elem_size)));
 
-	zone->index = zidx;
-	zone->name = name;
+	list_add(&page->link, &zone->pages_empty);
+
+	zone->page_count += 1;
+	zone->size += VM_PAGE_SIZE;
+	zone->count_free += zone->page_elems;
+	if (zone->page_count > zone->page_high_water)
+		zone->page_high_water = zone->page_count;
+
+	zalloc_log("zone '%s' grew to %d pages\n", zone->name, zone->page_count);
+	return KERN_RETURN_SUCCESS;
+}
+
+/**
+ * zone_alloc_elem
+ * 
+ * Take a free element from the zone's pages, growing the zone if needed. The
+ * element is left marked as free, or NULL is returned if the zone is full.
+*/
+static vm_address_t zone_alloc_elem(zone_t *zone)
+{
+	zone_page_t		*page;
+	vm_address_t	elem;
+
+	/* prefer partially used pages, so that empty pages can be reclaimed */
+	if (!list_empty(&zone->pages_partial)) {
+		page = list_first_entry(&zone->pages_partial, zone_page_t, link);
+	} else {
+		if (list_empty(&zone->pages_empty) && zone_grow(zone) != KERN_RETURN_SUCCESS) {
+			zalloc_log("zone '%s' has no free elements\n", zone->name);
+			return 0;
+		}
+		page = list_first_entry(&zone->pages_empty, zone_page_t, link);
+	}
+
+	/* pop the first element from the page's free list */
+	elem = page->free_head;
+	page->free_head = __zone_elem_link(zone, elem)[0];
+
+	/* move the page between lists as it fills up */
+	page->count_free -= 1;
+	if (page->count_free == 0)
+		list_move(&page->link, &zone->pages_full);
+	else if (page->count_free == zone->page_elems - 1)
+		list_move(&page->link, &zone->pages_partial);
+
+	zone->count += 1;
+	zone->count_free -= 1;
+	if (zone->count > zone->high_water)
+		zone->high_water = zone->count;
+
+	return elem;
+}
+
+/**
+ * zone_free_elem
+ * 
+ * Return an element which has already been checked and cleared to its page.
+*/
+static void zone_free_elem(zone_t *zone, vm_address_t addr)
+{
+	zone_page_t		*page;
+
+	page = __zone_page_get(addr);
+	__zone_free_push(zone, page, addr);
+
+	if (page->count_free == zone->page_elems)
+		list_move(&page->link, &zone->pages_empty);
+	else if (page->count_free == 1)
+		list_move(&page->link, &zone->pages_partial);
+
+	zone->count -= 1;
+	zone->count_free += 1;
+}
+
+/* return every element in a magazine to the zone */
+static void __zone_magazine_empty(zone_t *zone, zone_magazine_t *mag)
+{
+	for (uint32_t i = 0; i < mag->count; i++)
+		zone_free_elem(zone, mag->rounds[i]);
+	mag->count = 0;
+}
+
+/* swap a cpu's loaded and previous magazines */
+static inline void __zone_magazine_swap(zone_cpu_cache_t *cache)
+{
+	zone_magazine_t *tmp = cache->loaded;
+	cache->loaded = cache->previous;
+	cache->previous = tmp;
+}
+
+/**
+ * check that a cpu has magazines for a zone, allocating them on first use.
+ * returns 0 if the zone has no magazines, or they couldn't be allocated.
+*/
+static int __zone_magazines_ready(zone_t *zone, zone_cpu_cache_t *cache)
+{
+	if (zone->mag_depth == 0)
+		return 0;
+
+	if (cache->loaded == NULL) {
+		cache->loaded = zalloc(&magazine_zone);
+		cache->previous = zalloc(&magazine_zone);
+
+		if (cache->loaded == NULL || cache->previous == NULL) {
+			zfree(&magazine_zone, (vm_address_t) cache->loaded);
+			zfree(&magazine_zone, (vm_address_t) cache->previous);
+			cache->loaded = cache->previous = NULL;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* start timing a zone operation */
+static inline uint64_t __zone_latency_start()
+{
+#if ZALLOC_STATS_LATENCY
+	return machine_timer_get_ticks();
+#else
+	return 0;
+#endif
+}
+
+/* add the time since start to a cpu's alloc or free latency histogram */
+static inline void __zone_latency_record(zone_cpu_cache_t *cache, int free,
+											uint64_t start)
+{
+#if ZALLOC_STATS_LATENCY
+	uint32_t *hist = (free) ? cache->free_latency : cache->alloc_latency;
+	uint64_t ticks = machine_timer_get_ticks() - start;
+	int bucket = (ticks) ? 64 - __builtin_clzl(ticks) : 0;
+
+	if (bucket >= ZONE_LATENCY_BUCKETS)
+		bucket = ZONE_LATENCY_BUCKETS - 1;
+	hist[bucket] += 1;
+#endif
+}
+
+/* take an element from a cpu's magazines, or from the zone */
+static vm_address_t __zalloc(zone_t *zone, zone_cpu_cache_t *cache)
+{
+	vm_address_t elem;
+
+	if (!__zone_magazines_ready(zone, cache)) {
+		cache->misses += 1;
+		elem = zone_alloc_elem(zone);
+		goto out;
+	}
+
+	if (cache->loaded->count == 0 && cache->previous->count != 0)
+		__zone_magazine_swap(cache);
+
+	if (cache->loaded->count) {
+		cache->hits += 1;
+		elem = cache->loaded->rounds[--cache->loaded->count];
+	} else {
+		/* both magazines are empty, fill the loaded one from the zone */
+		cache->misses += 1;
+		if ((elem = zone_alloc_elem(zone)) == 0)
+			return 0;
+
+		while (cache->loaded->count < zone->mag_depth) {
+			vm_address_t round = zone_alloc_elem(zone);
+			if (round == 0)
+				break;
+			cache->loaded->rounds[cache->loaded->count++] = round;
+		}
+	}
+
+out:
+	/* the link (and cookie) are the only parts of a free element to clear */
+	if (elem)
+		memset(__zone_elem_link(zone, elem), '\0', ZONE_ELEM_MIN_SIZE);
+	return elem;
+}
+
+/* give an element to a cpu's magazines, or back to the zone */
+static void __zfree(zone_t *zone, zone_cpu_cache_t *cache, vm_address_t addr)
+{
+	zone_page_t *page;
+
+	page = __zone_page_get(addr);
+	if (page->zone != zone) {
+		panic("failed to free element '0x%lx' from zone '%s': element does not exist in zone\n",
+			addr, zone->name);
+	}
 
-	/* allocate enough pages for this zone */
 	/**
-	 * note, because i'm lazy and can't be bothered to fix the issue with
-	 * vm_map_alloc yet, this is how we make sure the assigned address is actually
-	 * valid.
+	 * clear the element, unless it's kept constructed, and mark it as free
+	 * before it goes to a magazine.
 	*/
-	while (vm_is_address_valid(zone_page_base = vm_map_alloc(vm_get_kernel_map(),
-		zone->page_count * VM_PAGE_SIZE)) != KERN_RETURN_SUCCESS);
-	zalloc_log("zone: '%s': zone_page_base: 0x%lx\n", name, zone_page_base);
+#if ZALLOC_CHECK_DOUBLE_FREE
+	if (__zone_elem_link(zone, addr)[1] == (ZONE_ELEM_FREE_MAGIC ^ addr))
+		panic("double free of element '0x%lx' in zone '%s'\n", addr, zone->name);
+#endif
+
+	if (zone->link_offset == 0)
+		memset((void *) addr, '\0', zone->elem_size);
+
+#if ZALLOC_CHECK_DOUBLE_FREE
+	__zone_elem_link(zone, addr)[1] = ZONE_ELEM_FREE_MAGIC ^ addr;
+#endif
+
+	if (!__zone_magazines_ready(zone, cache)) {
+		zone_free_elem(zone, addr);
+		return;
+	}
 
 	/**
-	 * Each element in the zone has a zone_alloc_metadata structure containing
-	 * a list node. This is how free and used blocks are tracked. Before any
-	 * allocations can be made, these structures need to be created and added
-	 * to the zone free list.
+	 * if the loaded magazine is full, swap to the previous one. if that's full
+	 * too, it's emptied back into the zone first.
 	*/
-	zone_block_size = zone->elem_size + sizeof(struct zone_alloc_metadata);
-	for (int i = 0; i < zone->count_free; i++) {
-		struct zone_alloc_metadata *meta = (struct zone_alloc_metadata *)
-			(zone_page_base + (i * zone_block_size));
-		list_add_tail(&meta->alloc, &zone->free_elems);
+	if (cache->loaded->count >= zone->mag_depth) {
+		if (cache->previous->count)
+			__zone_magazine_empty(zone, cache->previous);
+		__zone_magazine_swap(cache);
 	}
+	cache->loaded->rounds[cache->loaded->count++] = addr;
+}
 
-	/* set the zone state, and return it */
-	zone->state = ZONE_STATE_USED;
-	return zone;
+#if ZALLOC_GUARD_SAMPLING
+/* count down to the next sampled allocation on this cpu */
+static inline int __zone_guard_should_sample(cpu_number_t cpu)
+{
+	if (__builtin_expect(--zone_guard_cpu[cpu].countdown != 0, 1))
+		return 0;
+
+	zone_guard_cpu[cpu].countdown = (zone_guard_rate) ? zone_guard_rate : UINT32_MAX;
+	return (zone_guard_rate != 0);
+}
+
+/* find the slot whose guarded region covers an address */
+static zone_guard_slot_t *__zone_guard_find(vm_address_t addr)
+{
+	for (int i = 0; i < ZALLOC_GUARD_SLOTS; i++) {
+		zone_guard_slot_t *slot = &zone_guard_slots[i];
+		if (slot->state != ZONE_GUARD_SLOT_UNUSED &&
+			addr >= slot->page - VM_PAGE_SIZE && addr < slot->page + 2 * VM_PAGE_SIZE)
+			return slot;
+	}
+	return NULL;
+}
+
+/**
+ * zone_guard_alloc
+ * 
+ * Place a sampled element at the end of a guarded slot's page, so that reading
+ * or writing past it faults. Returns 0 if every slot is in use, in which case
+ * the element comes from the zone as normal.
+*/
+static vm_address_t zone_guard_alloc(zone_t *zone, vm_address_t site)
+{
+	zone_guard_slot_t	*slot = NULL;
+	tt_table_t			*table;
+	uint32_t			idx;
+
+	/* reuse the least recently used slot, to keep freed pages unmapped longest */
+	for (int i = 0; i < ZALLOC_GUARD_SLOTS; i++) {
+		idx = (zone_guard_next + i) % ZALLOC_GUARD_SLOTS;
+		if (zone_guard_slots[idx].state != ZONE_GUARD_SLOT_ALLOCATED) {
+			slot = &zone_guard_slots[idx];
+			break;
+		}
+	}
+	if (slot == NULL)
+		return 0;
+
+	table = (tt_table_t *) vm_get_kernel_map()->pmap->tte;
+	if (slot->state == ZONE_GUARD_SLOT_UNUSED) {
+		slot->page = vm_map_alloc(vm_get_kernel_map(), VM_PAGE_SIZE,
+			VM_ALLOC_GUARD_FIRST | VM_ALLOC_GUARD_LAST);
+		if (vm_is_address_valid(slot->page) != KERN_RETURN_SUCCESS)
+			return 0;
+		slot->paddr = pmap_extract(table, slot->page);
+
+		if (zone_guard_lo == 0 || slot->page - VM_PAGE_SIZE < zone_guard_lo)
+			zone_guard_lo = slot->page - VM_PAGE_SIZE;
+		if (slot->page + 2 * VM_PAGE_SIZE > zone_guard_hi)
+			zone_guard_hi = slot->page + 2 * VM_PAGE_SIZE;
+	} else {
+		/* the page was unmapped when the last element was freed */
+		pmap_tt_create_tte(table, slot->paddr, slot->page, VM_PAGE_SIZE,
+			PMAP_ACCESS_READWRITE);
+		memset((void *) slot->page, '\0', VM_PAGE_SIZE);
+	}
+	zone_guard_next = idx + 1;
+
+	slot->zone = zone;
+	slot->elem = slot->page + VM_PAGE_SIZE -
+		__zone_align(zone->obj_size, zone->elem_align);
+	slot->alloc_site = site;
+	slot->free_site = 0;
+	slot->state = ZONE_GUARD_SLOT_ALLOCATED;
+
+	zone->guard_samples += 1;
+	if (zone->ctor)
+		zone->ctor((void *) slot->elem);
+
+	zalloc_log("sampled element 0x%lx from zone '%s', allocated at 0x%lx\n",
+		slot->elem, zone->name, site);
+	return slot->elem;
+}
+
+/**
+ * zone_guard_free
+ * 
+ * Free a sampled element, unmapping its page so any later access faults. The
+ * slot is only reused once the other slots have been.
+*/
+static void zone_guard_free(zone_t *zone, zone_guard_slot_t *slot,
+							vm_address_t addr, vm_address_t site)
+{
+	if (slot->elem != addr || slot->zone != zone) {
+		panic("failed to free element '0x%lx' from zone '%s': element does not exist in zone\n",
+			addr, zone->name);
+	}
+
+	if (slot->state == ZONE_GUARD_SLOT_FREED) {
+		panic("double free of element '0x%lx' in zone '%s', allocated at 0x%lx, "
+			"first freed at 0x%lx\n", addr, zone->name, slot->alloc_site,
+			slot->free_site);
+	}
+
+	if (zone->dtor)
+		zone->dtor((void *) addr);
+
+	slot->free_site = site;
+	slot->state = ZONE_GUARD_SLOT_FREED;
+	pmap_tt_remove_tte((tt_table_t *) vm_get_kernel_map()->pmap->tte,
+		slot->page, VM_PAGE_SIZE);
+}
+#endif
+
+/**
+ * zone_guard_set_rate
+ * 
+ * Sample one in every rate allocations into a guarded slot, or none if the rate
+ * is zero. Has no effect unless ZALLOC_GUARD_SAMPLING is enabled.
+*/
+void zone_guard_set_rate(uint32_t rate)
+{
+#if ZALLOC_GUARD_SAMPLING
+	zone_guard_rate = rate;
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++)
+		zone_guard_cpu[i].countdown = (rate) ? rate : UINT32_MAX;
+#endif
+}
+
+/**
+ * zone_guard_report
+ * 
+ * Called on a translation fault. If the address is within a guarded slot, the
+ * fault is reported along with where the element was allocated and freed, and
+ * KERN_RETURN_SUCCESS is returned so the caller can panic.
+*/
+kern_return_t zone_guard_report(vm_address_t addr)
+{
+#if ZALLOC_GUARD_SAMPLING
+	zone_guard_slot_t	*slot;
+	const char			*kind;
+
+	if (addr < zone_guard_lo || addr >= zone_guard_hi)
+		return KERN_RETURN_FAIL;
+	if ((slot = __zone_guard_find(addr)) == NULL)
+		return KERN_RETURN_FAIL;
+
+	if (addr < slot->page)
+		kind = "underflow";
+	else if (addr >= slot->page + VM_PAGE_SIZE)
+		kind = "overflow";
+	else
+		kind = "use after free";
+
+	kprintf("zalloc: guard fault at 0x%lx: %s of element 0x%lx (%d bytes) from zone '%s'\n",
+		addr, kind, slot->elem, (slot->zone) ? slot->zone->obj_size : 0,
+		(slot->zone) ? slot->zone->name : "(destroyed)");
+	kprintf("  allocated at: 0x%lx\n", slot->alloc_site);
+	if (slot->state == ZONE_GUARD_SLOT_FREED)
+		kprintf("  freed at: 0x%lx\n", slot->free_site);
+
+	return KERN_RETURN_SUCCESS;
+#else
+	return KERN_RETURN_FAIL;
+#endif
 }
 
 /**
  * zalloc
  * 
- * Allocate a new element within a specified zone and return the address.
+ * Allocate a new element within a specified zone and return the address, or
+ * NULL if the zone is full and can't grow.
+ * 
+ * NOTE: As with the per-CPU page caches, zalloc must not be called from
+ *		 interrupt context, as there is no locking between a CPU and its own
+ *		 interrupt handlers.
 */
 void *zalloc(zone_t *zone)
 {
-	struct zone_alloc_metadata	*meta;
-	vm_address_t				addr;
+	zone_cpu_cache_t	*cache;
+	vm_address_t		elem;
+	cpu_number_t		cpu;
+	uint64_t			start;
 
-	/**
-	 * this is a simple process: take the first entry within the freelist, move
-	 * it to the used list, update the counters and return the address of the
-	 * element (exactly after the zone metadata).
-	*/
-	meta = list_first_entry(&zone->free_elems, struct zone_alloc_metadata, alloc);
-	list_move(&meta->alloc, &zone->used_elems);
+	start = __zone_latency_start();
+	cpu = cpu_get_current_num();
 
-	zone->count += 1;
-	zone->count_free -= 1;
+#if ZALLOC_GUARD_SAMPLING
+	if (__zone_guard_should_sample(cpu) &&
+		(elem = zone_guard_alloc(zone, (vm_address_t) __builtin_return_address(0))))
+		goto out;
+#endif
+
+	cache = &zone->cpu_caches[cpu];
+	if ((elem = __zalloc(zone, cache)) == 0)
+		cache->fails += 1;
 
-	addr = (meta);
-	return (void *) (addr + sizeof(struct zone_alloc_metadata));
+#if ZALLOC_GUARD_SAMPLING
+out:
+#endif
+	__zone_latency_record(&zone->cpu_caches[cpu], 0, start);
+	return (void *) elem;
 }
 
 /**
@@ -287,31 +1008,196 @@ void *zalloc(zone_t *zone)
 */
 void zfree(zone_t *zone, vm_address_t addr)
 {
-	struct zone_alloc_metadata	*meta;
-	vm_address_t				meta_addr;
+	zone_cpu_cache_t	*cache;
+	uint64_t			start;
+#if ZALLOC_GUARD_SAMPLING
+	zone_guard_slot_t	*slot;
+#endif
 
-	/**
-	 * calculate the address of the element's metadata struct, and then loop
-	 * over the used list until we find it. at that point, we can clear the
-	 * elements (not the metadata struct though), and move the metadata into the
-	 * free list.
-	*/
-	meta_addr = addr - sizeof(struct zone_alloc_metadata);
+	if (addr == 0)
+		return;
 
-	list_for_each_entry(meta, &zone->used_elems, alloc) {
-		if (meta == meta_addr) {
-			memset(addr, '\0', zone->elem_size);
-			list_move(&meta->alloc, &zone->free_elems);
+	start = __zone_latency_start();
 
-			zone->count -= 1;
-			zone->count_free += 1;
+	cache = &zone->cpu_caches[cpu_get_current_num()];
+	cache->frees += 1;
 
-			break;
+#if ZALLOC_GUARD_SAMPLING
+	/* zone pages can be allocated between the slots, so check for a slot */
+	if (addr >= zone_guard_lo && addr < zone_guard_hi &&
+		(slot = __zone_guard_find(addr)) != NULL)
+		zone_guard_free(zone, slot, addr,
+			(vm_address_t) __builtin_return_address(0));
+	else
+#endif
+	__zfree(zone, cache, addr);
+
+	__zone_latency_record(cache, 1, start);
+}
+
+/**
+ * zone_drain
+ * 
+ * Return the elements in every CPU's magazines to the zone.
+ * 
+ * NOTE: This touches the magazines of other CPUs, so it's only safe when they
+ * 		 aren't using the zone, as with vm_page_cpu_cache_drain_all.
+*/
+void zone_drain(zone_t *zone)
+{
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++) {
+		zone_cpu_cache_t *cache = &zone->cpu_caches[i];
+		if (cache->loaded == NULL)
+			continue;
+
+		__zone_magazine_empty(zone, cache->loaded);
+		__zone_magazine_empty(zone, cache->previous);
+	}
+}
+
+/**
+ * zone_set_magazine_depth
+ * 
+ * Set the per-CPU magazine depth for a zone, up to ZONE_MAGAZINE_MAX_DEPTH. A
+ * depth of zero disables the magazines, so every operation uses the zone.
+*/
+void zone_set_magazine_depth(zone_t *zone, uint32_t depth)
+{
+	if (depth > ZONE_MAGAZINE_MAX_DEPTH)
+		depth = ZONE_MAGAZINE_MAX_DEPTH;
+
+	zone_drain(zone);
+	zone->mag_depth = depth;
+}
+
+/**
+ * zone_page_release
+ * 
+ * Unmap an empty zone page, and return it and its virtual address range to
+ * the kernel vm_map.
+*/
+static void zone_page_release(zone_t *zone, zone_page_t *page)
+{
+	list_del(&page->link);
+	zone->page_count -= 1;
+	zone->size -= VM_PAGE_SIZE;
+	zone->count_free -= zone->page_elems;
+
+	/* every element of an empty page is on its free list */
+	if (zone->dtor) {
+		vm_address_t elem = page->free_head;
+		while (elem) {
+			vm_address_t next = __zone_elem_link(zone, elem)[0];
+			zone->dtor((void *) elem);
+			elem = next;
 		}
+	}
+
+	vm_map_deallocate(vm_get_kernel_map(), (vm_address_t) page, VM_PAGE_SIZE);
+}
+
+/**
+ * zone_release_empty_pages
+ * 
+ * Release every empty page of a zone, and return the number released. Freeing
+ * a page can allocate from the vm_map and vmem zones, which may take elements
+ * from their own empty pages, so the pages are moved off the zone's lists
+ * before any of them are released.
+*/
+static uint64_t zone_release_empty_pages(zone_t *zone)
+{
+	zone_page_t		*page;
+	list_t			empty;
+	uint64_t		freed = 0;
+
+	INIT_LIST_HEAD(&empty);
+	list_splice_init(&zone->pages_empty, &empty);
+
+	while (!list_empty(&empty)) {
+		page = list_first_entry(&empty, zone_page_t, link);
+		zone_page_release(zone, page);
+		freed += 1;
+	}
+
+	return freed;
+}
+
+/**
+ * zone_destroy
+ * 
+ * Destroy a zone, returning its pages and magazines. Every element must have
+ * been freed first, otherwise the zone is left as it is.
+*/
+kern_return_t zone_destroy(zone_t *zone)
+{
+	if (zone == &zone_zone || zone == &magazine_zone) {
+		zalloc_log("error: cannot destroy bootstrap zone '%s'\n", zone->name);
+		return KERN_RETURN_FAIL;
+	}
+
+	zone_drain(zone);
+	if (zone->count != 0) {
+		zalloc_log("error: cannot destroy zone '%s': %d elements in use\n",
+			zone->name, zone->count);
+		return KERN_RETURN_FAIL;
+	}
+
+#if ZALLOC_GUARD_SAMPLING
+	for (int i = 0; i < ZALLOC_GUARD_SLOTS; i++) {
+		zone_guard_slot_t *slot = &zone_guard_slots[i];
+		if (slot->zone != zone)
+			continue;
 
-		if (list_is_last(meta, &zone->used_elems)) {
-			panic("failed to free elemtn '0x%lx' from zone '%s': element does not exist in zone\n",
-				addr, zone->name);
+		if (slot->state == ZONE_GUARD_SLOT_ALLOCATED) {
+			zalloc_log("error: cannot destroy zone '%s': sampled element 0x%lx "
+				"in use\n", zone->name, slot->elem);
+			return KERN_RETURN_FAIL;
 		}
+		slot->zone = NULL;
+	}
+#endif
+
+	zone_release_empty_pages(zone);
+
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++) {
+		zone_cpu_cache_t *cache = &zone->cpu_caches[i];
+		zfree(&magazine_zone, (vm_address_t) cache->loaded);
+		zfree(&magazine_zone, (vm_address_t) cache->previous);
 	}
+
+	zalloc_log("destroyed zone '%s'\n", zone->name);
+
+	list_del(&zone->link);
+	zone->state = ZONE_STATE_UNUSED;
+	num_zones_used -= 1;
+
+	zfree(&zone_zone, (vm_address_t) zone);
+	return KERN_RETURN_SUCCESS;
+}
+
+/**
+ * zone_gc
+ * 
+ * Return every empty zone page to the page allocator, and return the number of
+ * pages freed. This is registered as the page allocator's reclaim callback, so
+ * it's called when physical memory runs out.
+*/
+uint64_t zone_gc()
+{
+	zone_t			*zone;
+	uint64_t		freed = 0;
+
+	if (zone_gc_busy)
+		return 0;
+
+	zone_gc_busy += 1;
+	list_for_each_entry(zone, &zones, link) {
+		/* cached elements would keep their pages from being empty */
+		zone_drain(zone);
+		freed += zone_release_empty_pages(zone);
+	}
+	zone_gc_busy -= 1;
+
+	zalloc_log("zone_gc: freed %d pages\n", freed);
+	return freed;
 }
@@ -35,6 +35,7 @@
 #include <libkern/list.h>
 
 #include <kern/kprintf.h>
+#include <kern/defaults.h>
 #include <kern/vm/vm_types.h>
 
 /* Interface logger */
@@ -42,23 +43,148 @@
 
 #define ZONE_NULL					NULL
 
+/* Check for double frees by marking free elements with a cookie */
+#define ZALLOC_CHECK_DOUBLE_FREE	DEFAULTS_ENABLE
+#define ZONE_ELEM_FREE_MAGIC		0x5a4f4e4546524545
+
+/**
+ * Elements hold the free list link, and the free cookie when double free checks
+ * are enabled, so they can't be smaller than this. Element sizes are rounded up
+ * to a multiple of the link size to keep the links aligned.
+*/
+#if ZALLOC_CHECK_DOUBLE_FREE
+#define ZONE_ELEM_MIN_SIZE			(2 * sizeof(vm_address_t))
+#else
+#define ZONE_ELEM_MIN_SIZE			(sizeof(vm_address_t))
+#endif
+
+/**
+ * Optional object constructor and destructor. The constructor is called once
+ * for each element when a zone grows, and the destructor when an empty page is
+ * returned, so objects stay constructed while they're on the free list.
+*/
+typedef void (*zone_ctor_t)(void *elem);
+typedef void (*zone_dtor_t)(void *elem);
+
+/**
+ * Element alignment. Elements are aligned to the size of a pointer by default,
+ * or to the size of a data cache line, read from CTR_EL0, with
+ * ZONE_ALIGN_CACHE_LINE. Any other power of two can also be used.
+*/
+#define ZONE_ALIGN_DEFAULT			(sizeof(vm_address_t))
+#define ZONE_ALIGN_CACHE_LINE		(0)
+
+/**
+ * Sampled guard allocations, similar to GWP-ASan. One in every rate allocations
+ * is placed at the end of its own page, with guard pages either side, instead
+ * of in the zone. Once it's freed, the page is unmapped until the slot is
+ * reused. Overflows, underflows and use after free of a sampled element then
+ * fault, and are reported with the address the element was allocated from.
+ * 
+ * This needs level 3 tables, as a guard page can't be unmapped on its own
+ * otherwise, so ZALLOC_GUARD_SAMPLING follows DEFAULTS_KERNEL_VM_USE_L3_TABLE
+ * and is compiled out by default. The rate can be changed with
+ * zone_guard_set_rate, and a rate of zero disables sampling.
+*/
+#define ZALLOC_GUARD_SAMPLING		DEFAULTS_KERNEL_VM_USE_L3_TABLE
+#define ZALLOC_GUARD_DEFAULT_RATE	1000
+#define ZALLOC_GUARD_SLOTS			16
+
+/**
+ * Per-CPU caches are padded to this size, so two CPUs never share a line. The
+ * line size can only be read at runtime, so this is the usual AArch64 size.
+*/
+#define ZONE_CPU_CACHE_ALIGN		64
+
+/**
+ * Time every zalloc and zfree with the virtual counter, and keep a histogram of
+ * the latencies for each zone. Bucket 0 counts operations which took no ticks,
+ * and bucket N counts those which took up to 2^N - 1 ticks. The last bucket
+ * counts everything slower. Off by default, as each operation reads the counter
+ * twice.
+*/
+#define ZALLOC_STATS_LATENCY		DEFAULTS_DISABLE
+#define ZONE_LATENCY_BUCKETS		16
+
+/**
+ * Per-CPU magazine depth. Magazines are allocated with room for the maximum
+ * depth, so it can be changed without reallocating them.
+*/
+#define ZONE_MAGAZINE_MAX_DEPTH		16
+#define ZONE_MAGAZINE_DEFAULT_DEPTH	8
+
+/**
+ * A magazine is a stack of free elements, or "rounds". Elements in a magazine
+ * are marked as free, but are still counted as in-use by the zone.
+*/
+typedef struct zone_magazine {
+	vm_address_t	rounds[ZONE_MAGAZINE_MAX_DEPTH];
+	uint32_t		count;
+} zone_magazine_t;
+
+/**
+ * Per-CPU zone cache
+ * 
+ * Based on the magazine layer from Bonwick's Vmem and Mach's zalloc, each CPU
+ * has a loaded and a previous magazine for every zone. Allocations pop from the
+ * loaded magazine and frees push onto it, swapping with the previous magazine
+ * when it's empty or full. Only when both magazines are empty (or full) does a
+ * CPU touch the shared zone, filling (or emptying) a whole magazine at once.
+ * 
+ * Magazines are allocated from their own zone the first time a CPU uses a zone,
+ * so idle CPUs don't cost anything.
+*/
+typedef struct zone_cpu_cache {
+	zone_magazine_t		*loaded;
+	zone_magazine_t		*previous;
+
+	/* statistics */
+	uint64_t			hits;		/* allocations served from a magazine */
+	uint64_t			misses;		/* allocations which went to the zone */
+	uint64_t			frees;		/* number of frees on this cpu */
+	uint64_t			fails;		/* allocations which failed */
+#if ZALLOC_STATS_LATENCY
+	uint32_t			alloc_latency[ZONE_LATENCY_BUCKETS];
+	uint32_t			free_latency[ZONE_LATENCY_BUCKETS];
+#endif
+} __attribute__((aligned(ZONE_CPU_CACHE_ALIGN))) zone_cpu_cache_t;
+
 /**
  * The Zone Allocator
  * 
- * Zone "descriptors" are created and stored within the zone_array. They contain
- * information regarding the whole zone, such as the number of in-use and free
- * elements, the list of free and used allocation metadata's, number of virtual
- * memory pages used for the zone, name, index, etc.
+ * Zone "descriptors" are allocated from a bootstrap "zone of zones", and kept
+ * on a registry list so they can be found by name. They contain information
+ * regarding the whole zone, such as the number of in-use and free elements,
+ * the zone's pages, name, index, etc.
  * 
- * Pages are allocated for the requested size (number of elements) for the zone,
- * these pages are then filled with zone_alloc_metadata structs. These structs:
+ * A zone starts with no memory, and grows by a page at a time when it runs out
+ * of free elements, up to max_size. Each page starts with a zone_page_t, and
+ * the rest is split into elements with no header. Elements are aligned to the
+ * zone's alignment, and the space left at the end of a page is used to "colour"
+ * the pages, starting the elements of each new page one alignment unit further
+ * in. This spreads elements at the same offset of different pages over more
+ * cache sets, as in Bonwick's slab allocator.
  * 
- * 		1) Contain only the list_node_t
- * 		2) Are directly followed by the element data
+ * Free elements are kept on a per-page singly-linked list, with the address of
+ * the next free element stored in the first word of each free element, so
+ * allocation and free are both a single push or pop. With
+ * ZALLOC_CHECK_DOUBLE_FREE, the second word of a free element holds a cookie
+ * derived from its address, which zfree checks before pushing.
  * 
- * In the zone structure, the two lists contain these metadata structs. When an
- * allocation is made, the first element from the free list is takne, mode into
- * the used list, and the address of the metadata + the element size is returned.
+ * Zones with a constructor or destructor are never cleared by zfree, and their
+ * free list link and cookie are kept after the object rather than in it, so a
+ * freed object is given back out in the state it was freed in. Objects must be
+ * returned to their constructed state before they're freed.
+ * 
+ * Pages are kept on one of three lists, depending on whether they have free
+ * elements, in-use elements or both. Allocations prefer partially used pages,
+ * so that pages become entirely free where possible. These empty pages are kept
+ * until memory runs low, at which point zone_gc returns them to the page
+ * allocator.
+ * 
+ * zalloc and zfree first go through the calling CPU's magazines for the zone,
+ * see zone_cpu_cache_t. The magazine depth is set per-zone with
+ * zone_set_magazine_depth, and a depth of zero disables the magazines.
  * 
 */
 typedef struct zone {
@@ -69,14 +195,35 @@ typedef struct zone {
 	vm_size_t	size;			/* Current zone size */
 	vm_size_t	max_size;		/* Maximum zone size */
 	vm_size_t	elem_size;		/* Zone element size */
+	vm_size_t	obj_size;		/* Size requested for each element */
+	vm_size_t	link_offset;	/* Offset of the free list link in an element */
 
 	integer_t	page_count;		/* Number of pages used by this zone */
+	integer_t	page_elems;		/* Number of elements in each page */
+
+	vm_size_t	elem_align;		/* Element alignment */
+	vm_size_t	elem_offset;	/* Offset of the first element in a page */
+	vm_size_t	colour_max;		/* Largest colour offset */
+	vm_size_t	colour_next;	/* Colour offset of the next new page */
 
-	list_t		free_elems;		/* List of free elements */
-	list_t		used_elems;		/* List of used elements */
+	list_t		pages_partial;	/* Pages with both free and in-use elements */
+	list_t		pages_full;		/* Pages with no free elements */
+	list_t		pages_empty;	/* Pages with no in-use elements */
 
+	uint32_t	mag_depth;		/* Per-CPU magazine depth, or 0 if disabled */
+	zone_cpu_cache_t	cpu_caches[DEFAULTS_MACHINE_MAX_CPUS];
+
+	zone_ctor_t	ctor;			/* Object constructor, or NULL */
+	zone_dtor_t	dtor;			/* Object destructor, or NULL */
+
+	/* Statistics. Allocation, free and failure counts are kept per-CPU */
+	integer_t	high_water;		/* Most elements in use at once */
+	integer_t	page_high_water;	/* Most pages used at once */
+	uint64_t	guard_samples;	/* Allocations given a guarded slot */
+
+	list_node_t	link;			/* Link in the zone registry */
 	integer_t	index;			/* Zone index */
-	const char	*name;			/* Zone name */
+	const char	*name;			/* Zone name, owned by the caller */
 
 	uint32_t	
 
@@ -88,19 +235,60 @@ typedef struct zone {
 } zone_t;
 
 /**
- * The pages allocated for the zone are filled with these structs, with enough
- * space for the element data type after each of them. 
+ * Header at the start of every page used by a zone. The page an element belongs
+ * to is found by rounding the element's address down to the page size.
+*/
+typedef struct zone_page {
+	list_node_t		link;		/* Link in one of the zone's page lists */
+	zone_t			*zone;		/* Zone which owns this page */
+	vm_address_t	free_head;	/* First free element, or 0 if there are none */
+	integer_t		count_free;	/* Number of free elements in this page */
+} zone_page_t;
+
+/**
+ * Slot for a sampled guard allocation. The object page is allocated, with a
+ * guard page either side, the first time the slot is used, and is kept for
+ * reuse afterwards.
 */
-typedef struct zone_alloc_metadata {
-	list_node_t	alloc;
-} zone_alloc_metadata_t;
+typedef struct zone_guard_slot {
+	vm_address_t	page;		/* Object page, between the two guard pages */
+	phys_addr_t		paddr;		/* Physical page backing the object page */
+
+	zone_t			*zone;		/* Zone the element was allocated from */
+	vm_address_t	elem;		/* Element address, at the end of the page */
+	vm_address_t	alloc_site;	/* Return address of the zalloc call */
+	vm_address_t	free_site;	/* Return address of the zfree call */
+
+#define ZONE_GUARD_SLOT_UNUSED		(0x0)	/* page not yet allocated */
+#define ZONE_GUARD_SLOT_ALLOCATED	(0x1)	/* element in use */
+#define ZONE_GUARD_SLOT_FREED		(0x2)	/* element freed, page unmapped */
+	uint32_t		state;
+} zone_guard_slot_t;
+
+/* Offset of the first element in a zone page, keeping elements aligned */
+#define ZONE_PAGE_HEADER_SIZE		\
+	((sizeof(zone_page_t) + sizeof(vm_address_t) - 1) & ~(sizeof(vm_address_t) - 1))
 
 extern kern_return_t zone_init();
 extern zone_t *zone_create(vm_size_t size, vm_size_t max, const char *name);
+extern zone_t *zone_create_aligned(vm_size_t size, vm_size_t max,
+									vm_size_t align, const char *name);
+extern kern_return_t zone_set_ctor(zone_t *zone, zone_ctor_t ctor,
+									zone_dtor_t dtor);
+extern kern_return_t zone_destroy(zone_t *zone);
+extern zone_t *zone_find(const char *name);
 
 extern void *zalloc(zone_t *zone);
 extern void zfree(zone_t *zone, vm_address_t addr);
 
+extern void zone_set_magazine_depth(zone_t *zone, uint32_t depth);
+extern void zone_drain(zone_t *zone);
+extern uint64_t zone_gc();
+
+extern void zone_guard_set_rate(uint32_t rate);
+extern kern_return_t zone_guard_report(vm_address_t addr);
+
 extern void zone_dump(zone_t *zone);
+extern void zone_dump_summary();
 
 #endif /* __kern_zalloc_h__ */
@@ -23,6 +23,7 @@
 #include <kern/kprintf.h>
 #include <kern/defaults.h>
 #include <kern/vm/vm_page.h>
+#include <kern/mm/kalloc.h>
 
 #include <tinylibc/string.h>
 
@@ -36,18 +37,10 @@
  * A reference to the kernel task is stored here, along with the task list head
  * and PID count.
 */
-task_t		kernel_task;
+task_t		*kernel_task;
 integer_t	task_pid = 0;
 list_t		tasks;
 
-/**
- * For now, we'll manually track where the allocations are, but we should switch
- * to some kind of zone allocator or something, so tasks can be allocated in
- * the same place.
-*/
-vm_address_t	task_page;	/* tmp: replace with a zone? */
-vm_offset_t		task_page_cursor = 0;
-
 /**
  * NOTE:	For the moment, we'll record the current task here, so the panic
  * 			handler doesn't fuck up. But this needs to change in two ways:
@@ -74,8 +67,6 @@ void		kernel_task_entry()
 {
 
 }
-// this is annoying, and really should be in lists.h
-static inline void prefetch(const void *x) {;}
 
 task_t *get_current_task()
 {
@@ -103,7 +94,7 @@ void _dump_tasks()
 		 * for each task is valid. If it's not, the kernel will crash.
 		*/
 #if TASK_DO_STACK_GUARD_CHECK
-		stack_guard_addr = entry->context.sp;
+		stack_guard_addr = entry->context.sp - VM_PAGE_SIZE;
 		memcpy(stack_guard_addr, stack_guard, strlen(stack_guard));
 
 		kprintf_hexdump(stack_guard_addr, stack_guard_addr, 64);
@@ -121,13 +112,6 @@ void _dump_tasks()
 */
 void task_init()
 {
-	/**
-	 * Allocate a page within the kernel task's map to store the task structure,
-	 * this could be replaced with a zone allocation, but this needs more
-	 * investigation.
-	*/
-	task_page = vm_map_alloc(vm_get_kernel_map(), sizeof(task_t) * TASK_COUNT_MAX);
-
 	/* Initialise the tasks list */
 	INIT_LIST_HEAD(&tasks);
 
@@ -146,29 +130,31 @@ void task_init()
 		panic("failed to create task: \"kernel_task\"\n");
 	}
 
-	kprintf ("%s: %d\n", kernel_task.name, kernel_task.pid);
+	kprintf ("%s: %d\n", kernel_task->name, kernel_task->pid);
 }
 
 
 /**
  * task_create_internal
  * 
- * Creates a new task_t with a given entry point and vm_map. The task is placed
- * within the task page, and a new stack is allocated on the given map. The task
- * is added to the global tasks list, and a pid is assigned.
+ * Creates a new task_t with a given entry point and vm_map. The task is
+ * allocated with kalloc, and a new stack is allocated on the given map. The task
+ * is added to the global tasks list, a pid is assigned, and the new task is
+ * returned through 'task'.
 */
 kern_return_t
 task_create_internal(task_entry_t *entry,
 					vm_map_t *map,
 					const char *name,
-					task_t *task)
+					task_t **task)
 {
 	vm_address_t 	stack;
 	size_t			name_len;
 	task_t			*new;
 
-	new = (task_t *) (task_page + task_page_cursor);
-	task_page_cursor += sizeof (task_t);
+	new = (task_t *) kalloc (sizeof (task_t));
+	if (new == NULL)
+		return KERN_RETURN_FAIL;
 
 	/* two references: caller, and this function */
 	new->ref_count = 2;
@@ -181,13 +167,12 @@ task_create_internal(task_entry_t *entry,
 		name_len = TASK_NAME_MAX_LEN;
 	memcpy(new->name, name, name_len);
 
-	/* TODO: fix the issue in vm.c that is causing this */
-	vm_map_alloc(map, 1);
-
-	/* allocate a stack */
-	stack = vm_map_alloc(map, VM_PAGE_SIZE);
-	if (vm_is_address_valid(stack) != KERN_RETURN_SUCCESS)
+	/* allocate a stack from the stack arena, with a guard page below it */
+	stack = vm_map_alloc(map, VM_PAGE_SIZE, VM_ALLOC_STACK | VM_ALLOC_GUARD_FIRST);
+	if (vm_is_address_valid(stack) != KERN_RETURN_SUCCESS) {
+		kfree(new, sizeof(task_t));
 		return KERN_RETURN_FAIL;
+	}
 
 	/**
 	 * Setup the task context. Once threads, are implemented, this will be moved
@@ -195,11 +180,11 @@ task_create_internal(task_entry_t *entry,
 	 * the parent task.
 	*/
 	new->context.x19 = entry;
-	new->context.lr = (uint64_t) &__fork64_return;
-	new->context.sp = stack;
+	new->context.pc = (uint64_t) &__fork64_return;
+	new->context.sp = stack + VM_PAGE_SIZE;
 
 	list_add_tail(&new->tasks, &tasks);
-	*task = *new;
+	*task = new;
 
 	return KERN_RETURN_SUCCESS;
 }
\ No newline at end of file
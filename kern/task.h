@@ -107,6 +107,9 @@ typedef struct task {
 
 } task_t;
 
+/* The kernel task, created by task_init */
+extern task_t			*kernel_task;
+
 /* Initialise the task interface */
 extern void				task_init(void);
 
@@ -114,7 +117,7 @@ extern kern_return_t	task_create_internal(
 							task_entry_t *entry,
 							vm_map_t *map,
 							const char *name,
-							task_t *task);
+							task_t **task);
 
 extern kern_return_t	task_kill_internal(
 							task_t *task);
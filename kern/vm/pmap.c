@@ -20,10 +20,13 @@
 //===----------------------------------------------------------------------===//
 
 #include <tinylibc/stdint.h>
+#include <tinylibc/string.h>
 
 #include <kern/defaults.h>
 #include <kern/vm/pmap.h>
+#include <kern/vm/vm_page.h>
 #include <kern/vm/vm.h>
+#include <kern/cpu.h>
 
 #include <libkern/assert.h>
 
@@ -49,6 +52,21 @@ tt_table_t	*invalid_tte	__attribute__((section(".data")));
 phys_addr_t	kernel_ttep 	__attribute__((section(".data")));
 phys_addr_t	invalid_ttep	__attribute__((section(".data")));
 
+/* table pool, with the physical base of each huge page it's carved from */
+static struct {
+	tt_table_t		*l2_table;
+	phys_addr_t		chunks[PMAP_TABLE_POOL_CHUNKS];
+	vm_size_t		nchunks;
+	vm_offset_t		cursor;
+} pmap_table_pool;
+
+/* each cpu's page window entry, and the physical base it currently maps */
+static struct {
+	tt_entry_t		*entry;
+	phys_addr_t		pbase;
+	int				valid;
+} pmap_windows[DEFAULTS_MACHINE_MAX_CPUS];
+
 
 /******************************************************************************
  * Management of the Kernel pagetable region, only used for kernel pagetables
@@ -68,7 +86,10 @@ vm_address_t pmap_ptregion_alloc ()
 	pagetables_region_cursor += DEFAULTS_KERNEL_VM_PAGE_SIZE;
 
 	/* ensure that the address is within the pagetable region bounds */
-	assert (pagetables_region_end < vaddr);
+	assert (pagetables_region_cursor <= (vm_address_t) &pagetables_region_end);
+
+	/* a new table must not contain any valid entries */
+	memset ((void *) vaddr, 0, DEFAULTS_KERNEL_VM_PAGE_SIZE);
 	return vaddr;
 }
 
@@ -97,6 +118,88 @@ pmap_return_t pmap_ptregion_create ()
 	return PMAP_RETURN_SUCCESS;
 }
 
+/******************************************************************************
+ * Translation table pool, used once the pagetables region is full
+ *
+ *****************************************************************************/
+
+/**
+ *	Name:	pmap_table_pool_init
+ *	Desc:	Create the L2 table the table pool's huge pages are mapped through.
+ *			This comes from the pagetables region, so it must exist before the
+ *			region is used up.
+ */
+void pmap_table_pool_init ()
+{
+	vm_offset_t index;
+
+	index = (PMAP_TABLE_POOL_BASE & TT_L1_INDEX_MASK) >> TT_L1_SHIFT;
+	pmap_table_pool.l2_table = (tt_table_t *) pmap_ptregion_alloc ();
+	kernel_tte[index] = (mmu_translate_kvtop (pmap_table_pool.l2_table) &
+		TT_TABLE_MASK) | 0x3;
+}
+
+/**
+ *	Name:	__pmap_tt_alloc_table
+ *	Desc:	Allocate a zeroed translation table, from the pagetables region
+ *			while it has room, and from the table pool after that.
+ */
+static tt_table_t *__pmap_tt_alloc_table ()
+{
+	tt_table_t *table;
+	phys_addr_t paddr;
+	vm_size_t n;
+
+	if (pagetables_region_cursor < (vm_address_t) &pagetables_region_end)
+		return (tt_table_t *) pmap_ptregion_alloc ();
+
+	/* map another huge page into the pool once the last one is used up */
+	n = pmap_table_pool.nchunks;
+	if (n == 0 || pmap_table_pool.cursor == TT_L2_SIZE) {
+		if (n == PMAP_TABLE_POOL_CHUNKS ||
+			(paddr = vm_page_alloc_huge ()) == VM_PAGE_NULL)
+			panic ("pmap: no memory for translation tables\n");
+
+		pmap_table_pool.l2_table[n] = TTE_BLOCK_TEMPLATE | (paddr & TT_BLOCK_MASK);
+		mmu_tt_sync ();
+
+		pmap_table_pool.chunks[n++] = paddr;
+		pmap_table_pool.nchunks = n;
+		pmap_table_pool.cursor = 0;
+	}
+
+	table = (tt_table_t *) (PMAP_TABLE_POOL_BASE + (n - 1) * TT_L2_SIZE +
+		pmap_table_pool.cursor);
+	pmap_table_pool.cursor += DEFAULTS_KERNEL_VM_PAGE_SIZE;
+
+	memset ((void *) table, 0, DEFAULTS_KERNEL_VM_PAGE_SIZE);
+	return table;
+}
+
+/**
+ *	Name:	pmap_tt_ptokva
+ *	Desc:	Return the virtual address of the translation table at a physical
+ *			address, in either the pagetables region or the table pool.
+ */
+tt_table_t *pmap_tt_ptokva (phys_addr_t paddr)
+{
+	phys_addr_t chunk;
+
+	if (paddr >= ptregion_phys_base &&
+		paddr < ptregion_phys_base + DEFAULTS_KERNEL_VM_PAGE_SIZE * 16)
+		return (tt_table_t *) ptokva (paddr);
+
+	chunk = paddr & ~(TT_L2_SIZE - 1);
+	for (vm_size_t i = 0; i < pmap_table_pool.nchunks; i++) {
+		if (pmap_table_pool.chunks[i] == chunk)
+			return (tt_table_t *) (PMAP_TABLE_POOL_BASE + i * TT_L2_SIZE +
+				(paddr - chunk));
+	}
+
+	panic ("pmap: no table at 0x%lx\n", paddr);
+	return NULL;
+}
+
 /******************************************************************************
  * General translation table management
  *
@@ -113,12 +216,17 @@ pmap_return_t pmap_tt_create_tte (tt_table_t *table, phys_addr_t pbase,
 	vm_address_t map_address, map_address_l2, map_address_l3, vend;
 	vm_offset_t index;
 	tt_table_t *l2_table, *l3_table;
-	tt_entry_t entry;
+	tt_entry_t entry, attr;
 
 //	pmap_log ("pmap_tt_create_tte(0x%lx, 0x%lx, 0x%lx, %d)\n",
 //		table, pbase, vbase, size);
 
-	/* TODO: apply attributes to tte's, e.g. NOACCESS, READONLY, READWRITE */
+	/**
+	 * NOACCESS pages are left with invalid entries, so any access to them
+	 * faults. Blocks can't be made inaccessible without their neighbours, so
+	 * they ignore it.
+	*/
+	attr = (flags & PMAP_ACCESS_READONLY) ? TTE_AP_READONLY : 0;
 
 	/* calculate the virtual end of the region */
 	vend = vbase + size;
@@ -132,11 +240,11 @@ pmap_return_t pmap_tt_create_tte (tt_table_t *table, phys_addr_t pbase,
 
 		/* if the index is not already a table descriptor, create the L2 table */
 		if ((table[index] & TTE_TYPE_MASK) != TTE_TYPE_TABLE) {
-			l2_table = (tt_table_t *) pmap_ptregion_alloc ();
+			l2_table = __pmap_tt_alloc_table ();
 			entry = ((vm_address_t) mmu_translate_kvtop (l2_table) & TT_TABLE_MASK) | 0x3;
 			table[index] = entry;
 		} else {
-			l2_table = (tt_table_t *) (ptokva(table[index] & TT_TABLE_MASK));
+			l2_table = pmap_tt_ptokva (table[index] & TT_TABLE_MASK);
 		}
 
 		/* fill the L2 table */
@@ -147,12 +255,28 @@ pmap_return_t pmap_tt_create_tte (tt_table_t *table, phys_addr_t pbase,
 			index = ((map_address_l2 & TT_L2_INDEX_MASK) >> TT_L2_SHIFT);
 
 #if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+			/**
+			 * map a whole, aligned 2MB region with a single block entry when
+			 * asked to, unless there is already an L3 table in its place.
+			*/
+			if ((flags & PMAP_MAP_BLOCK) &&
+				!(map_address_l2 & (TT_L2_SIZE - 1)) &&
+				!((pbase + (map_address_l2 - vbase)) & (TT_L2_SIZE - 1)) &&
+				vend - map_address_l2 >= TT_L2_SIZE &&
+				(l2_table[index] & TTE_TYPE_MASK) != TTE_TYPE_TABLE) {
+				entry = TTE_BLOCK_TEMPLATE | attr | (pbase + (map_address_l2 - vbase) & TT_BLOCK_MASK);
+				l2_table[index] = entry;
+
+				map_address_l2 += TT_L2_SIZE;
+				continue;
+			}
+
 			if ((l2_table[index] & TTE_TYPE_MASK) != TTE_TYPE_TABLE) {
-				l3_table = (tt_table_t *) mmu_translate_kvtop (pmap_ptregion_alloc ());
+				l3_table = __pmap_tt_alloc_table ();
 				entry = (mmu_translate_kvtop (l3_table) & TT_TABLE_MASK) | 0x3;
 				l2_table[index] = entry;
 			} else {
-				l3_table = (tt_table_t *) (ptokva(l2_table[index] & TT_TABLE_MASK));
+				l3_table = pmap_tt_ptokva (l2_table[index] & TT_TABLE_MASK);
 			}
 
 			/* fill the L3 table */
@@ -160,13 +284,14 @@ pmap_return_t pmap_tt_create_tte (tt_table_t *table, phys_addr_t pbase,
 			while (map_address_l3 < (map_address_l2 + TT_L2_SIZE) && map_address_l3 < vend) {
 
 				index = ((map_address_l3 & TT_L3_INDEX_MASK) >> TT_L3_SHIFT);
-				entry = TTE_PAGE_TEMPLATE | (pbase + (map_address_l3 - vbase) & TT_TABLE_MASK);
-				l3_table[index] = entry;
+				entry = TTE_PAGE_TEMPLATE | attr | (pbase + (map_address_l3 - vbase) & TT_TABLE_MASK);
+				l3_table[index] = (flags & PMAP_ACCESS_NOACCESS) ?
+					TTE_ENTRY_INVALID : entry;
 
 				map_address_l3 += TT_L3_SIZE;
 			}
 #else
-			entry = TTE_BLOCK_TEMPLATE | (pbase + (map_address_l2 - vbase) & TT_TABLE_MASK);
+			entry = TTE_BLOCK_TEMPLATE | attr | (pbase + (map_address_l2 - vbase) & TT_TABLE_MASK);
 			l2_table[index] = entry;
 #endif
 			map_address_l2 += TT_L2_SIZE;
@@ -178,3 +303,411 @@ pmap_return_t pmap_tt_create_tte (tt_table_t *table, phys_addr_t pbase,
 	return PMAP_RETURN_SUCCESS;
 }
 
+/**
+ *	Name:	__pmap_tt_next_table
+ *	Desc:	Return the table that 'table[index]' points to, creating it if the
+ *			entry isn't a table descriptor yet.
+ */
+static tt_table_t *__pmap_tt_next_table (tt_table_t *table, vm_offset_t index)
+{
+	tt_table_t *next;
+
+	if ((table[index] & TTE_TYPE_MASK) == TTE_TYPE_TABLE)
+		return pmap_tt_ptokva (table[index] & TT_TABLE_MASK);
+
+	next = __pmap_tt_alloc_table ();
+	table[index] = ((vm_address_t) mmu_translate_kvtop (next) & TT_TABLE_MASK) | 0x3;
+	return next;
+}
+
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+/**
+ *	Name:	__pmap_tt_l3_table
+ *	Desc:	Return the L3 table covering a virtual address, creating it, and
+ *			the L2 table above it, if they don't exist yet.
+ */
+static tt_table_t *__pmap_tt_l3_table (tt_table_t *table, vm_address_t vaddr)
+{
+	tt_table_t *l2_table;
+
+	l2_table = __pmap_tt_next_table (table,
+		(vaddr & TT_L1_INDEX_MASK) >> TT_L1_SHIFT);
+	return __pmap_tt_next_table (l2_table,
+		(vaddr & TT_L2_INDEX_MASK) >> TT_L2_SHIFT);
+}
+#endif
+
+/**
+ *	Name:	pmap_enter_range
+ *	Desc:	Map 'npages' pages from 'vbase' to the physical pages in 'pages'.
+ *			The tables are walked once for each L3 table the range covers,
+ *			rather than for every page, and physically contiguous runs are
+ *			found so aligned runs of PMAP_CONTIG_PAGES get the contiguous hint.
+ *			Without L3 tables, each contiguous run is mapped as a single region.
+ */
+pmap_return_t pmap_enter_range (pmap_t *pmap, vm_address_t vbase,
+								const phys_addr_t *pages, vm_size_t npages,
+								vm_flags_t flags)
+{
+	vm_address_t vaddr;
+	vm_size_t i, run;
+	tt_table_t *table;
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+	tt_table_t *l3_table = NULL;
+	tt_entry_t attr, hint;
+	vm_offset_t index;
+	vm_size_t j, n;
+	phys_addr_t paddr;
+
+	attr = (flags & PMAP_ACCESS_READONLY) ? TTE_AP_READONLY : 0;
+#endif
+
+	table = (tt_table_t *) pmap->tte;
+	for (i = 0; i < npages; i += run) {
+		vaddr = vbase + i * TT_L3_SIZE;
+
+		/* find the physically contiguous run, up to the end of the L3 table */
+		run = 1;
+		while (i + run < npages &&
+			pages[i + run] == pages[i] + run * TT_L3_SIZE &&
+			((vaddr + run * TT_L3_SIZE) & (TT_L2_SIZE - 1)))
+			run++;
+
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+		if (l3_table == NULL || !(vaddr & (TT_L2_SIZE - 1)))
+			l3_table = __pmap_tt_l3_table (table, vaddr);
+
+		index = ((vaddr & TT_L3_INDEX_MASK) >> TT_L3_SHIFT);
+		for (j = 0; j < run; j += n) {
+			paddr = pages[i] + j * TT_L3_SIZE;
+
+			/* the hint needs a whole run aligned in both address spaces */
+			n = 1;
+			hint = 0;
+			if (run - j >= PMAP_CONTIG_PAGES &&
+				!((vaddr + j * TT_L3_SIZE) & (PMAP_CONTIG_SIZE - 1)) &&
+				!(paddr & (PMAP_CONTIG_SIZE - 1))) {
+				n = PMAP_CONTIG_PAGES;
+				hint = TTE_CONTIGUOUS;
+			}
+
+			for (vm_size_t k = 0; k < n; k++) {
+				l3_table[index + j + k] = TTE_PAGE_TEMPLATE | attr | hint |
+					((paddr + k * TT_L3_SIZE) & TT_PAGE_MASK);
+			}
+		}
+#else
+		pmap_tt_create_tte (table, pages[i], vaddr, run * TT_L3_SIZE, flags);
+#endif
+	}
+
+	pmap_log ("mapped 0x%llx -> 0x%llx from %d pages\n", vbase,
+		vbase + npages * TT_L3_SIZE, npages);
+	return PMAP_RETURN_SUCCESS;
+}
+
+/**
+ *	Name:	pmap_tt_lookup
+ *	Desc:	Walk the given table and return a pointer to the Block or Page entry
+ *			which maps a virtual address, along with the size of the memory it
+ *			maps. Returns NULL if the address isn't mapped.
+ */
+tt_entry_t *pmap_tt_lookup (tt_table_t *table, vm_address_t vaddr,
+							vm_size_t *size)
+{
+	tt_table_t *l2_table, *l3_table;
+	tt_entry_t *entry;
+
+	/* level 1 */
+	entry = &table[(vaddr & TT_L1_INDEX_MASK) >> TT_L1_SHIFT];
+	if (!(*entry & TTE_ENTRY_VALID))
+		return NULL;
+	if ((*entry & TTE_TYPE_MASK) == TTE_TYPE_BLOCK) {
+		*size = TT_L1_SIZE;
+		return entry;
+	}
+
+	/* level 2 */
+	l2_table = pmap_tt_ptokva (*entry & TT_TABLE_MASK);
+	entry = &l2_table[(vaddr & TT_L2_INDEX_MASK) >> TT_L2_SHIFT];
+	if (!(*entry & TTE_ENTRY_VALID))
+		return NULL;
+	if ((*entry & TTE_TYPE_MASK) == TTE_TYPE_BLOCK) {
+		*size = TT_L2_SIZE;
+		return entry;
+	}
+
+	/* level 3 */
+	l3_table = pmap_tt_ptokva (*entry & TT_TABLE_MASK);
+	entry = &l3_table[(vaddr & TT_L3_INDEX_MASK) >> TT_L3_SHIFT];
+	if ((*entry & TTE_TYPE_MASK) != TTE_TYPE_PAGE)
+		return NULL;
+
+	*size = TT_L3_SIZE;
+	return entry;
+}
+
+/**
+ *	Name:	__pmap_tt_break_contiguous
+ *	Desc:	Clear the contiguous hint from the run of Page entries containing
+ *			'entry', before any one of them is changed. Changing the hint on a
+ *			live entry needs break-before-make, so the whole run is invalidated
+ *			and flushed from the TLB before it's rewritten without the hint.
+ */
+static void __pmap_tt_break_contiguous (tt_entry_t *entry, vm_address_t vaddr)
+{
+	tt_entry_t *first;
+
+	if (!(*entry & TTE_CONTIGUOUS))
+		return;
+
+	first = entry - ((vaddr & (PMAP_CONTIG_SIZE - 1)) >> TT_L3_SHIFT);
+	vaddr &= ~(PMAP_CONTIG_SIZE - 1);
+
+	/* break: no entry in the run may be valid while the hint changes */
+	for (int i = 0; i < PMAP_CONTIG_PAGES; i++)
+		first[i] &= ~TTE_ENTRY_VALID;
+
+	for (int i = 0; i < PMAP_CONTIG_PAGES; i++)
+		mmu_tlb_flush_vaddr (vaddr + i * TT_L3_SIZE);
+
+	/* make: the same entries, as individual pages */
+	for (int i = 0; i < PMAP_CONTIG_PAGES; i++)
+		first[i] = (first[i] & ~TTE_CONTIGUOUS) | TTE_ENTRY_VALID;
+}
+
+/**
+ *	Name:	pmap_tt_remove_tte
+ *	Desc:	Remove the translation table entries mapping a virtual region, and
+ *			flush them from the TLB. A block entry is only removed if the region
+ *			covers all of it. Tables are left in place.
+ */
+pmap_return_t pmap_tt_remove_tte (tt_table_t *table, vm_address_t vbase,
+								vm_size_t size)
+{
+	vm_address_t vaddr, vend;
+	tt_entry_t *entry;
+	vm_size_t leaf_size;
+
+	vend = vbase + size;
+	for (vaddr = vbase; vaddr < vend; vaddr += leaf_size) {
+		if ((entry = pmap_tt_lookup (table, vaddr, &leaf_size)) == NULL) {
+			leaf_size = TT_L3_SIZE;
+			continue;
+		}
+
+		if ((vaddr & (leaf_size - 1)) || vend - vaddr < leaf_size)
+			return PMAP_RETURN_ILLEGAL;
+
+		if (leaf_size == TT_L3_SIZE)
+			__pmap_tt_break_contiguous (entry, vaddr);
+		*entry = TTE_ENTRY_INVALID;
+		mmu_tlb_flush_vaddr (vaddr);
+	}
+
+	return PMAP_RETURN_SUCCESS;
+}
+
+/**
+ *	Name:	pmap_extract
+ *	Desc:	Return the physical address a virtual address is mapped to in the
+ *			given table, or zero if it isn't mapped.
+ */
+phys_addr_t pmap_extract (tt_table_t *table, vm_address_t vaddr)
+{
+	tt_entry_t *entry;
+	vm_size_t size;
+
+	if ((entry = pmap_tt_lookup (table, vaddr, &size)) == NULL)
+		return 0;
+
+	return (*entry & TT_PAGE_MASK & ~(size - 1)) + (vaddr & (size - 1));
+}
+
+/******************************************************************************
+ * Copy-on-write
+ *
+ ******************************************************************************/
+
+/**
+ *	Name:	pmap_copy_on_write
+ *	Desc:	Share the page mapped at 'vaddr' in 'src' with 'dst', at the same
+ *			virtual address. Both mappings are made read-only and marked as
+ *			copy-on-write, and the page gains a reference. The page is only
+ *			copied once either side writes to it, see pmap_fault_copy_on_write.
+ */
+pmap_return_t pmap_copy_on_write (tt_table_t *src, tt_table_t *dst,
+								vm_address_t vaddr)
+{
+	tt_entry_t *entry;
+	phys_addr_t paddr;
+	vm_size_t size;
+
+	vaddr &= ~(TT_L3_SIZE - 1);
+	if ((entry = pmap_tt_lookup (src, vaddr, &size)) == NULL)
+		return PMAP_RETURN_INVALID;
+
+	/* reference counts are per-page, so only page mappings can be shared */
+	if (size != TT_L3_SIZE)
+		return PMAP_RETURN_ILLEGAL;
+
+	paddr = *entry & TT_PAGE_MASK;
+	if (vm_page_ref_get (paddr) == 0)
+		return PMAP_RETURN_INVALID;
+
+	/* write-protect the source first, so the copy is taken from stable data */
+	__pmap_tt_break_contiguous (entry, vaddr);
+	*entry |= TTE_AP_READONLY | TTE_SW_COPY_ON_WRITE;
+	mmu_tlb_flush_vaddr (vaddr);
+
+	pmap_tt_create_tte (dst, paddr, vaddr, TT_L3_SIZE, PMAP_ACCESS_READONLY);
+	entry = pmap_tt_lookup (dst, vaddr, &size);
+	*entry |= TTE_SW_COPY_ON_WRITE;
+
+	return PMAP_RETURN_SUCCESS;
+}
+
+/**
+ *	Name:	pmap_fault_copy_on_write
+ *	Desc:	Resolve a write fault on a copy-on-write page. If the page is still
+ *			shared, it's copied into a new page which replaces it in this
+ *			mapping, otherwise the mapping is simply made writable again.
+ *			Returns PMAP_RETURN_INVALID if the fault isn't copy-on-write.
+ */
+pmap_return_t pmap_fault_copy_on_write (vm_address_t vaddr)
+{
+	phys_addr_t old_paddr, new_paddr, window_pbase;
+	int window_valid;
+	cpu_number_t cpu;
+	tt_entry_t *entry, new_entry;
+	tt_table_t *table;
+	vm_size_t size;
+
+	/* the upper half of the address space is translated by TTBR1 */
+	vaddr &= ~(TT_L3_SIZE - 1);
+	table = (vaddr & (UL(1) << 63)) ? kernel_tte :
+		(tt_table_t *) ptokva (mmu_get_tt_base () & TTBR_BADDR_MASK);
+
+	entry = pmap_tt_lookup (table, vaddr, &size);
+	if (entry == NULL || !(*entry & TTE_SW_COPY_ON_WRITE))
+		return PMAP_RETURN_INVALID;
+
+	old_paddr = *entry & TT_PAGE_MASK;
+	__pmap_tt_break_contiguous (entry, vaddr);
+
+	/* the last mapping of the page can take it over */
+	if (vm_page_ref_count (old_paddr) == 1) {
+		*entry &= ~(TTE_AP_READONLY | TTE_SW_COPY_ON_WRITE);
+		mmu_tlb_flush_vaddr (vaddr);
+		return PMAP_RETURN_SUCCESS;
+	}
+
+	/**
+	 * The old page is still readable through the faulting address. The fault
+	 * may have interrupted a user of this cpu's page window, so the window is
+	 * pointed back at whatever it mapped before once the copy is done.
+	*/
+	cpu = cpu_get_current_num ();
+	window_pbase = pmap_windows[cpu].pbase;
+	window_valid = pmap_windows[cpu].valid;
+
+	new_paddr = vm_page_alloc ();
+	memcpy ((void *) pmap_window_map (new_paddr), (void *) vaddr, TT_L3_SIZE);
+
+	if (window_valid)
+		pmap_window_map (window_pbase);
+
+	/* break-before-make, as the output address changes */
+	new_entry = (*entry & ~(TT_PAGE_MASK | TTE_AP_READONLY | TTE_SW_COPY_ON_WRITE)) |
+		new_paddr;
+	*entry = TTE_ENTRY_INVALID;
+	mmu_tlb_flush_vaddr (vaddr);
+	*entry = new_entry;
+	mmu_tt_sync ();
+
+	vm_page_ref_put (old_paddr);
+	return PMAP_RETURN_SUCCESS;
+}
+
+/******************************************************************************
+ * Physical page windows
+ *
+ ******************************************************************************/
+
+/**
+ *	Name:	pmap_window_init
+ *	Desc:	Create the tables for every cpu's page window, and keep a pointer to
+ *			each window's entry so it can be repointed without walking the
+ *			tables. The entries start out invalid.
+ */
+void pmap_window_init ()
+{
+	tt_table_t *l2_table;
+	vm_address_t window;
+
+	for (int cpu = 0; cpu < DEFAULTS_MACHINE_MAX_CPUS; cpu++) {
+		window = PMAP_WINDOW_BASE + (cpu * PMAP_WINDOW_SIZE);
+		l2_table = __pmap_tt_next_table (kernel_tte,
+			(window & TT_L1_INDEX_MASK) >> TT_L1_SHIFT);
+
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+		pmap_windows[cpu].entry = &__pmap_tt_next_table (l2_table,
+			(window & TT_L2_INDEX_MASK) >> TT_L2_SHIFT)
+			[(window & TT_L3_INDEX_MASK) >> TT_L3_SHIFT];
+#else
+		pmap_windows[cpu].entry =
+			&l2_table[(window & TT_L2_INDEX_MASK) >> TT_L2_SHIFT];
+#endif
+		pmap_windows[cpu].valid = 0;
+	}
+}
+
+/**
+ *	Name:	pmap_window_map
+ *	Desc:	Point the current cpu's page window at the given physical page, and
+ *			return the virtual address the page can be accessed through. The
+ *			address is only valid until the next call on this cpu.
+ */
+vm_address_t pmap_window_map (phys_addr_t paddr)
+{
+	vm_address_t window;
+	phys_addr_t pbase;
+	cpu_number_t cpu;
+	tt_entry_t *entry;
+
+	cpu = cpu_get_current_num ();
+	window = PMAP_WINDOW_BASE + (cpu * PMAP_WINDOW_SIZE);
+	pbase = paddr & ~(PMAP_WINDOW_SIZE - 1);
+
+	/* neighbouring pages usually share a block, so only remap when it changes */
+	if (!pmap_windows[cpu].valid || pmap_windows[cpu].pbase != pbase) {
+		entry = pmap_windows[cpu].entry;
+
+		/* break-before-make: the old translation must be gone first */
+		if (pmap_windows[cpu].valid) {
+			*entry = TTE_ENTRY_INVALID;
+			mmu_tlb_flush_vaddr (window);
+		}
+
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+		*entry = TTE_PAGE_TEMPLATE | (pbase & TT_PAGE_MASK);
+#else
+		*entry = TTE_BLOCK_TEMPLATE | (pbase & TT_BLOCK_MASK);
+#endif
+		mmu_tt_sync ();
+
+		pmap_windows[cpu].pbase = pbase;
+		pmap_windows[cpu].valid = 1;
+	}
+
+	return window + (paddr - pbase);
+}
+
+/**
+ *	Name:	pmap_zero_page
+ *	Desc:	Zero a physical page through the current cpu's page window.
+ */
+void pmap_zero_page (phys_addr_t paddr)
+{
+	memset ((void *) pmap_window_map (paddr), 0, DEFAULTS_KERNEL_VM_PAGE_SIZE);
+}
@@ -36,6 +36,7 @@
 
 #include <kern/vm/vm_types.h>
 #include <kern/vm/vm.h>
+#include <kern/defaults.h>
 
 /* interface logger */
 #define pmap_log(fmt, ...)		interface_log("pmap", fmt, ##__VA_ARGS__)
@@ -61,6 +62,18 @@ typedef uint64_t		phys_size_t;	/* physical size */
 #define PMAP_ACCESS_READONLY	UL(0x2)	/* page is read-only */
 #define PMAP_ACCESS_READWRITE	UL(0x4)	/* page is read-write */
 
+/* Translation table mapping flags */
+#define PMAP_MAP_BLOCK			UL(0x8)	/* use level 2 blocks where aligned */
+
+/**
+ * An aligned run of 16 Page entries mapping contiguous, equally aligned
+ * physical memory can be marked with the contiguous hint, so the run only
+ * takes a single TLB entry.
+*/
+#define PMAP_CONTIG_ORDER		UL(4)
+#define PMAP_CONTIG_PAGES		(UL(1) << PMAP_CONTIG_ORDER)
+#define PMAP_CONTIG_SIZE		(PMAP_CONTIG_PAGES * TT_L3_SIZE)
+
 /**
  * MMU helpers. These are external declarations of assembly function. There are
  * two Translation Table Base Registers (TTBRn_EL1) for the kernel to use, so
@@ -78,6 +91,12 @@ extern phys_addr_t mmu_get_tt_base_alt ();
 /* Use the MMU to translate virtual addresses */
 extern phys_addr_t mmu_translate_kvtop (vm_address_t);
 
+/* Invalidate the TLB entries for a virtual address */
+extern void mmu_tlb_flush_vaddr (vm_address_t);
+
+/* Make translation table writes visible to the table walker */
+extern void mmu_tt_sync ();
+
 /* Convert translation table entry addresses */
 #define ptokva(__p)		((vm_address_t)(__p) - memory_phys_base + memory_virt_base)
 
@@ -109,6 +128,33 @@ typedef struct pmap {
 /* Maximum number of pmaps */
 #define PMAP_LIST_MAX		UL(2)
 
+/**
+ * Physical page windows
+ *
+ * Physical pages aren't mapped into the kernel until they're given to a
+ * vm_map, so each CPU has a window in the kernel address space which can be
+ * pointed at any physical page, for example to zero it. The window is the size
+ * of the smallest mapping pmap_tt_create_tte creates.
+*/
+#define PMAP_WINDOW_BASE		DEFAULTS_KERNEL_VM_WINDOW_BASE
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+#define PMAP_WINDOW_SIZE		TT_L3_SIZE
+#else
+#define PMAP_WINDOW_SIZE		TT_L2_SIZE
+#endif
+
+/**
+ * Translation table pool
+ *
+ * The pagetables region only has room for the first few tables. Once it's used
+ * up, tables are carved out of huge pages from vm_page instead. Each huge page
+ * is mapped with a single block entry in the pool's own 1GB region, so a table
+ * can be reached from the physical address in its descriptor without needing
+ * another table to map it.
+*/
+#define PMAP_TABLE_POOL_BASE	DEFAULTS_KERNEL_VM_TABLE_BASE
+#define PMAP_TABLE_POOL_CHUNKS	(TT_L1_SIZE / TT_L2_SIZE)
+
 /* Memory bases */
 extern vm_address_t		memory_virt_base;
 extern vm_address_t		memory_phys_base;
@@ -129,10 +175,30 @@ extern pmap_return_t	pmap_ptregion_create ();
 extern vm_address_t		pmap_ptregion_alloc ();
 
 /* translation table management */
+extern void				pmap_table_pool_init ();
+extern tt_table_t		*pmap_tt_ptokva (phys_addr_t);
 extern pmap_return_t	pmap_tt_create_tte (tt_table_t *, phys_addr_t, 
 											vm_address_t, vm_size_t,
 											vm_flags_t);
 extern pmap_return_t	pmap_map_page (pmap_t *, phys_addr_t);
+extern pmap_return_t	pmap_enter_range (pmap_t *, vm_address_t,
+											const phys_addr_t *, vm_size_t,
+											vm_flags_t);
+extern tt_entry_t		*pmap_tt_lookup (tt_table_t *, vm_address_t,
+											vm_size_t *);
+extern pmap_return_t	pmap_tt_remove_tte (tt_table_t *, vm_address_t,
+											vm_size_t);
+extern phys_addr_t		pmap_extract (tt_table_t *, vm_address_t);
+
+/* copy-on-write */
+extern pmap_return_t	pmap_copy_on_write (tt_table_t *src, tt_table_t *dst,
+											vm_address_t vaddr);
+extern pmap_return_t	pmap_fault_copy_on_write (vm_address_t vaddr);
+
+/* physical page windows */
+extern void				pmap_window_init ();
+extern vm_address_t		pmap_window_map (phys_addr_t paddr);
+extern void				pmap_zero_page (phys_addr_t paddr);
 
 /* pmap */
 extern int				pmap_create_kernel_pmap (pmap_t *kernel_pmap);
@@ -29,6 +29,9 @@
 #include <libkern/assert.h>
 #include <libkern/boot.h>
 #include <libkern/list.h>
+#include <libkern/panic.h>
+
+#include <platform/platform.h>
 
 #include <arch/proc_reg.h>
 
@@ -49,7 +52,14 @@ static vm_address_t	kernel_virt_base;
 /* kernel pmap and vm_map */
 static struct pmap 	kernel_pmap_ref __attribute__((section(".data")));
 static pmap_t 		*kernel_pmap = &kernel_pmap_ref;
-static vm_map_t		*kernel_vm_map = (&kernel_pmap_ref + sizeof(task_t));
+static vm_map_t		kernel_vm_map_ref __attribute__((section(".data")));
+static vm_map_t		*kernel_vm_map = &kernel_vm_map_ref;
+
+/* kernel virtual address arenas */
+static vmem_t		kernel_va_arena __attribute__((section(".data")));
+static vmem_t		kernel_heap_arena __attribute__((section(".data")));
+static vmem_t		kernel_stack_arena __attribute__((section(".data")));
+static vmem_t		kernel_mmio_arena __attribute__((section(".data")));
 
 
 /* temporary, for debugging */
@@ -85,6 +95,20 @@ vm_map_t *vm_get_kernel_map()
 	return (vm_map_t *) kernel_vm_map;
 }
 
+vmem_t *vm_get_kernel_arena (int type)
+{
+	switch (type) {
+		case VM_ARENA_HEAP:
+			return &kernel_heap_arena;
+		case VM_ARENA_STACK:
+			return &kernel_stack_arena;
+		case VM_ARENA_MMIO:
+			return &kernel_mmio_arena;
+		default:
+			return NULL;
+	}
+}
+
 kern_return_t vm_is_address_valid(vm_address_t addr)
 {
 	/**
@@ -103,20 +127,101 @@ kern_return_t vm_is_address_valid(vm_address_t addr)
 
 void vm_configure (void)
 {
+	platform_memory_range_t ranges[PLATFORM_MEMORY_RANGES_MAX];
+	platform_memory_range_t reserved[PLATFORM_RESERVED_RANGES_MAX];
+	unsigned int nranges, nreserved;
+
 	/**
-	 * Create the vm_page's for the entire non-secure memory region. We do not
-	 * create pages for device memory. The kernel is placed at the lowest usable
-	 * physical memory address.
+	 * Create the vm_page's for every physical memory range in the device tree,
+	 * excluding reserved memory. We do not create pages for device memory.
 	*/
-	vm_page_bootstrap (kernel_phys_base, memory_phys_size, kernel_phys_size);
+	nranges = PLATFORM_MEMORY_RANGES_MAX;
+	if (platform_get_memory_ranges (ranges, &nranges) != KERN_RETURN_SUCCESS)
+		panic ("failed to find any physical memory ranges\n");
+
+	nreserved = PLATFORM_RESERVED_RANGES_MAX;
+	platform_get_reserved_memory (reserved, &nreserved);
+
+	vm_page_bootstrap (ranges, nranges, reserved, nreserved, kernel_phys_base,
+		kernel_phys_size);
 
 	/**
-	 * Create the kernel tasks vm_map just after the pmap structure. This is all
-	 * (hopefully) within a single 4KB page.
+	 * Create the kernel tasks vm_map. Its entries come from the map's reserve
+	 * until vm_map_init creates the entry zone.
 	*/
-	vm_map_create(kernel_vm_map, &kernel_pmap, kernel_virt_base, VM_KERNEL_MAX_ADDRESS);
+	vm_map_create(kernel_vm_map, kernel_pmap, kernel_virt_base, VM_KERNEL_MAX_ADDRESS);
 	vm_map_entry_create(kernel_vm_map, kernel_virt_base, kernel_phys_size, VM_ALLOC_KERNEL_CODE);
 
+	/* kernel map allocations take their addresses from the heap arena */
+	kernel_vm_map->arena = &kernel_heap_arena;
+
+}
+
+/*******************************************************************************
+ * Name:	vm_map_peripheral
+ * Desc:	Map a peripheral's physical registers into the kernel, at an address
+ * 			allocated from the MMIO arena, and return the virtual address of
+ * 			'paddr'. Mappings are made in units of PMAP_WINDOW_SIZE, so the
+ * 			region is aligned to it and may cover neighbouring registers.
+*******************************************************************************/
+
+vm_address_t vm_map_peripheral (vm_address_t paddr, vm_size_t size)
+{
+	vm_address_t alloc_base, vbase;
+	vm_size_t offset, map_size, alloc_size;
+
+	offset = paddr & (PMAP_WINDOW_SIZE - 1);
+	map_size = (offset + size + PMAP_WINDOW_SIZE - 1) & ~(PMAP_WINDOW_SIZE - 1);
+
+	/* allocate enough to align the mapping, and free what's left either side */
+	alloc_size = map_size + PMAP_WINDOW_SIZE - VM_PAGE_SIZE;
+	alloc_base = vmem_alloc(&kernel_mmio_arena, alloc_size);
+	if (alloc_base == VMEM_NULL) {
+		vm_log("error: no space to map peripheral at 0x%lx\n", paddr);
+		return VM_NULL;
+	}
+
+	vbase = (alloc_base + PMAP_WINDOW_SIZE - 1) & ~(PMAP_WINDOW_SIZE - 1);
+	if (vbase > alloc_base)
+		vmem_free(&kernel_mmio_arena, alloc_base, vbase - alloc_base);
+	if (alloc_base + alloc_size > vbase + map_size)
+		vmem_free(&kernel_mmio_arena, vbase + map_size,
+			(alloc_base + alloc_size) - (vbase + map_size));
+
+	pmap_tt_create_tte (kernel_tte, paddr - offset, vbase, map_size,
+		PMAP_ACCESS_READWRITE);
+	return vbase + offset;
+}
+
+/*******************************************************************************
+ * Name:	__vm_arena_create
+ * Desc:	Create the kernel virtual address arenas. The kernel map's range is
+ * 			shared by the heap and stack arenas, and the peripheral region by
+ * 			the MMIO arena. The kernel binary and boot console are mapped
+ * 			before the arenas exist, so their ranges are reserved here.
+*******************************************************************************/
+
+static void __vm_arena_create (vm_size_t console_size)
+{
+	vmem_create(&kernel_va_arena, "kernel.va", kernel_virt_base,
+		(VM_KERNEL_MAX_ADDRESS + 1) - kernel_virt_base, VM_PAGE_SIZE, NULL,
+		0, 0);
+	if (vmem_xalloc(&kernel_va_arena, kernel_phys_size, kernel_virt_base) ==
+		VMEM_NULL)
+		panic("failed to reserve kernel virtual address range\n");
+
+	vmem_create(&kernel_heap_arena, "kernel.heap", 0, 0, VM_PAGE_SIZE,
+		&kernel_va_arena, VM_PAGE_HUGE_SIZE, VM_ARENA_QCACHE_MAX);
+	vmem_create(&kernel_stack_arena, "kernel.stack", 0, 0, VM_PAGE_SIZE,
+		&kernel_va_arena, VM_PAGE_HUGE_SIZE, VM_ARENA_QCACHE_MAX);
+
+	vmem_create(&kernel_mmio_arena, "kernel.mmio",
+		DEFAULTS_KERNEL_VM_PERIPH_BASE,
+		PMAP_WINDOW_BASE - DEFAULTS_KERNEL_VM_PERIPH_BASE, VM_PAGE_SIZE, NULL,
+		0, VM_ARENA_QCACHE_MAX);
+	if (vmem_xalloc(&kernel_mmio_arena, (console_size + PMAP_WINDOW_SIZE - 1) &
+		~(PMAP_WINDOW_SIZE - 1), DEFAULTS_KERNEL_VM_PERIPH_BASE) == VMEM_NULL)
+		panic("failed to reserve console virtual address range\n");
 }
 
 /*******************************************************************************
@@ -153,6 +258,10 @@ void arm_vm_init (struct boot_args *args, phys_addr_t membase, phys_size_t memsi
 	invalid_tte = (tt_table_t *) pmap_ptregion_alloc ();
 	invalid_ttep = mmu_translate_kvtop (invalid_tte);
 
+	/* the kernel pmap uses the kernel pagetables */
+	kernel_pmap->tte = kernel_tte;
+	kernel_pmap->ttep = kernel_ttep;
+
 	/**
 	 * tBoot passes two regions to map before configuring the rest of the virtual
 	 * memory system: kernel and console.
@@ -170,10 +279,18 @@ void arm_vm_init (struct boot_args *args, phys_addr_t membase, phys_size_t memsi
 	pmap_tt_create_tte (kernel_tte, kernel_phys_base, kernel_virt_base, kernel_phys_size, PMAP_ACCESS_READWRITE);
 	pmap_tt_create_tte (kernel_tte, args->uartbase, console_virt_base, args->uartsize, PMAP_ACCESS_READWRITE);
 
+	/* create the tables for the per-cpu page windows up front */
+	pmap_window_init ();
+
+	/* and for the table pool, which takes over once the region is full */
+	pmap_table_pool_init ();
+
 	/* switch the mmu to use the new translation tables */
 	mmu_set_tt_base_alt (kernel_ttep & TTBR_BADDR_MASK);
 	mmu_set_tt_base (kernel_ttep & TTBR_BADDR_MASK);
 
+	/* kernel virtual addresses are allocated from arenas from here on */
+	__vm_arena_create (args->uartsize);
 }
 
 void vm_debug_overview ()
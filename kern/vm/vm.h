@@ -29,6 +29,8 @@
 
 #include <tinylibc/stdint.h>
 #include <kern/vm/vm_types.h>
+#include <kern/vm/vmem.h>
+#include <libkern/types.h>
 #include <libkern/boot.h>
 
 /* Interface logger */
@@ -38,6 +40,18 @@
 #define VM_KERNEL_MIN_ADDRESS		((vm_address_t) 0xffffffe000000000ULL)
 #define VM_KERNEL_MAX_ADDRESS		((vm_address_t) 0xfffffff3ffffffffULL)
 
+/**
+ * Kernel virtual address arenas. The heap and stack arenas import their spans
+ * from the kernel map's address range, and the MMIO arena covers the
+ * peripheral region between DEFAULTS_KERNEL_VM_PERIPH_BASE and the page
+ * windows. Ranges of up to VM_ARENA_QCACHE_MAX are cached.
+*/
+#define VM_ARENA_HEAP				(0x0)
+#define VM_ARENA_STACK				(0x1)
+#define VM_ARENA_MMIO				(0x2)
+
+#define VM_ARENA_QCACHE_MAX			(8 * VM_PAGE_SIZE)
+
 /* Memory protection types */
 #define VM_PROT_NONE				((vm_prot_t) 0x0)
 #define VM_PROT_READ				((vm_prot_t) 0x1)
@@ -56,4 +70,10 @@ extern void arm_vm_init		(struct boot_args *args,
 
 extern void vm_configure	(void);
 
+extern kern_return_t vm_is_address_valid (vm_address_t addr);
+
+/* Kernel virtual address arenas, and peripheral mappings */
+extern vmem_t *vm_get_kernel_arena (int type);
+extern vm_address_t vm_map_peripheral (vm_address_t paddr, vm_size_t size);
+
 #endif /* __kern_vm_h__ */
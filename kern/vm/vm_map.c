@@ -22,48 +22,357 @@
 #include <kern/vm/vm_page.h>
 #include <kern/vm/vm_map.h>
 #include <kern/vm/pmap.h>
+#include <kern/mm/zalloc.h>
 
 #include <libkern/assert.h>
+#include <libkern/panic.h>
 #include <tinylibc/string.h>
 
+/* zone of vm_map entries, and whether an entry is being allocated from it */
+static zone_t	*vm_map_entry_zone = NULL;
+static int		vm_map_entry_zone_busy = VM_FALSE;
+
 /*******************************************************************************
- * Name:	vm_map_entry_create
- * Desc:	Create a new entry within a vm_map for the given base address and
- * 			size. This does not allocate the 'size' of memory at 'base', it is
- * 			expected that this has already been done.
+ * Name:	vm_map_init
+ * Desc:	Create the zone that vm_map entries are allocated from. Until then,
+ * 			entries come from each map's reserve.
 *******************************************************************************/
 
-void vm_map_entry_create (vm_map_t *map, vm_address_t base, vm_size_t size,
-	vm_flags_t flags)
+void vm_map_init (void)
+{
+	vm_map_entry_zone = zone_create(VM_MAP_ENTRY_SIZE,
+		VM_MAP_ENTRY_ZONE_MAX_SIZE, "vm_map.entries");
+	if (vm_map_entry_zone == NULL)
+		panic("vm_map: failed to create entry zone\n");
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_entry_alloc
+ * Desc:	Allocate an entry from the entry zone. If the zone doesn't exist yet,
+ * 			or this is called while it's growing (which needs an entry in the
+ * 			kernel map), an entry is taken from the map's reserve instead.
+*******************************************************************************/
+
+static vm_map_entry_t *__vm_map_entry_alloc (vm_map_t *map)
 {
 	vm_map_entry_t *entry;
+	int idx;
 
-	/* lock the map while we make critical changes */
-	vm_map_lock(map);
+	if (vm_map_entry_zone && !vm_map_entry_zone_busy) {
+		vm_map_entry_zone_busy = VM_TRUE;
+		entry = (vm_map_entry_t *) zalloc(vm_map_entry_zone);
+		vm_map_entry_zone_busy = VM_FALSE;
+
+		if (entry)
+			return entry;
+	}
+
+	if ((idx = __builtin_ffs(~map->reserve_used) - 1) < 0 ||
+		idx >= VM_MAP_ENTRY_RESERVE)
+		panic("vm_map: out of reserved entries for map 0x%lx\n", map);
+
+	map->reserve_used |= (1 << idx);
+	return &map->reserve[idx];
+}
+
+/* return an entry to the reserve, or the entry zone */
+static void __vm_map_entry_free (vm_map_t *map, vm_map_entry_t *entry)
+{
+	if (entry >= &map->reserve[0] && entry < &map->reserve[VM_MAP_ENTRY_RESERVE]) {
+		map->reserve_used &= ~(1 << (entry - &map->reserve[0]));
+		return;
+	}
+	zfree(vm_map_entry_zone, (vm_address_t) entry);
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_reserve_refill
+ * Desc:	Move any entries using the map's reserve into the entry zone, so the
+ * 			reserve is available for the next time the zone grows.
+*******************************************************************************/
+
+static void __vm_map_reserve_refill (vm_map_t *map)
+{
+	vm_map_entry_t *old, *new;
+	int idx;
+
+	while (map->reserve_used && vm_map_entry_zone && !vm_map_entry_zone_busy) {
+		vm_map_entry_zone_busy = VM_TRUE;
+		new = (vm_map_entry_t *) zalloc(vm_map_entry_zone);
+		vm_map_entry_zone_busy = VM_FALSE;
+
+		/* growing the zone can use the reserve, so check again */
+		if (new == NULL || (idx = __builtin_ffs(map->reserve_used) - 1) < 0) {
+			if (new)
+				zfree(vm_map_entry_zone, (vm_address_t) new);
+			return;
+		}
+
+		old = &map->reserve[idx];
+		memcpy(new, old, VM_MAP_ENTRY_SIZE);
+		list_replace(&old->siblings, &new->siblings);
+		rb_replace_node(&old->rb_node, &new->rb_node, &map->entries_tree);
+		if (map->hint == old)
+			map->hint = new;
+
+		map->reserve_used &= ~(1 << idx);
+	}
+}
+
+/*******************************************************************************
+ * Free space tracking
+ * 
+ * Each entry records the size of the unallocated gap between it and the entry
+ * before it (or the start of the map), and the tree is augmented with the
+ * largest gap in each subtree. The lowest gap large enough for an allocation
+ * can then be found in O(log n), without visiting every entry.
+*******************************************************************************/
+
+static vm_size_t __vm_map_entry_gap (vm_map_t *map, vm_map_entry_t *entry)
+{
+	vm_map_entry_t *prev;
+
+	if (entry->siblings.prev == &map->entries)
+		return (entry->base > map->min) ? entry->base - map->min : 0;
+
+	prev = list_entry(entry->siblings.prev, vm_map_entry_t, siblings);
+	return entry->base - (prev->base + prev->size + 1);
+}
+
+static void __vm_map_entry_augment (rb_node_t *node)
+{
+	vm_map_entry_t *entry, *child;
+	vm_size_t max_gap;
+
+	entry = rb_entry(node, vm_map_entry_t, rb_node);
+	max_gap = entry->gap;
+
+	if (node->left) {
+		child = rb_entry(node->left, vm_map_entry_t, rb_node);
+		if (child->max_gap > max_gap)
+			max_gap = child->max_gap;
+	}
+	if (node->right) {
+		child = rb_entry(node->right, vm_map_entry_t, rb_node);
+		if (child->max_gap > max_gap)
+			max_gap = child->max_gap;
+	}
+	entry->max_gap = max_gap;
+}
+
+/* recompute the gap of the entry following a list node, if there is one */
+static void __vm_map_update_gap (vm_map_t *map, list_node_t *node)
+{
+	vm_map_entry_t *entry;
+
+	if (node == &map->entries)
+		return;
+
+	entry = list_entry(node, vm_map_entry_t, siblings);
+	entry->gap = __vm_map_entry_gap(map, entry);
+	rb_augment_propagate(&entry->rb_node, __vm_map_entry_augment);
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_find_space
+ * Desc:	Find the lowest unallocated region of at least 'size' bytes in the
+ * 			map, either in a gap before an entry, or after the last one.
+*******************************************************************************/
+
+static kern_return_t __vm_map_find_space (vm_map_t *map, vm_size_t size,
+						vm_address_t *addr)
+{
+	vm_map_entry_t *entry, *last;
+	rb_node_t *node;
 
-	/* determine the base address of the next map entry */
 	if (list_empty(&map->entries)) {
-		entry = (vm_map_entry_t *) (map + sizeof(vm_map_t));
-	} else {
-		entry = list_last_entry(&map->entries, vm_map_entry_t, siblings) +
-			VM_MAP_ENTRY_SIZE;
+		if (size - 1 > map->max - map->min)
+			return KERN_RETURN_FAIL;
+		*addr = map->min;
+		return KERN_RETURN_SUCCESS;
+	}
+
+	node = map->entries_tree.node;
+	if (rb_entry(node, vm_map_entry_t, rb_node)->max_gap >= size) {
+		while (node) {
+			entry = rb_entry(node, vm_map_entry_t, rb_node);
+
+			if (node->left &&
+				rb_entry(node->left, vm_map_entry_t, rb_node)->max_gap >= size) {
+				node = node->left;
+			} else if (entry->gap >= size) {
+				*addr = entry->base - entry->gap;
+				return KERN_RETURN_SUCCESS;
+			} else {
+				node = node->right;
+			}
+		}
 	}
+
+	last = list_last_entry(&map->entries, vm_map_entry_t, siblings);
+	if (map->max - (last->base + last->size) < size)
+		return KERN_RETURN_FAIL;
+
+	*addr = last->base + last->size + 1;
+	return KERN_RETURN_SUCCESS;
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_entry_insert
+ * Desc:	Add an allocated entry to a vm_map for the given base address and
+ * 			size. The entry is added to the map's tree, and to the list of
+ * 			entries after the entry before it, so the list stays in address
+ * 			order. An entry overlapping an existing one is a bug, so this panics.
+*******************************************************************************/
+
+static void __vm_map_entry_insert (vm_map_t *map, vm_map_entry_t *entry,
+						vm_address_t base, vm_size_t size, vm_flags_t flags)
+{
+	vm_map_entry_t *cur, *prev;
+	rb_node_t **link, *parent;
+
+	/* lock the map while we make critical changes */
+	vm_map_lock(map);
+
 	memset(entry, '\0', VM_MAP_ENTRY_SIZE);
 
 	entry->base = base;
 	entry->size = size - 1;
 	entry->guard_page = (flags & VM_MAP_ENTRY_GUARD_PAGE) ? VM_TRUE : VM_FALSE;
 	entry->kernel_code = (flags & VM_ALLOC_KERNEL_CODE) ? VM_TRUE : VM_FALSE;
+	entry->lazy = (flags & VM_ALLOC_LAZY) ? VM_TRUE : VM_FALSE;
+	entry->stack = (flags & VM_ALLOC_STACK) ? VM_TRUE : VM_FALSE;
+	entry->huge = (flags & VM_ALLOC_HUGE) ? VM_TRUE : VM_FALSE;
+
+	/* find where the entry belongs in the tree, and the entry before it */
+	link = &map->entries_tree.node;
+	parent = NULL;
+	prev = NULL;
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, vm_map_entry_t, rb_node);
+
+		if (entry->base + entry->size < cur->base) {
+			link = &parent->left;
+		} else if (entry->base > cur->base + cur->size) {
+			prev = cur;
+			link = &parent->right;
+		} else {
+			panic("vm_map: entry 0x%lx-0x%lx overlaps existing entry 0x%lx-0x%lx\n",
+				entry->base, entry->base + entry->size, cur->base,
+				cur->base + cur->size);
+		}
+	}
+	/* add the entry to the map's list */
+	list_add(&entry->siblings, (prev) ? &prev->siblings : &map->entries);
+
+	/* the entry splits the gap before the next entry */
+	entry->gap = __vm_map_entry_gap(map, entry);
+	rb_link_node(&entry->rb_node, parent, link);
+	rb_insert_augmented(&entry->rb_node, &map->entries_tree,
+		__vm_map_entry_augment);
+	__vm_map_update_gap(map, entry->siblings.next);
 
 	map->nentries += 1;
 	map->size += size;
 
-	/* add the entry to the map's list */
-	list_add_tail(&entry->siblings, &map->entries);
+	vm_map_unlock(map);
+}
+
+/*******************************************************************************
+ * Name:	vm_map_entry_create
+ * Desc:	Create a new entry within a vm_map for the given base address and
+ * 			size. This does not allocate the 'size' of memory at 'base', it is
+ * 			expected that this has already been done.
+*******************************************************************************/
+
+void vm_map_entry_create (vm_map_t *map, vm_address_t base, vm_size_t size,
+	vm_flags_t flags)
+{
+	__vm_map_entry_insert(map, __vm_map_entry_alloc(map), base, size, flags);
+	__vm_map_reserve_refill(map);
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_entry_remove
+ * Desc:	Remove an entry from a vm_map, adding its range to the gap before the
+ * 			next entry. The caller frees the entry.
+*******************************************************************************/
+
+static void __vm_map_entry_remove (vm_map_t *map, vm_map_entry_t *entry)
+{
+	list_node_t *next;
+
+	vm_map_lock(map);
+
+	next = entry->siblings.next;
+	rb_erase_augmented(&entry->rb_node, &map->entries_tree,
+		__vm_map_entry_augment);
+	list_del(&entry->siblings);
+	__vm_map_update_gap(map, next);
+
+	if (map->hint == entry)
+		map->hint = NULL;
+
+	map->nentries -= 1;
+	map->size -= entry->size + 1;
 
 	vm_map_unlock(map);
 }
 
+/*******************************************************************************
+ * Name:	vm_map_lookup_entry
+ * Desc:	Find the entry containing a virtual address, or NULL if the address
+ * 			hasn't been allocated in the map. The last entry found is kept as a
+ * 			hint, as repeated lookups (such as faults) tend to hit the same one.
+*******************************************************************************/
+
+vm_map_entry_t *vm_map_lookup_entry (vm_map_t *map, vm_address_t addr)
+{
+	vm_map_entry_t *entry;
+	rb_node_t *node;
+
+	entry = map->hint;
+	if (entry && addr >= entry->base && addr <= entry->base + entry->size)
+		return entry;
+
+	node = map->entries_tree.node;
+	while (node) {
+		entry = rb_entry(node, vm_map_entry_t, rb_node);
+
+		if (addr < entry->base) {
+			node = node->left;
+		} else if (addr > entry->base + entry->size) {
+			node = node->right;
+		} else {
+			map->hint = entry;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* find the lowest entry ending at or after an address */
+static vm_map_entry_t *__vm_map_lookup_next (vm_map_t *map, vm_address_t addr)
+{
+	vm_map_entry_t *entry, *found;
+	rb_node_t *node;
+
+	found = NULL;
+	node = map->entries_tree.node;
+	while (node) {
+		entry = rb_entry(node, vm_map_entry_t, rb_node);
+
+		if (entry->base + entry->size < addr) {
+			node = node->right;
+		} else {
+			found = entry;
+			node = node->left;
+		}
+	}
+	return found;
+}
+
 /*******************************************************************************
  * Locking for vm_map_t
  * 
@@ -100,12 +409,12 @@ static void __vm_map_init (vm_map_t *map, pmap_t *pmap, vm_address_t min,
 	map->lock = 1;
 
 	INIT_LIST_HEAD(&map->entries);
+	INIT_RB_ROOT(&map->entries_tree);
+	map->hint = NULL;
 
-	/**
-	 * Map entries should follow the map structure in memory. We'll set the
-	 * entries pointer to directly after the map.
-	*/
+	map->reserve_used = 0;
 	map->nentries = 0;
+	map->arena = NULL;
 }
 
 /*******************************************************************************
@@ -145,6 +454,10 @@ vm_map_t *vm_map_create_new (pmap_t *pmap, vm_address_t min, vm_address_t max)
 	map.nentries = 0;
 
 	INIT_LIST_HEAD(&map.entries);
+	INIT_RB_ROOT(&map.entries_tree);
+	map.hint = NULL;
+	map.reserve_used = 0;
+	map.arena = NULL;
 
 	entry.base = min;
 	entry.size = VM_PAGE_SIZE;
@@ -155,67 +468,501 @@ vm_map_t *vm_map_create_new (pmap_t *pmap, vm_address_t min, vm_address_t max)
 	pmap_tt_create_tte(ttep, paddr, min, VM_PAGE_SIZE, PMAP_ACCESS_READWRITE);
 }
 
+/* arena that an allocation's addresses come from, if the map has any */
+static vmem_t *__vm_map_arena (vm_map_t *map, vm_flags_t flags)
+{
+	if (map->arena == NULL)
+		return NULL;
+	return (flags & VM_ALLOC_STACK) ? vm_get_kernel_arena(VM_ARENA_STACK) :
+		map->arena;
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_release_pages
+ * Desc:	Unmap a page-aligned virtual region, and release the physical pages
+ * 			backing it. Pages shared copy-on-write are only freed once the last
+ * 			reference is dropped. Block entries below 'huge_end' map huge pages,
+ * 			which are freed whole, and the caller must not split them.
+ *
+ * 			Without level 3 tables, normal pages are also mapped with block
+ * 			entries, which are shared with the pages either side and can't be
+ * 			traced back to the pages behind them. These are only unmapped when
+ * 			the region covers the whole block.
+*******************************************************************************/
+
+static void __vm_map_release_pages (vm_map_t *map, vm_address_t start,
+						vm_address_t end, vm_address_t huge_end)
+{
+	vm_address_t vaddr;
+	phys_addr_t paddr;
+	vm_size_t leaf_size;
+	tt_table_t *table;
+
+	table = (tt_table_t *) map->pmap->tte;
+	for (vaddr = start; vaddr < end; vaddr += leaf_size) {
+		if (pmap_tt_lookup(table, vaddr, &leaf_size) == NULL) {
+			leaf_size = VM_PAGE_SIZE;
+			continue;
+		}
+		paddr = pmap_extract(table, vaddr);
+
+		if (leaf_size == VM_PAGE_SIZE) {
+			pmap_tt_remove_tte(table, vaddr, VM_PAGE_SIZE);
+			vm_page_ref_put(paddr);
+			continue;
+		}
+
+		if ((vaddr & (leaf_size - 1)) || end - vaddr < leaf_size) {
+			leaf_size -= vaddr & (leaf_size - 1);
+			continue;
+		}
+
+		pmap_tt_remove_tte(table, vaddr, leaf_size);
+		if (vaddr < huge_end)
+			vm_page_free_huge(paddr);
+	}
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_huge_end
+ * Desc:	Return the end of the part of an entry backed by huge pages, which
+ * 			is every whole 2MB from its base, or its base if it has none.
+*******************************************************************************/
+
+static vm_address_t __vm_map_huge_end (vm_map_entry_t *entry)
+{
+	if (!entry->huge)
+		return entry->base;
+	return entry->base + ((entry->size + 1) & ~(VM_PAGE_HUGE_SIZE - 1));
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_can_split
+ * Desc:	Return whether an entry can be split at 'addr' without splitting a
+ * 			block entry. Without level 3 tables, every page is mapped by one.
+*******************************************************************************/
+
+static int __vm_map_can_split (vm_map_entry_t *entry, vm_address_t addr)
+{
+	if (addr <= entry->base || addr > entry->base + entry->size ||
+		!(addr & (VM_PAGE_HUGE_SIZE - 1)))
+		return VM_TRUE;
+
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+	return (addr >= __vm_map_huge_end(entry)) ? VM_TRUE : VM_FALSE;
+#else
+	return VM_FALSE;
+#endif
+}
+
+/*******************************************************************************
+ * Name:	__vm_map_back_pages
+ * Desc:	Allocate and map zeroed physical pages for 'page_count' pages from
+ * 			'vbase'. With VM_ALLOC_HUGE, 'vbase' must be aligned to
+ * 			VM_PAGE_HUGE_SIZE, and every whole 2MB of the region is backed by a
+ * 			huge page, each mapped with a single block entry. If they can't all
+ * 			be allocated, none are used, so the entry can record whether it's
+ * 			backed by huge pages. Returns VM_TRUE if it is.
+ *
+ * 			Other pages are mapped in batches with pmap_enter_range. Each
+ * 			aligned run of PMAP_CONTIG_PAGES is backed by a single block of
+ * 			pages where one is free, so the run can use the contiguous hint.
+*******************************************************************************/
+
+static int __vm_map_back_pages (vm_map_t *map, vm_address_t vbase,
+						vm_size_t page_count, vm_flags_t flags)
+{
+	phys_addr_t pages[VM_MAP_ENTER_BATCH];
+	vm_address_t vcursor;
+	phys_addr_t page_addr;
+	vm_size_t count;
+	pmap_t *pmap;
+	int huge;
+
+	pmap = map->pmap;
+	vcursor = vbase;
+	huge = (flags & VM_ALLOC_HUGE) ? VM_TRUE : VM_FALSE;
+
+	/* back every whole 2MB with a huge page, or give them all back */
+	while (huge && page_count >= VM_PAGE_HUGE_PAGES) {
+		if ((page_addr = vm_page_alloc_huge()) == VM_PAGE_NULL) {
+			__vm_map_release_pages(map, vbase, vcursor, vcursor);
+			page_count += (vcursor - vbase) / VM_PAGE_SIZE;
+			vcursor = vbase;
+			huge = VM_FALSE;
+			break;
+		}
+
+		for (int i = 0; i < VM_PAGE_HUGE_PAGES; i++)
+			pmap_zero_page(page_addr + (i * VM_PAGE_SIZE));
+
+		pmap_tt_create_tte(pmap->tte, page_addr, vcursor, VM_PAGE_HUGE_SIZE,
+			PMAP_ACCESS_READWRITE | PMAP_MAP_BLOCK);
+
+		vcursor += VM_PAGE_HUGE_SIZE;
+		page_count -= VM_PAGE_HUGE_PAGES;
+	}
+
+	while (page_count) {
+		for (count = 0; count < VM_MAP_ENTER_BATCH && count < page_count;) {
+			/* a batch ends at an aligned run it hasn't room for */
+			if (!((vcursor + count * VM_PAGE_SIZE) & (PMAP_CONTIG_SIZE - 1)) &&
+				page_count - count >= PMAP_CONTIG_PAGES) {
+				if (VM_MAP_ENTER_BATCH - count < PMAP_CONTIG_PAGES)
+					break;
+
+				/* fall back to single pages rather than reclaim memory */
+				page_addr = vm_page_try_alloc_order(PMAP_CONTIG_ORDER);
+				if (page_addr != VM_PAGE_NULL) {
+					for (int i = 0; i < PMAP_CONTIG_PAGES; i++) {
+						pmap_zero_page(page_addr + (i * VM_PAGE_SIZE));
+						pages[count++] = page_addr + (i * VM_PAGE_SIZE);
+					}
+					continue;
+				}
+			}
+			pages[count++] = vm_page_alloc_zeroed();
+		}
+
+		pmap_enter_range(pmap, vcursor, pages, count, PMAP_ACCESS_READWRITE);
+		vcursor += count * VM_PAGE_SIZE;
+		page_count -= count;
+	}
+	return huge;
+}
+
+/*******************************************************************************
+ * Name:	vm_map_guard_page
+ * Desc:	Map a guard page at the given address. With level 3 tables the page
+ * 			is left unmapped, so any access faults. Otherwise, it can only be
+ * 			backed by a page filled with VM_PAGE_GUARD_MAGIC, which can be
+ * 			checked for corruption.
+*******************************************************************************/
+
+static void vm_map_guard_page(vm_map_t *map, vm_address_t vaddr)
+{
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+	pmap_tt_create_tte(map->pmap->tte, 0, vaddr, VM_PAGE_SIZE,
+		PMAP_ACCESS_NOACCESS);
+#else
+	pmap_tt_create_tte(map->pmap->tte, vm_page_alloc(), vaddr, VM_PAGE_SIZE,
+		PMAP_ACCESS_NOACCESS);
+	vm_guard_page_fill(vaddr);
+#endif
+}
+
 /*******************************************************************************
  * Name:	vm_map_alloc
  * Desc:	Allocate virtual memory for a given size within the provided vm_map,
  * 			and create corresponding entries in the mmu translation tables so
  * 			the allocation is immediately accessible.
  * 
- * 			This allocator makes sequential vm_map_entry's, meaning each entry
- * 			is placed one-after-the-other.
+ * 			The allocation is placed in the lowest gap between entries which
+ * 			fits it and its guard pages, or after the last entry. If the map
+ * 			has an arena, as the kernel map does, the region is allocated from
+ * 			that instead, or from the stack arena with VM_ALLOC_STACK.
+ *
+ * 			With VM_ALLOC_HUGE, the allocation is aligned to VM_PAGE_HUGE_SIZE
+ * 			and every whole 2MB of it is backed by a huge page, each mapped with
+ * 			a single block entry. The remainder is backed by normal pages, as is
+ * 			all of it if the huge pages can't all be allocated.
+ *
+ * 			With VM_ALLOC_LAZY, only the virtual region is reserved. Each page
+ * 			is allocated and mapped by vm_map_fault when it's first accessed,
+ * 			so huge pages aren't used. A single page can't be mapped without
+ * 			level 3 tables, so the region is backed straight away instead.
 *******************************************************************************/
 
 vm_address_t vm_map_alloc(vm_map_t *map, vm_size_t size, vm_flags_t flags)
 {
-	vm_address_t vbase, vcursor;
-	vm_map_entry_t *last_entry;
-	phys_addr_t page_addr;
-	vm_size_t page_count;
-	pmap_t *pmap;
+	vm_map_entry_t *entry, *guard_first, *guard_last;
+	vm_address_t vbase, alloc_base;
+	vm_size_t page_count, guard_size, total_size, used_size;
+	kern_return_t ret;
+	vmem_t *arena;
+
+	/**
+	 * allocate the entries first. this can grow the entry zone, which allocates
+	 * from the kernel map, so must be done before looking for space.
+	*/
+	entry = __vm_map_entry_alloc(map);
+	guard_first = (flags & VM_ALLOC_GUARD_FIRST) ? __vm_map_entry_alloc(map) : NULL;
+	guard_last = (flags & VM_ALLOC_GUARD_LAST) ? __vm_map_entry_alloc(map) : NULL;
+
+	/* allocate enough physical pages for the desired allocation size */
+	page_count = (size < VM_PAGE_SIZE) ? 1 : (VM_PAGE_ROUND(size) / VM_PAGE_SIZE);
 
-	pmap = &map->pmap;
+#if !DEFAULTS_KERNEL_VM_USE_L3_TABLE
+	/* faulted pages would be mapped with 2MB blocks, so back them now */
+	flags &= ~VM_ALLOC_LAZY;
+#endif
 
-	/* use the last entry to calculate the base virtual address for this one */
-	last_entry = list_last_entry(&map->entries, vm_map_entry_t, siblings);
+	if (!(flags & VM_ALLOC_HUGE) || (flags & VM_ALLOC_LAZY) ||
+		size < VM_PAGE_HUGE_SIZE)
+		flags &= ~VM_ALLOC_HUGE;
 
-	/* work out the base address for the allocation */
-	vcursor = vbase = (vm_address_t)
-		VM_ALIGN_ADDR(last_entry->base + last_entry->size + 1);
+	/* find room for the pages and guard pages, and to align huge pages */
+	guard_size = (flags & VM_ALLOC_GUARD_FIRST) ? VM_PAGE_SIZE : 0;
+	used_size = page_count * VM_PAGE_SIZE + guard_size +
+		((flags & VM_ALLOC_GUARD_LAST) ? VM_PAGE_SIZE : 0);
+	total_size = used_size +
+		((flags & VM_ALLOC_HUGE) ? VM_PAGE_HUGE_SIZE - VM_PAGE_SIZE : 0);
 
-	/* check if we need to allocate a guard page */
-	if (flags & VM_ALLOC_GUARD_FIRST) {
-		pmap_tt_create_tte(&pmap->tte, vm_page_alloc(), vcursor, VM_PAGE_SIZE,
-			PMAP_ACCESS_NOACCESS);
-		vm_map_entry_create(map, vcursor, VM_PAGE_SIZE, VM_MAP_ENTRY_GUARD_PAGE);
-		vm_guard_page_fill(vcursor);
-		vbase = vcursor += VM_PAGE_SIZE;
+	arena = __vm_map_arena(map, flags);
+	if (arena) {
+		vbase = vmem_alloc(arena, total_size);
+		ret = (vbase != VMEM_NULL) ? KERN_RETURN_SUCCESS : KERN_RETURN_FAIL;
+	} else {
+		ret = __vm_map_find_space(map, total_size, &vbase);
 	}
 
-	/* allocate enough physical pages for the desired allocation size */
-	page_count = (size < VM_PAGE_SIZE) ? 1 : (size / VM_PAGE_SIZE);
-	for (int i = 0; i < page_count; i++) {
-		page_addr = vm_page_alloc();
-		pmap_tt_create_tte(&pmap->tte, page_addr, vcursor, VM_PAGE_SIZE,
-			PMAP_ACCESS_READWRITE);
+	if (ret != KERN_RETURN_SUCCESS) {
+		vm_map_log("error: no space for 0x%lx bytes in vm_map 0x%lx\n",
+			size, map);
+		__vm_map_entry_free(map, entry);
+		if (guard_first)
+			__vm_map_entry_free(map, guard_first);
+		if (guard_last)
+			__vm_map_entry_free(map, guard_last);
+		return VM_NULL;
+	}
 
-		vcursor += VM_PAGE_SIZE;
+	/* huge pages must be aligned, leaving room for the guard page before */
+	alloc_base = vbase;
+	if (flags & VM_ALLOC_HUGE) {
+		vbase = ((vbase + guard_size + VM_PAGE_HUGE_SIZE - 1) &
+			~(VM_PAGE_HUGE_SIZE - 1)) - guard_size;
 	}
 
-	/* create the map entry for the allocated pages */
-	vm_map_entry_create(map, vbase, (vm_size_t) (page_count * VM_PAGE_SIZE),
-		VM_NULL);
+	/* give back whatever of the arena allocation aligning didn't use */
+	if (arena && vbase > alloc_base)
+		vmem_free(arena, alloc_base, vbase - alloc_base);
+	if (arena && alloc_base + total_size > vbase + used_size)
+		vmem_free(arena, vbase + used_size,
+			(alloc_base + total_size) - (vbase + used_size));
+	vbase += guard_size;
 
-	/* check if we need a guard page after the allocation */
-	if (flags & VM_ALLOC_GUARD_LAST) {
-		pmap_tt_create_tte(&pmap->tte, vm_page_alloc(), vcursor, VM_PAGE_SIZE,
-			PMAP_ACCESS_NOACCESS);
-		vm_guard_page_fill(vcursor);
-		vm_map_entry_create(map, vcursor, VM_PAGE_SIZE, VM_MAP_ENTRY_GUARD_PAGE);
+	/**
+	 * insert the entries before mapping anything, as allocating pages can
+	 * reclaim memory, which may change the map.
+	*/
+	__vm_map_entry_insert(map, entry, vbase, page_count * VM_PAGE_SIZE,
+		flags & (VM_ALLOC_LAZY | VM_ALLOC_STACK));
+	if (guard_first) {
+		__vm_map_entry_insert(map, guard_first, vbase - VM_PAGE_SIZE,
+			VM_PAGE_SIZE, VM_MAP_ENTRY_GUARD_PAGE | (flags & VM_ALLOC_STACK));
+		vm_map_guard_page(map, vbase - VM_PAGE_SIZE);
 	}
+	if (guard_last) {
+		__vm_map_entry_insert(map, guard_last, vbase + page_count * VM_PAGE_SIZE,
+			VM_PAGE_SIZE, VM_MAP_ENTRY_GUARD_PAGE | (flags & VM_ALLOC_STACK));
+		vm_map_guard_page(map, vbase + page_count * VM_PAGE_SIZE);
+	}
+
+	/* pages of a lazy allocation are mapped as they're faulted in */
+	if (!(flags & VM_ALLOC_LAZY))
+		entry->huge = __vm_map_back_pages(map, vbase, page_count, flags);
 
+	__vm_map_reserve_refill(map);
 	return vbase;
 }
 
+/*******************************************************************************
+ * Name:	vm_map_deallocate
+ * Desc:	Deallocate a virtual region of a vm_map, unmapping and freeing the
+ * 			physical pages backing it, so both can be reused. Entries partly
+ * 			covered by the region are shrunk or split to fit around it.
+ * 
+ * 			Kernel code can't be deallocated, and huge pages can't be split, so
+ * 			the map is left unchanged if the region covers any kernel code, or
+ * 			part of a huge page. Without level 3 tables, every entry can only be
+ * 			split on a 2MB boundary.
+*******************************************************************************/
+
+kern_return_t vm_map_deallocate (vm_map_t *map, vm_address_t addr,
+						vm_size_t size)
+{
+	vm_map_entry_t *entry, *next, *head, *tail;
+	vm_address_t vaddr, vend, start, end, ebase, eend, ehuge;
+	vm_flags_t eflags;
+	vmem_t *arena;
+	LIST_HEAD(removed);
+
+	vaddr = addr & ~(VM_PAGE_SIZE - 1);
+	vend = VM_PAGE_ROUND(addr + size);
+	if (size == 0 || vend <= vaddr)
+		return KERN_RETURN_FAIL;
+
+	/* check the whole region first, so nothing is removed on failure */
+	entry = __vm_map_lookup_next(map, vaddr);
+	while (entry && entry->base < vend) {
+		if (entry->kernel_code) {
+			vm_map_log("error: cannot deallocate kernel code at 0x%lx\n",
+				entry->base);
+			return KERN_RETURN_FAIL;
+		}
+		if (!__vm_map_can_split(entry, vaddr) ||
+			!__vm_map_can_split(entry, vend)) {
+			vm_map_log("error: cannot deallocate part of a block at 0x%lx\n",
+				entry->base);
+			return KERN_RETURN_FAIL;
+		}
+		if (list_is_last(&entry->siblings, &map->entries))
+			break;
+		entry = list_entry(entry->siblings.next, vm_map_entry_t, siblings);
+	}
+
+	/**
+	 * only the first and last entries can be left partly mapped, so at most
+	 * one entry is needed for either side. These are allocated first, as
+	 * allocating and freeing entries can place new allocations in the map,
+	 * and nothing may be placed in the region while it's being removed.
+	*/
+	head = __vm_map_entry_alloc(map);
+	tail = __vm_map_entry_alloc(map);
+
+	entry = __vm_map_lookup_next(map, vaddr);
+	while (entry && entry->base < vend) {
+		ebase = entry->base;
+		eend = entry->base + entry->size + 1;
+		ehuge = __vm_map_huge_end(entry);
+		eflags = ((entry->guard_page) ? VM_MAP_ENTRY_GUARD_PAGE : VM_NULL) |
+			((entry->lazy) ? VM_ALLOC_LAZY : VM_NULL) |
+			((entry->stack) ? VM_ALLOC_STACK : VM_NULL);
+
+		start = (ebase > vaddr) ? ebase : vaddr;
+		end = (eend < vend) ? eend : vend;
+
+		/* what's left either side keeps any whole huge pages it holds */
+		__vm_map_entry_remove(map, entry);
+		if (ebase < start) {
+			__vm_map_entry_insert(map, head, ebase, start - ebase,
+				eflags | ((ebase < ehuge) ? VM_ALLOC_HUGE : VM_NULL));
+			head = NULL;
+		}
+		if (end < eend) {
+			__vm_map_entry_insert(map, tail, end, eend - end,
+				eflags | ((end < ehuge) ? VM_ALLOC_HUGE : VM_NULL));
+			tail = NULL;
+		}
+		__vm_map_release_pages(map, start, end, ehuge);
+
+		/**
+		 * removed entries are freed once the whole region is gone, along with
+		 * the part of the region they covered if it came from an arena.
+		*/
+		entry->base = start;
+		entry->size = end - start - 1;
+		list_add(&entry->siblings, &removed);
+		entry = __vm_map_lookup_next(map, end);
+	}
+
+	list_for_each_entry_safe(entry, next, &removed, siblings) {
+		arena = __vm_map_arena(map, (entry->stack) ? VM_ALLOC_STACK : VM_NULL);
+		if (arena)
+			vmem_free(arena, entry->base, entry->size + 1);
+		__vm_map_entry_free(map, entry);
+	}
+	if (head)
+		__vm_map_entry_free(map, head);
+	if (tail)
+		__vm_map_entry_free(map, tail);
+
+	__vm_map_reserve_refill(map);
+	return KERN_RETURN_SUCCESS;
+}
+
+/*******************************************************************************
+ * Name:	vm_map_copy
+ * Desc:	Duplicate the entries of 'src' into the empty map 'dst'. Pages are
+ * 			not copied, instead they're shared read-only between both maps and
+ * 			only copied when either side first writes to them. Guard pages are
+ * 			recreated as entries, but left unmapped in 'dst', as are the pages
+ * 			of lazy entries which haven't been faulted in yet.
+ *
+ * 			Only page entries can be shared, so this always fails unless the
+ * 			level 3 tables are enabled with DEFAULTS_KERNEL_VM_USE_L3_TABLE.
+*******************************************************************************/
+
+kern_return_t vm_map_copy (vm_map_t *dst, vm_map_t *src)
+{
+	vm_map_entry_t *entry;
+	vm_address_t vaddr;
+	vm_size_t leaf_size;
+	pmap_return_t ret;
+
+#if !DEFAULTS_KERNEL_VM_USE_L3_TABLE
+	/* block mappings can't be shared, as page reference counts are per-page */
+	vm_map_log("error: vm_map_copy needs DEFAULTS_KERNEL_VM_USE_L3_TABLE\n");
+	return KERN_RETURN_FAIL;
+#endif
+
+	list_for_each_entry(entry, &src->entries, siblings) {
+		if (!entry->guard_page) {
+			for (vaddr = entry->base; vaddr <= entry->base + entry->size;
+				vaddr += VM_PAGE_SIZE) {
+				if (entry->lazy && pmap_tt_lookup((tt_table_t *) src->pmap->tte,
+					vaddr, &leaf_size) == NULL)
+					continue;
+
+				ret = pmap_copy_on_write(src->pmap->tte, dst->pmap->tte, vaddr);
+				if (ret != PMAP_RETURN_SUCCESS) {
+					vm_map_log("error: failed to share 0x%lx: %d\n", vaddr, ret);
+					return KERN_RETURN_FAIL;
+				}
+			}
+		}
+
+		vm_map_entry_create(dst, entry->base, entry->size + 1,
+			(entry->guard_page ? VM_MAP_ENTRY_GUARD_PAGE : VM_NULL) |
+			(entry->kernel_code ? VM_ALLOC_KERNEL_CODE : VM_NULL) |
+			(entry->lazy ? VM_ALLOC_LAZY : VM_NULL) |
+			(entry->stack ? VM_ALLOC_STACK : VM_NULL));
+	}
+
+	return KERN_RETURN_SUCCESS;
+}
+
+/*******************************************************************************
+ * Name:	vm_map_fault
+ * Desc:	Resolve a translation fault at 'addr' within a vm_map. If the address
+ * 			is part of a lazy allocation, a zeroed page is allocated and mapped
+ * 			there, and the faulting access can be retried. Any other address
+ * 			is a genuine fault, and KERN_RETURN_FAIL is returned.
+ *
+ * 			Without level 3 tables there are no lazy allocations, as the page
+ * 			would be mapped with a 2MB block, so every fault is genuine.
+*******************************************************************************/
+
+kern_return_t vm_map_fault (vm_map_t *map, vm_address_t addr)
+{
+	vm_map_entry_t *entry;
+	vm_address_t vaddr;
+	vm_size_t leaf_size;
+	tt_table_t *table;
+	phys_addr_t page_addr;
+
+#if !DEFAULTS_KERNEL_VM_USE_L3_TABLE
+	return KERN_RETURN_FAIL;
+#endif
+
+	vaddr = addr & ~(VM_PAGE_SIZE - 1);
+	entry = vm_map_lookup_entry(map, vaddr);
+	if (entry == NULL || !entry->lazy)
+		return KERN_RETURN_FAIL;
+
+	/* the page may have been mapped since the access faulted */
+	table = (tt_table_t *) map->pmap->tte;
+	if (pmap_tt_lookup(table, vaddr, &leaf_size) != NULL)
+		return KERN_RETURN_SUCCESS;
+
+	page_addr = vm_page_alloc_zeroed();
+	pmap_tt_create_tte(table, page_addr, vaddr, VM_PAGE_SIZE,
+		PMAP_ACCESS_READWRITE);
+
+	return KERN_RETURN_SUCCESS;
+}
+
 /*******************************************************************************
  * Name:	vm_map_alloc_at_address
  * Desc:	Allocate virtual memory of a given size within the provided vm_map,
@@ -223,15 +970,68 @@ vm_address_t vm_map_alloc(vm_map_t *map, vm_size_t size, vm_flags_t flags)
  * 			from a provided virtual base address.
  * 
  * 			Unlike vm_map_alloc, this alloc takes a virtual address to map `size`
- * 			bytes to. 
+ * 			bytes to. This may be used when creating the virtual address space
+ * 			of a new process, where the __DATA, __TEXT, heap and stack are best
+ * 			not placed directly next to eachother. The region must be page
+ * 			aligned, within the map, and not overlap any existing entry, or
+ * 			anything allocated from the map's arena.
+ *
+ * 			If the base is aligned to VM_PAGE_HUGE_SIZE, the region is backed
+ * 			with huge pages where possible, as with VM_ALLOC_HUGE. Only the
+ * 			VM_ALLOC_LAZY flag is otherwise used, as with vm_map_alloc.
 *******************************************************************************/
 
-int vm_map_alloc_at_address (vm_map_t *map, vm_size_t size, vm_address_t base)
+vm_address_t vm_map_alloc_at_address (vm_map_t *map, vm_size_t size,
+						vm_address_t base, vm_flags_t flags)
 {
-	/**
-	 * this allocator may be used when creating the virtual address space of a
-	 * new process, where the __DATA, __TEXT, heap and stack are best not placed
-	 * directly next to eachother.
-	*/
-	return 0;
-}
\ No newline at end of file
+	vm_map_entry_t *entry, *next;
+	vm_size_t page_count;
+	vm_address_t end;
+
+	page_count = (size < VM_PAGE_SIZE) ? 1 : (VM_PAGE_ROUND(size) / VM_PAGE_SIZE);
+	end = base + page_count * VM_PAGE_SIZE;
+
+	if ((base & (VM_PAGE_SIZE - 1)) || base < map->min || end <= base ||
+		end - 1 > map->max) {
+		vm_map_log("error: 0x%lx bytes at 0x%lx is outside vm_map 0x%lx\n",
+			size, base, map);
+		return VM_NULL;
+	}
+
+	/* allocating the entry can change the map, so do it before checking */
+	entry = __vm_map_entry_alloc(map);
+
+	next = __vm_map_lookup_next(map, base);
+	if (next && next->base < end) {
+		vm_map_log("error: 0x%lx-0x%lx overlaps entry 0x%lx-0x%lx\n",
+			base, end - 1, next->base, next->base + next->size);
+		__vm_map_entry_free(map, entry);
+		return VM_NULL;
+	}
+
+	/* the region must also be free in the map's arena */
+	if (map->arena && vmem_xalloc(map->arena, end - base, base) == VMEM_NULL) {
+		vm_map_log("error: 0x%lx-0x%lx is in use in arena '%s'\n", base,
+			end - 1, map->arena->name);
+		__vm_map_entry_free(map, entry);
+		return VM_NULL;
+	}
+
+#if DEFAULTS_KERNEL_VM_USE_L3_TABLE
+	flags &= VM_ALLOC_LAZY;
+#else
+	/* faulted pages would be mapped with 2MB blocks, so back them now */
+	flags = VM_NULL;
+#endif
+	if (!(flags & VM_ALLOC_LAZY) && !(base & (VM_PAGE_HUGE_SIZE - 1)) &&
+		page_count >= VM_PAGE_HUGE_PAGES)
+		flags |= VM_ALLOC_HUGE;
+
+	__vm_map_entry_insert(map, entry, base, page_count * VM_PAGE_SIZE,
+		flags & VM_ALLOC_LAZY);
+	if (!(flags & VM_ALLOC_LAZY))
+		entry->huge = __vm_map_back_pages(map, base, page_count, flags);
+
+	__vm_map_reserve_refill(map);
+	return base;
+}
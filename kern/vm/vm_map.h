@@ -29,11 +29,14 @@
 
 #include <tinylibc/stdint.h>
 
+#include <libkern/types.h>
 #include <libkern/list.h>
+#include <libkern/rbtree.h>
 
 #include <kern/vm/vm_types.h>
 #include <kern/vm/pmap.h>
 #include <kern/vm/vm.h>
+#include <kern/vm/vmem.h>
 
 /* interface logger */
 #define vm_map_log(fmt, ...)		interface_log("vm_map", fmt, ##__VA_ARGS__)
@@ -43,6 +46,17 @@
 
 #define VM_MAP_ENTRY_SIZE			(sizeof(vm_map_entry_t))
 
+/**
+ * Entries are allocated from the "vm_map.entries" zone. Growing that zone needs
+ * an entry in the kernel map, as do any allocations before the zone exists, so
+ * each map has a few entries of its own to use until the zone can be used.
+*/
+#define VM_MAP_ENTRY_RESERVE		8
+#define VM_MAP_ENTRY_ZONE_MAX_SIZE	(1024 * VM_PAGE_SIZE)
+
+/* Pages allocated before each call to pmap_enter_range */
+#define VM_MAP_ENTER_BATCH			(4 * PMAP_CONTIG_PAGES)
+
 #define VM_NULL						(0x0)
 #define VM_FALSE					(0x0)
 #define VM_TRUE						(0x1)
@@ -51,6 +65,9 @@
 #define VM_ALLOC_GUARD_FIRST		(0x01)	/* guard page before allocation */
 #define VM_ALLOC_GUARD_LAST			(0x02)	/* guard page after allocation */
 #define VM_ALLOC_KERNEL_CODE		(0x04)	/* kernel code */
+#define VM_ALLOC_HUGE				(0x08)	/* back with 2MB huge pages */
+#define VM_ALLOC_LAZY				(0x10)	/* back pages on first access */
+#define VM_ALLOC_STACK				(0x20)	/* address from the stack arena */
 
 #define VM_MAP_ENTRY_GUARD_PAGE		(0x01)
 
@@ -68,11 +85,21 @@ typedef struct vm_map_entry {
 	/* Flags */
 	uint32_t		guard_page	:1,
 					kernel_code	:1,
-					__unused_bits:30;
+					lazy		:1,
+					stack		:1,
+					huge		:1,
+					__unused_bits:27;
 
-	/* List of entries */
+	/* List of entries, in address order */
 	list_node_t		siblings;
 
+	/* Node in the map's tree of entries, keyed by base address */
+	rb_node_t		rb_node;
+
+	/* Free space before this entry, and the most before any in its subtree */
+	vm_size_t		gap;
+	vm_size_t		max_gap;
+
 } vm_map_entry_t;
 
 /**
@@ -97,9 +124,24 @@ typedef struct vm_map {
 
 	uint32_t		nentries;
 	list_t			entries;
+
+	/* Entries indexed by base address, and the entry last looked up */
+	rb_root_t		entries_tree;
+	vm_map_entry_t	*hint;
+
+	/* Entries used when the entry zone can't be, and which are in use */
+	vm_map_entry_t	reserve[VM_MAP_ENTRY_RESERVE];
+	uint32_t		reserve_used;
+
+	/**
+	 * Arena that addresses are allocated from, or NULL to place allocations
+	 * in the gaps between entries. Only the kernel map has one.
+	*/
+	vmem_t			*arena;
 } vm_map_t;
 
 /* virtual memory maps */
+extern void vm_map_init 	(void);
 extern void vm_map_create 	(vm_map_t *map, pmap_t *pmap, vm_address_t min,
 								vm_address_t max);
 extern void vm_map_unlock 	(vm_map_t *map);
@@ -107,10 +149,17 @@ extern void vm_map_lock 	(vm_map_t *map);
 
 extern vm_address_t vm_map_alloc (vm_map_t *map, vm_size_t size,
 								vm_flags_t flags);
+extern vm_address_t vm_map_alloc_at_address (vm_map_t *map, vm_size_t size,
+								vm_address_t base, vm_flags_t flags);
+extern kern_return_t vm_map_deallocate (vm_map_t *map, vm_address_t addr,
+								vm_size_t size);
+extern kern_return_t vm_map_copy (vm_map_t *dst, vm_map_t *src);
+extern kern_return_t vm_map_fault (vm_map_t *map, vm_address_t addr);
 
 /* virtual memory map entries */
 extern void vm_map_entry_create (vm_map_t *map, vm_address_t base,
 								vm_size_t size, vm_flags_t flags);
+extern vm_map_entry_t *vm_map_lookup_entry (vm_map_t *map, vm_address_t addr);
 
 vm_map_t *vm_map_create_new (pmap_t *pmap, vm_address_t min, vm_address_t max);
 
@@ -24,70 +24,714 @@
 #include <kern/vm/pmap.h>
 #include <kern/kprintf.h>
 
+#include <kern/machine.h>
+#include <kern/machine/machine_timer.h>
+
+#include <libkern/bitmap.h>
+#include <libkern/panic.h>
+
 /**
- * Page structures are stored within the kernel ".vm" segment, which is placed
- * at the end of teh kernel to allow it to grow as required. We calculate the
- * upper bounds of the region and use a cursor to track where we have written
- * up to.
+ * Page metadata is stored within the kernel ".vm" segment, which is placed at
+ * the end of the kernel to allow it to grow as required. The region is split
+ * into the free list links, the free and mapped page bitmaps, the reference
+ * counts and the page state bytes, in that order, so that each array stays
+ * naturally aligned.
 */
 static vm_address_t	vm_page_region_lower_bound __attribute__((section(".vm")));
 static vm_address_t vm_page_region_upper_bound;
-static vm_address_t vm_page_region_cursor;
 
 static vm_size_t 	vm_page_region_size;
 
-/* Page region pointer */
+/* Page state array */
 static vm_page_t 	*vm_page_region;
 
-/* Highest page index */
+/* Free list links, one for each page */
+static vm_page_link_t	*vm_page_links;
+
+/* Total number of pages in the page region, across all segments */
 static uint64_t 	vm_page_idx;
 
-/* Page list */
-static list_t		page_list;
+/* Physical memory segments, sorted by base address */
+static vm_page_segment_t	vm_page_segments[VM_PAGE_MAX_SEGMENTS];
+static unsigned int			vm_page_nsegments;
+
+/**
+ * Bitmap of free pages. A bit is set while the page is part of a free block in
+ * the buddy allocator, and clear while it's allocated. It is also used to search
+ * for runs of free pages for contiguous allocations.
+*/
+static bitmap_t		*vm_page_free_map;
+
+/* Bitmap of pages which are mapped in the MMU */
+static bitmap_t		*vm_page_mapped_map;
+
+/**
+ * Reference counts, less one, so a newly allocated page has a single reference
+ * without the allocator having to write to this array. Only valid while the
+ * page is allocated.
+*/
+static vm_page_ref_t	*vm_page_refs;
+
+/* Per-CPU page caches, indexed by cpu number */
+static vm_page_cpu_cache_t	vm_page_cpu_caches[DEFAULTS_MACHINE_MAX_CPUS];
+
+/* Pre-zeroed page pool */
+static vm_page_zero_pool_t	vm_page_zero_pool;
+
+/* Called to free cached memory when the allocator runs out of pages */
+static vm_page_reclaim_t	vm_page_reclaim;
 
 /* fetch the page at given index */
-#define __vm_page_get_idx(__idx)		((vm_page_t *) &vm_page_region[__idx])
+#define __vm_page_get_idx(__idx)		(&vm_page_region[__idx])
+
+/* fetch the page index for a physical address within a segment */
+#define __vm_page_paddr_to_idx(__seg, __pa)		\
+	((__seg)->first_idx + (((__pa) - (__seg)->base) / VM_PAGE_SIZE))
+
+/* fetch the physical address of the page at a given index within a segment */
+#define __vm_page_idx_to_paddr(__seg, __idx)	\
+	((__seg)->base + (((__idx) - (__seg)->first_idx) * VM_PAGE_SIZE))
+
+/* page frame number of a page index, buddies are calculated from this */
+#define __vm_page_pfn(__seg, __idx)		(__vm_page_idx_to_paddr(__seg, __idx) / VM_PAGE_SIZE)
+
+/* first page frame number of a segment, and the end of its initialised pages */
+#define __vm_page_seg_start_pfn(__seg)	((__seg)->base / VM_PAGE_SIZE)
+#define __vm_page_seg_init_end_pfn(__seg)	\
+	(__vm_page_seg_start_pfn(__seg) + ((__seg)->init_idx - (__seg)->first_idx))
+
+/* whether the page at a given index is allocated */
+#define __vm_page_is_alloc(__idx)		(!bitmap_test(vm_page_free_map, (__idx)))
+
+/**
+ * look up the page index and segment for a physical address, or -1 if the
+ * address is not in any segment, or its page hasn't been initialised yet.
+ * 'segp' may be NULL.
+*/
+static inline int64_t __vm_page_lookup (phys_addr_t paddr,
+										vm_page_segment_t **segp)
+{
+	vm_page_segment_t *seg;
+
+	for (unsigned int i = 0; i < vm_page_nsegments; i++) {
+		seg = &vm_page_segments[i];
+		if (paddr < seg->base ||
+			paddr >= seg->base + ((seg->init_idx - seg->first_idx) * VM_PAGE_SIZE))
+			continue;
+
+		if (segp)
+			*segp = seg;
+		return (int64_t) __vm_page_paddr_to_idx(seg, paddr);
+	}
+	return -1;
+}
+
+/* the numa node of the current cpu, preferred for allocations */
+static inline unsigned int __vm_page_local_node ()
+{
+	return machine_get_cpu_node(cpu_get_current_num());
+}
 
-/* increment the page region curosr */
-#define __vm_page_region_cursor_inc							\
-	do {													\
-		vm_page_region_cursor += VM_PAGE_STRUCT_SIZE;		\
-		vm_page_idx += 1;									\
-	} while (0);
+static int __vm_page_deferred_init_chunk (unsigned int node);
+
+/**
+ * ask the reclaim callback to free memory, and return the freed pages to the
+ * buddy allocator so they can be merged. returns the number of pages freed.
+*/
+static uint64_t __vm_page_reclaim ()
+{
+	uint64_t freed;
+
+	if (vm_page_reclaim == NULL || (freed = vm_page_reclaim()) == 0)
+		return 0;
+
+	vm_page_log("reclaimed %d pages\n", freed);
+	vm_page_cpu_cache_drain_all();
+	return freed;
+}
+
+/**
+ * iterate the segments, with those on 'node' first. segments on other nodes
+ * are only used once the preferred node is exhausted.
+*/
+#define for_each_segment_by_node(__seg, __node, __pass, __i)					\
+	for (__pass = 0; __pass < 2; __pass++)									\
+		for (__i = 0; __i < vm_page_nsegments; __i++)						\
+			if (((__seg) = &vm_page_segments[__i])->node == (__node) ?		\
+				(__pass) == 0 : (__pass) == 1)
 
 /*******************************************************************************
- * Name:	__vm_page_alloc_internal
- * Desc:	Internal page allocator. Creates a new 4KB vm_page_t for the given
- * 			base physical address. If the page is already mapped in the MMU, for
- * 			example Kernel code, set 'is_mapped'.
+ * Buddy allocator
+ *
+ * Free physical memory is kept as blocks of 2^order pages, with the head page
+ * of each block linked into the free area for that order. A block's buddy is
+ * found by flipping bit 'order' of the page frame number, so blocks are always
+ * naturally aligned in physical memory. Allocations split larger blocks down
+ * to the requested order, and frees merge a block with its buddy for as long
+ * as the buddy is also free.
 *******************************************************************************/
 
-static int __vm_page_alloc_internal (phys_size_t paddr, int is_mapped)
+static inline void __vm_page_free_area_add (vm_page_segment_t *seg,
+										uint64_t idx, unsigned int order)
 {
-	vm_page_t *page, *prev;
+	vm_page_free_area_t *area = &seg->free_areas[order];
+	vm_page_t *page = __vm_page_get_idx(idx);
 
-	/* check that the page region hasn't been exceeded */
-	if (vm_page_region_cursor >= vm_page_region_upper_bound) {
-		vm_page_log ("error: page region exeeded upper bounds\n");
-		return 1;
+	page->buddy = 1;
+	page->order = order;
+
+	/* push the block onto the head of the free list */
+	vm_page_links[idx].prev = VM_PAGE_IDX_NONE;
+	vm_page_links[idx].next = area->head;
+	if (area->head != VM_PAGE_IDX_NONE)
+		vm_page_links[area->head].prev = idx;
+
+	area->head = idx;
+	area->nr_free += 1;
+}
+
+static inline void __vm_page_free_area_del (vm_page_segment_t *seg,
+										uint64_t idx, unsigned int order)
+{
+	vm_page_free_area_t *area = &seg->free_areas[order];
+	vm_page_link_t *link = &vm_page_links[idx];
+	vm_page_t *page = __vm_page_get_idx(idx);
+
+	if (link->prev != VM_PAGE_IDX_NONE)
+		vm_page_links[link->prev].next = link->next;
+	else
+		area->head = link->next;
+
+	if (link->next != VM_PAGE_IDX_NONE)
+		vm_page_links[link->next].prev = link->prev;
+
+	link->next = link->prev = VM_PAGE_IDX_NONE;
+	area->nr_free -= 1;
+
+	page->buddy = 0;
+	page->order = 0;
+}
+
+/* set the allocation state of a range of pages in the free bitmap */
+static inline void __vm_page_set_state_range (uint64_t idx, uint64_t count,
+										unsigned int state)
+{
+	for (uint64_t i = idx; i < idx + count; i++) {
+		if (state == VM_PAGE_STATE_FREE)
+			bitmap_set(vm_page_free_map, i);
+		else
+			bitmap_clear(vm_page_free_map, i);
 	}
+}
 
-	/* get the location within the page region to create the new structure */
-	page = (vm_page_t *) vm_page_region_cursor;
+/*******************************************************************************
+ * Name:	__vm_page_find_buddy
+ * Desc:	Return the index of the buddy of a block of 2^order pages, or -1 if
+ * 			the buddy falls outside of the segment.
+*******************************************************************************/
 
-	/* create the new page */
-	page->paddr = paddr;
-	page->idx = vm_page_idx;
+static int64_t __vm_page_find_buddy (vm_page_segment_t *seg, uint64_t idx,
+									unsigned int order)
+{
+	uint64_t pfn, buddy_pfn;
 
-	page->state = VM_PAGE_STATE_FREE;
-	page->mapped = (is_mapped) ? VM_PAGE_IS_MAPPED : VM_PAGE_IS_NOT_MAPPED;
+	pfn = __vm_page_pfn(seg, idx);
+	buddy_pfn = pfn ^ VM_PAGE_ORDER_PAGES(order);
 
-	list_add_tail(&page->siblings, &page_list);
+	/* the buddy must be entirely within the initialised part of the segment */
+	if (buddy_pfn < __vm_page_seg_start_pfn(seg) ||
+		buddy_pfn + VM_PAGE_ORDER_PAGES(order) > __vm_page_seg_init_end_pfn(seg))
+		return -1;
 
-	/* increment the max index and region cursor */
-	__vm_page_region_cursor_inc;
+	return (int64_t) (idx + buddy_pfn - pfn);
+}
 
-	return 0;
+/*******************************************************************************
+ * Name:	__vm_page_free_block
+ * Desc:	Add a block of 2^order pages, already marked as free, to the free
+ * 			areas. The block is merged with its buddy for as long as the buddy
+ * 			is also free.
+*******************************************************************************/
+
+static void __vm_page_free_block (vm_page_segment_t *seg, uint64_t idx,
+									unsigned int order)
+{
+	vm_page_t *buddy;
+	int64_t buddy_idx;
+
+	/* merge with the buddy until it's either allocated, or split */
+	while (order < VM_PAGE_MAX_ORDER - 1) {
+		buddy_idx = __vm_page_find_buddy(seg, idx, order);
+		if (buddy_idx < 0)
+			break;
+
+		buddy = __vm_page_get_idx(buddy_idx);
+		if (!buddy->buddy || buddy->order != order)
+			break;
+
+		__vm_page_free_area_del(seg, buddy_idx, order);
+		if ((uint64_t) buddy_idx < idx)
+			idx = buddy_idx;
+		order += 1;
+	}
+
+	__vm_page_free_area_add(seg, idx, order);
+}
+
+/*******************************************************************************
+ * Name:	__vm_page_free_range
+ * Desc:	Free a range of pages into the free areas. The range is carved into
+ * 			the largest naturally aligned blocks possible, and each block is
+ * 			merged with any free neighbours.
+*******************************************************************************/
+
+static void __vm_page_free_range (vm_page_segment_t *seg, uint64_t idx,
+									uint64_t count)
+{
+	uint64_t end = idx + count;
+	unsigned int order;
+
+	__vm_page_set_state_range(idx, count, VM_PAGE_STATE_FREE);
+
+	while (idx < end) {
+
+		/* find the largest aligned block which fits within the range */
+		order = VM_PAGE_MAX_ORDER - 1;
+		while (order > 0 &&
+			((__vm_page_pfn(seg, idx) & (VM_PAGE_ORDER_PAGES(order) - 1)) ||
+			 idx + VM_PAGE_ORDER_PAGES(order) > end))
+			order -= 1;
+
+		__vm_page_free_block(seg, idx, order);
+		idx += VM_PAGE_ORDER_PAGES(order);
+	}
+}
+
+/*******************************************************************************
+ * Name:	__vm_page_isolate
+ * Desc:	Remove a single free page from the free areas. The free block which
+ * 			contains the page is split down, with every half that doesn't hold
+ * 			the page returned to the free areas.
+*******************************************************************************/
+
+static void __vm_page_isolate (vm_page_segment_t *seg, uint64_t idx)
+{
+	uint64_t pfn, head_idx, offset;
+	unsigned int order;
+	vm_page_t *head;
+
+	/* find the head page of the free block containing this page */
+	pfn = __vm_page_pfn(seg, idx);
+	for (order = 0; order < VM_PAGE_MAX_ORDER; order++) {
+		offset = pfn & (VM_PAGE_ORDER_PAGES(order) - 1);
+		if (pfn - offset < __vm_page_seg_start_pfn(seg))
+			break;
+
+		head_idx = idx - offset;
+		head = __vm_page_get_idx(head_idx);
+		if (head->buddy && head->order == order)
+			break;
+	}
+	if (order == VM_PAGE_MAX_ORDER || pfn - offset < __vm_page_seg_start_pfn(seg))
+		panic("free page 0x%lx is not part of a free block\n",
+			__vm_page_idx_to_paddr(seg, idx));
+
+	__vm_page_free_area_del(seg, head_idx, order);
+
+	/* split the block, keeping the half that contains the page */
+	while (order > 0) {
+		order -= 1;
+		if (idx >= head_idx + VM_PAGE_ORDER_PAGES(order)) {
+			__vm_page_free_area_add(seg, head_idx, order);
+			head_idx += VM_PAGE_ORDER_PAGES(order);
+		} else {
+			__vm_page_free_area_add(seg,
+				head_idx + VM_PAGE_ORDER_PAGES(order), order);
+		}
+	}
+}
+
+/*******************************************************************************
+ * Name:	__vm_page_alloc_order_segment
+ * Desc:	Allocate a block of 2^order pages from a single segment.
+*******************************************************************************/
+
+static phys_addr_t __vm_page_alloc_order_segment (vm_page_segment_t *seg,
+												unsigned int order)
+{
+	vm_page_free_area_t *area;
+	unsigned int cur;
+	uint64_t idx;
+
+	/* find the smallest free block that can satisfy the request */
+	for (cur = order; cur < VM_PAGE_MAX_ORDER; cur++) {
+		area = &seg->free_areas[cur];
+		if (area->head != VM_PAGE_IDX_NONE)
+			break;
+	}
+	if (cur == VM_PAGE_MAX_ORDER)
+		return VM_PAGE_NULL;
+
+	idx = area->head;
+	__vm_page_free_area_del(seg, idx, cur);
+
+	/* split the block, returning the upper halves to the lower free areas */
+	while (cur > order) {
+		cur -= 1;
+		__vm_page_free_area_add(seg, idx + VM_PAGE_ORDER_PAGES(cur), cur);
+	}
+
+	__vm_page_set_state_range(idx, VM_PAGE_ORDER_PAGES(order),
+		VM_PAGE_STATE_ALLOC);
+	return __vm_page_idx_to_paddr(seg, idx);
+}
+
+/*******************************************************************************
+ * Name:	__vm_page_alloc_order_node
+ * Desc:	Allocate a block of 2^order pages from any segment, preferring the
+ * 			given numa node. If 'reclaim' is set, memory is reclaimed from the
+ * 			rest of the kernel before giving up.
+*******************************************************************************/
+
+static phys_addr_t __vm_page_alloc_order_node (unsigned int order,
+											unsigned int node, int reclaim)
+{
+	vm_page_segment_t *seg;
+	unsigned int pass, i;
+	phys_addr_t paddr;
+
+	if (order >= VM_PAGE_MAX_ORDER)
+		return VM_PAGE_NULL;
+
+	do {
+		for_each_segment_by_node(seg, node, pass, i) {
+			paddr = __vm_page_alloc_order_segment(seg, order);
+			if (paddr != VM_PAGE_NULL)
+				return paddr;
+		}
+
+	/**
+	 * out of initialised memory, initialise the next chunk and try again. once
+	 * everything is initialised, try to reclaim memory from elsewhere.
+	*/
+	} while (__vm_page_deferred_init_chunk(node) ||
+		(reclaim && __vm_page_reclaim()));
+
+	return VM_PAGE_NULL;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_alloc_order_node
+ * Desc:	Allocate a naturally aligned block of 2^order physical pages,
+ * 			preferring memory on the given numa node. Returns the physical
+ * 			address of the first page, or VM_PAGE_NULL if there is no free block
+ * 			large enough on any node.
+*******************************************************************************/
+
+phys_addr_t vm_page_alloc_order_node (unsigned int order, unsigned int node)
+{
+	return __vm_page_alloc_order_node(order, node, 1);
+}
+
+/*******************************************************************************
+ * Name:	vm_page_alloc_order
+ * Desc:	Allocate a naturally aligned block of 2^order physical pages from
+ * 			the current cpu's numa node where possible.
+*******************************************************************************/
+
+phys_addr_t vm_page_alloc_order (unsigned int order)
+{
+	return vm_page_alloc_order_node(order, __vm_page_local_node());
+}
+
+/*******************************************************************************
+ * Name:	vm_page_try_alloc_order
+ * Desc:	Allocate a block of 2^order physical pages like vm_page_alloc_order,
+ * 			but without reclaiming memory from the rest of the kernel. This is
+ * 			for callers which can fall back to smaller allocations.
+*******************************************************************************/
+
+phys_addr_t vm_page_try_alloc_order (unsigned int order)
+{
+	return __vm_page_alloc_order_node(order, __vm_page_local_node(), 0);
+}
+
+/*******************************************************************************
+ * Name:	vm_page_free_order
+ * Desc:	Free a block of 2^order physical pages, merging it with its buddy for
+ * 			as long as the buddy is also free.
+*******************************************************************************/
+
+void vm_page_free_order (phys_addr_t paddr, unsigned int order)
+{
+	vm_page_segment_t *seg;
+	int64_t idx;
+
+	idx = __vm_page_lookup(paddr, &seg);
+	if (idx < 0 || order >= VM_PAGE_MAX_ORDER ||
+		idx + VM_PAGE_ORDER_PAGES(order) > seg->init_idx) {
+		vm_page_log("error: cannot free invalid page 0x%lx (order %d)\n",
+			paddr, order);
+		return;
+	}
+
+	if (!__vm_page_is_alloc(idx)) {
+		vm_page_log("error: page 0x%lx is already free\n", paddr);
+		return;
+	}
+
+	if (vm_page_refs[idx]) {
+		vm_page_log("error: page 0x%lx is still shared\n", paddr);
+		return;
+	}
+
+	__vm_page_set_state_range(idx, VM_PAGE_ORDER_PAGES(order),
+		VM_PAGE_STATE_FREE);
+	__vm_page_free_block(seg, idx, order);
+}
+
+/*******************************************************************************
+ * Name:	__vm_page_find_run
+ * Desc:	Search the free bitmap for a run of 'npages' free pages within a
+ * 			segment, where the first page's frame number is a multiple of
+ * 			'align'. Returns the index of the first page, or -1 if there is no
+ * 			such run.
+*******************************************************************************/
+
+static int64_t __vm_page_find_run (vm_page_segment_t *seg, uint64_t npages,
+									uint64_t align)
+{
+	uint64_t base_pfn, seg_end, start, end, i;
+	int pos;
+
+	base_pfn = __vm_page_seg_start_pfn(seg) - seg->first_idx;
+	seg_end = seg->init_idx;
+
+	if (seg->first_idx == 0)
+		pos = bitmap_lsb_first(vm_page_free_map, seg_end);
+	else
+		pos = bitmap_lsb_next(vm_page_free_map, seg_end, seg->first_idx - 1);
+
+	while (pos >= 0) {
+
+		/* align the start of the run by physical frame number */
+		start = ((base_pfn + pos + align - 1) & ~(align - 1)) - base_pfn;
+		end = start + npages;
+		if (end > seg_end)
+			return -1;
+
+		/* find the first allocated page in the run, skipping full words */
+		for (i = start; i < end; i++) {
+			if (!(i & 63) && i + 64 <= end &&
+				vm_page_free_map[bitmap_index(i)] == ~0ULL) {
+				i += 63;
+				continue;
+			}
+			if (!bitmap_test(vm_page_free_map, i))
+				break;
+		}
+		if (i >= end)
+			return (int64_t) start;
+
+		/* restart from the next free page after the allocated one */
+		pos = bitmap_lsb_next(vm_page_free_map, seg_end, i);
+	}
+	return -1;
+}
+
+/* find a free run in any segment, preferring the local node */
+static int64_t __vm_page_find_run_any (uint64_t npages, uint64_t align,
+										vm_page_segment_t **segp)
+{
+	unsigned int node, pass, i;
+	vm_page_segment_t *seg;
+	int64_t start;
+
+	node = __vm_page_local_node();
+	for_each_segment_by_node(seg, node, pass, i) {
+		if ((start = __vm_page_find_run(seg, npages, align)) >= 0) {
+			*segp = seg;
+			return start;
+		}
+	}
+	return -1;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_alloc_contig
+ * Desc:	Allocate 'npages' physically contiguous pages, with the physical
+ * 			address of the first page aligned to 'align' pages. 'align' must be
+ * 			a power of two, or zero for no alignment. Returns VM_PAGE_NULL if no
+ * 			suitable run of free pages exists.
+*******************************************************************************/
+
+phys_addr_t vm_page_alloc_contig (uint64_t npages, uint64_t align)
+{
+	vm_page_segment_t *seg;
+	uint64_t idx, end;
+	unsigned int order;
+	vm_page_t *page;
+	int64_t start;
+
+	if (npages == 0 || (align & (align - 1)))
+		return VM_PAGE_NULL;
+	if (align == 0)
+		align = 1;
+
+	/* a power of two run is already naturally aligned by the buddy allocator */
+	order = bit_ceiling(npages);
+	if (npages == VM_PAGE_ORDER_PAGES(order) && align <= npages &&
+		order < VM_PAGE_MAX_ORDER) {
+		phys_addr_t paddr = vm_page_alloc_order(order);
+		if (paddr != VM_PAGE_NULL)
+			return paddr;
+	}
+
+	/**
+	 * pages held in the per-cpu caches may be breaking up a free run, and the
+	 * run may be in memory that hasn't been initialised yet.
+	*/
+	if ((start = __vm_page_find_run_any(npages, align, &seg)) < 0) {
+		vm_page_zero_pool_drain();
+		vm_page_cpu_cache_drain_all();
+
+		while ((start = __vm_page_find_run_any(npages, align, &seg)) < 0) {
+			if (!__vm_page_deferred_init_chunk(VM_PAGE_NODE_ANY) &&
+				!__vm_page_reclaim())
+				return VM_PAGE_NULL;
+		}
+	}
+
+	/**
+	 * remove the run from the free areas. whole free blocks inside the run are
+	 * taken in one go, and blocks which straddle the run are split.
+	*/
+	idx = (uint64_t) start;
+	end = idx + npages;
+	while (idx < end) {
+		page = __vm_page_get_idx(idx);
+		if (page->buddy && idx + VM_PAGE_ORDER_PAGES(page->order) <= end) {
+			order = page->order;
+			__vm_page_free_area_del(seg, idx, order);
+			idx += VM_PAGE_ORDER_PAGES(order);
+		} else {
+			__vm_page_isolate(seg, idx);
+			idx += 1;
+		}
+	}
+
+	__vm_page_set_state_range(start, npages, VM_PAGE_STATE_ALLOC);
+	return __vm_page_idx_to_paddr(seg, start);
+}
+
+/*******************************************************************************
+ * Name:	vm_page_free_contig
+ * Desc:	Free 'npages' physically contiguous pages allocated with
+ * 			vm_page_alloc_contig.
+*******************************************************************************/
+
+void vm_page_free_contig (phys_addr_t paddr, uint64_t npages)
+{
+	vm_page_segment_t *seg;
+	int64_t idx;
+
+	idx = __vm_page_lookup(paddr, &seg);
+	if (idx < 0 || idx + npages > seg->init_idx) {
+		vm_page_log("error: cannot free invalid range 0x%lx (%d pages)\n",
+			paddr, npages);
+		return;
+	}
+
+	for (uint64_t i = idx; i < idx + npages; i++) {
+		if (!__vm_page_is_alloc(i) || __vm_page_get_idx(i)->cached) {
+			vm_page_log("error: page 0x%lx is already free\n",
+				__vm_page_idx_to_paddr(seg, i));
+			return;
+		}
+	}
+
+	__vm_page_free_range(seg, idx, npages);
+}
+
+/*******************************************************************************
+ * Name:	vm_page_alloc_huge
+ * Desc:	Allocate a huge page, a run of VM_PAGE_HUGE_PAGES pages aligned to
+ * 			its own size so it can be mapped by a single block entry. Returns
+ * 			VM_PAGE_NULL if no such run is free.
+*******************************************************************************/
+
+phys_addr_t vm_page_alloc_huge ()
+{
+	return vm_page_alloc_contig(VM_PAGE_HUGE_PAGES, VM_PAGE_HUGE_PAGES);
+}
+
+/*******************************************************************************
+ * Name:	vm_page_free_huge
+ * Desc:	Free a huge page allocated with vm_page_alloc_huge.
+*******************************************************************************/
+
+void vm_page_free_huge (phys_addr_t paddr)
+{
+	vm_page_free_contig(paddr, VM_PAGE_HUGE_PAGES);
+}
+
+/*******************************************************************************
+ * Per-CPU page caches
+ *
+ * Single page allocations and frees are served from a per-cpu stack of pages
+ * where possible. When the stack is empty, a batch of pages is taken from the
+ * buddy allocator (as a single block if one is available), and when it's full,
+ * a batch of the least recently freed pages is returned.
+ *
+ * NOTE: The caches must not be used from interrupt context, as there is no
+ * 		 locking between a CPU and its own interrupt handlers.
+*******************************************************************************/
+
+static inline vm_page_cpu_cache_t *__vm_page_cpu_cache_get ()
+{
+	return &vm_page_cpu_caches[cpu_get_current_num()];
+}
+
+static void __vm_page_cpu_cache_refill (vm_page_cpu_cache_t *cache)
+{
+	phys_addr_t paddr;
+
+	/* try to take a whole batch as a single block first, without reclaiming */
+	paddr = __vm_page_alloc_order_node(VM_PAGE_CPU_CACHE_BATCH_ORDER,
+		__vm_page_local_node(), 0);
+	if (paddr != VM_PAGE_NULL) {
+		for (int i = VM_PAGE_CPU_CACHE_BATCH - 1; i >= 0; i--) {
+			__vm_page_get_idx(__vm_page_lookup(paddr, NULL) + i)->cached = 1;
+			cache->pages[cache->count++] = paddr + (i * VM_PAGE_SIZE);
+		}
+	} else {
+		for (int i = 0; i < VM_PAGE_CPU_CACHE_BATCH; i++) {
+			if ((paddr = vm_page_alloc_order(0)) == VM_PAGE_NULL)
+				break;
+
+			__vm_page_get_idx(__vm_page_lookup(paddr, NULL))->cached = 1;
+			cache->pages[cache->count++] = paddr;
+		}
+	}
+	cache->refills += 1;
+}
+
+static void __vm_page_cpu_cache_drain (vm_page_cpu_cache_t *cache,
+										uint32_t count)
+{
+	if (count > cache->count)
+		count = cache->count;
+
+	/* the bottom of the stack holds the least recently freed pages */
+	for (uint32_t i = 0; i < count; i++) {
+		__vm_page_get_idx(__vm_page_lookup(cache->pages[i], NULL))->cached = 0;
+		vm_page_free_order(cache->pages[i], 0);
+	}
+
+	memmove(&cache->pages[0], &cache->pages[count],
+		(cache->count - count) * sizeof(phys_addr_t));
+	cache->count -= count;
+	cache->drains += 1;
 }
 
 /*******************************************************************************
@@ -97,23 +741,24 @@ static int __vm_page_alloc_internal (phys_size_t paddr, int is_mapped)
 
 phys_addr_t vm_page_alloc ()
 {
-	vm_page_t *last;
+	vm_page_cpu_cache_t *cache;
+	phys_addr_t paddr;
 
-	/* find the next free page */
-	for (unsigned int i = 0; i < vm_page_idx; i++) {
-		last = __vm_page_get_idx(i);
-		if (last->state == VM_PAGE_STATE_FREE)
-			break;
-	}
+	cache = __vm_page_cpu_cache_get();
+	if (cache->count) {
+		cache->hits += 1;
+	} else {
+		cache->misses += 1;
+		__vm_page_cpu_cache_refill(cache);
 
-	/* if the last page isn't free, something went wrong */
-	if (last->state != VM_PAGE_STATE_FREE)
-		panic("failed to allocate a free physical page\n");
+		if (cache->count == 0)
+			panic("failed to allocate a free physical page\n");
+	}
 
-	/* allocate the last page */
-	last->state = VM_PAGE_STATE_ALLOC;
+	paddr = cache->pages[--cache->count];
+	__vm_page_get_idx(__vm_page_lookup(paddr, NULL))->cached = 0;
 
-	return last->paddr;
+	return paddr;
 }
 
 void vm_guard_page_fill(vm_address_t *guard_page)
@@ -129,108 +774,682 @@ void vm_guard_page_fill(vm_address_t *guard_page)
 
 void vm_page_free (phys_addr_t paddr)
 {
+	vm_page_cpu_cache_t *cache;
 	vm_page_t *page;
-	uint32_t idx;
+	int64_t idx;
+
+	idx = __vm_page_lookup(paddr, NULL);
+	page = (idx < 0) ? NULL : __vm_page_get_idx(idx);
+	if (page == NULL || !__vm_page_is_alloc(idx) || page->cached) {
+		vm_page_log("error: cannot free page 0x%lx: invalid or already free\n",
+			paddr);
+		return;
+	}
 
-	idx = (paddr - memory_phys_base) / VM_PAGE_SIZE;
-	page = __vm_page_get_idx(idx);
+	if (vm_page_refs[idx]) {
+		vm_page_log("error: page 0x%lx is still shared\n", paddr);
+		return;
+	}
 
-	page->state = VM_PAGE_STATE_FREE;
+	cache = __vm_page_cpu_cache_get();
+	if (cache->count == VM_PAGE_CPU_CACHE_SIZE)
+		__vm_page_cpu_cache_drain(cache, VM_PAGE_CPU_CACHE_BATCH);
 
-	vm_page_log("free'd page '%d': 0x%lx\n", idx, page->paddr);
+	page->cached = 1;
+	cache->pages[cache->count++] = paddr;
 }
 
 /*******************************************************************************
- * Name:	vm_page_bootstrap
- * Desc:	Bootstrap the kernel page allocator. Configure the page table region
- * 			and create pages for provided memory region.
+ * Name:	vm_page_get_state
+ * Desc:	Return the allocation state of a physical page. Addresses outside of
+ * 			the page region are reported as allocated.
 *******************************************************************************/
 
-void vm_page_bootstrap (phys_addr_t membase, phys_size_t memsize, 
-						phys_size_t kernsize)
+int vm_page_get_state (phys_addr_t paddr)
 {
-	uint64_t page_count, kern_page_count, i;
-	vm_page_t *first_page, *kern_page;
-	phys_addr_t pcursor;
-	phys_size_t psize;
+	int64_t idx;
 
-	vm_page_log ("starting vm_page_bootstrap\n");
+	idx = __vm_page_lookup(paddr, NULL);
+	if (idx < 0 || __vm_page_is_alloc(idx))
+		return VM_PAGE_STATE_ALLOC;
+	return VM_PAGE_STATE_FREE;
+}
 
-	/* set the initial page index */
-	vm_page_idx = 0;
+/*******************************************************************************
+ * Name:	vm_page_get_mapped
+ * Desc:	Return whether a physical page is mapped in the MMU.
+*******************************************************************************/
 
-	/* calculate the number of pages for the physical memory size */
-	psize = (phys_size_t) memsize;
-	page_count = psize / VM_PAGE_SIZE;
+int vm_page_get_mapped (phys_addr_t paddr)
+{
+	int64_t idx;
 
-	vm_page_region_size = (vm_size_t) page_count * sizeof (vm_page_t);
+	idx = __vm_page_lookup(paddr, NULL);
+	if (idx < 0 || !bitmap_test(vm_page_mapped_map, idx))
+		return VM_PAGE_IS_NOT_MAPPED;
+	return VM_PAGE_IS_MAPPED;
+}
 
-	vm_page_log ("page count: %d, size required (%dKB)\n",
-		page_count, vm_page_region_size / 1024);
+/*******************************************************************************
+ * Name:	vm_page_set_mapped
+ * Desc:	Set whether a physical page is mapped in the MMU.
+*******************************************************************************/
 
-	/* initialise the .vm page region */
-	vm_page_region_upper_bound = &vm_page_region_lower_bound + vm_page_region_size;
-	vm_page_region_cursor = &vm_page_region_lower_bound;
+void vm_page_set_mapped (phys_addr_t paddr, int mapped)
+{
+	int64_t idx;
 
-	vm_page_region = (vm_page_t *) &vm_page_region_lower_bound;
+	if ((idx = __vm_page_lookup(paddr, NULL)) < 0)
+		return;
 
-	INIT_LIST_HEAD(&page_list);
+	if (mapped)
+		bitmap_set(vm_page_mapped_map, idx);
+	else
+		bitmap_clear(vm_page_mapped_map, idx);
+}
 
-	vm_page_log ("initialised page region: 0x%lx-0x%lx\n",
-		&vm_page_region_lower_bound, vm_page_region_upper_bound);
+/*******************************************************************************
+ * Name:	vm_page_ref_get
+ * Desc:	Take an additional reference to an allocated physical page, for
+ * 			example when it is shared between two address spaces. Returns the
+ * 			new reference count, or zero if the page isn't allocated.
+*******************************************************************************/
+
+uint32_t vm_page_ref_get (phys_addr_t paddr)
+{
+	vm_page_ref_t old;
+	int64_t idx;
+
+	idx = __vm_page_lookup(paddr, NULL);
+	if (idx < 0 || !__vm_page_is_alloc(idx)) {
+		vm_page_log("error: cannot reference free page 0x%lx\n", paddr);
+		return 0;
+	}
+
+	old = __atomic_fetch_add(&vm_page_refs[idx], 1, __ATOMIC_RELAXED);
+	if (old == VM_PAGE_REF_MAX - 1)
+		panic("vm_page: reference count overflow on page 0x%lx\n", paddr);
+
+	return (uint32_t) old + 2;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_ref_put
+ * Desc:	Drop a reference to an allocated physical page, and free the page
+ * 			once the last reference has been dropped. Returns the number of
+ * 			references left.
+*******************************************************************************/
+
+uint32_t vm_page_ref_put (phys_addr_t paddr)
+{
+	vm_page_ref_t old;
+	int64_t idx;
+
+	idx = __vm_page_lookup(paddr, NULL);
+	if (idx < 0 || !__vm_page_is_alloc(idx)) {
+		vm_page_log("error: cannot release free page 0x%lx\n", paddr);
+		return 0;
+	}
 
 	/**
-	 * manually create the first page, so the doubly-linked list of pages can be
-	 * properly setup.
+	 * the count is stored less one, so it wraps when the last reference is
+	 * dropped. Nobody else can hold a reference at that point, so the count
+	 * can be reset before the page is freed.
 	*/
-	first_page = (vm_page_t *) vm_page_region_cursor;
-	first_page->paddr = membase;
-	first_page->idx = vm_page_idx;
+	old = __atomic_fetch_sub(&vm_page_refs[idx], 1, __ATOMIC_ACQ_REL);
+	if (old == 0) {
+		__atomic_store_n(&vm_page_refs[idx], 0, __ATOMIC_RELAXED);
+		vm_page_free(paddr);
+	}
+
+	return old;
+}
 
-	first_page->state = VM_PAGE_STATE_FREE;
-	first_page->mapped = VM_PAGE_IS_NOT_MAPPED;		/* not mapped by default */
+/*******************************************************************************
+ * Name:	vm_page_ref_count
+ * Desc:	Return the number of references to a physical page, or zero if the
+ * 			page is free.
+*******************************************************************************/
+
+uint32_t vm_page_ref_count (phys_addr_t paddr)
+{
+	int64_t idx;
 
-	/* add the page to the global page list */
-	list_add_tail(&first_page->siblings, &page_list);
+	idx = __vm_page_lookup(paddr, NULL);
+	if (idx < 0 || !__vm_page_is_alloc(idx))
+		return 0;
 
-	/* move the page cursor and increment the index */
-	__vm_page_region_cursor_inc;
+	return (uint32_t) __atomic_load_n(&vm_page_refs[idx], __ATOMIC_ACQUIRE) + 1;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_cpu_cache_drain_all
+ * Desc:	Return every page held in the per-cpu caches to the buddy allocator,
+ * 			so they can be merged into larger blocks.
+*******************************************************************************/
+
+void vm_page_cpu_cache_drain_all ()
+{
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++) {
+		if (vm_page_cpu_caches[i].count)
+			__vm_page_cpu_cache_drain(&vm_page_cpu_caches[i],
+				vm_page_cpu_caches[i].count);
+	}
+}
+
+/*******************************************************************************
+ * Name:	vm_page_cpu_cache_stats
+ * Desc:	Fetch the hit and miss counters for a given CPU's page cache.
+*******************************************************************************/
+
+void vm_page_cpu_cache_stats (cpu_number_t cpu, uint64_t *hits, uint64_t *misses)
+{
+	if (cpu < 0 || cpu >= DEFAULTS_MACHINE_MAX_CPUS) {
+		*hits = *misses = 0;
+		return;
+	}
 
-	/* create a page struct for every physical page */
-	pcursor = membase + VM_PAGE_SIZE;
-	for (i = 0; i < page_count; i++) {
-		if (__vm_page_alloc_internal(pcursor, 1))
+	*hits = vm_page_cpu_caches[cpu].hits;
+	*misses = vm_page_cpu_caches[cpu].misses;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_dump_cpu_caches
+ * Desc:	Print the state and statistics for each active per-cpu page cache.
+*******************************************************************************/
+
+void vm_page_dump_cpu_caches ()
+{
+	vm_page_cpu_cache_t *cache;
+
+	vm_page_log("per-cpu page caches:\n");
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++) {
+		cache = &vm_page_cpu_caches[i];
+		if (cache->hits == 0 && cache->misses == 0)
+			continue;
+
+		kprintf("  cpu%d: %d/%d pages, hits: %d, misses: %d, refills: %d, drains: %d\n",
+			i, cache->count, VM_PAGE_CPU_CACHE_SIZE, cache->hits, cache->misses,
+			cache->refills, cache->drains);
+	}
+}
+
+/*******************************************************************************
+ * Pre-zeroed page pool
+ *
+ * Pages are zeroed ahead of time through the pmap page window, by calling
+ * vm_page_zero_pool_refill() when the CPU would otherwise be idle. Allocations
+ * which find the pool empty fall back to zeroing a page synchronously.
+ *
+ * Pooled pages are marked cached like those in the per-cpu caches, so freeing
+ * one is caught as a double free.
+ *
+ * NOTE: As with the per-cpu caches, the pool must not be used from interrupt
+ * 		 context.
+*******************************************************************************/
+
+/*******************************************************************************
+ * Name:	vm_page_alloc_zeroed
+ * Desc:	Allocate a physical memory page which is filled with zeros.
+*******************************************************************************/
+
+phys_addr_t vm_page_alloc_zeroed ()
+{
+	vm_page_zero_pool_t *pool = &vm_page_zero_pool;
+	phys_addr_t paddr;
+
+	pool->depth_sum += pool->count;
+	if (pool->count) {
+		pool->hits += 1;
+		paddr = pool->pages[--pool->count];
+		__vm_page_get_idx(__vm_page_lookup(paddr, NULL))->cached = 0;
+
+		if (pool->count < pool->low_water)
+			pool->low_water = pool->count;
+		return paddr;
+	}
+
+	pool->misses += 1;
+	pool->low_water = 0;
+
+	paddr = vm_page_alloc();
+	pmap_zero_page(paddr);
+	return paddr;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_zero_pool_refill
+ * Desc:	Zero up to 'budget' pages into the pre-zeroed page pool, and return
+ * 			the number of pages added. This is the idle-time worker, and should
+ * 			be called repeatedly until it returns zero.
+*******************************************************************************/
+
+uint32_t vm_page_zero_pool_refill (uint32_t budget)
+{
+	vm_page_zero_pool_t *pool = &vm_page_zero_pool;
+	phys_addr_t paddr;
+	uint32_t added = 0;
+
+	while (added < budget && pool->count < VM_PAGE_ZERO_POOL_SIZE) {
+		if ((paddr = vm_page_alloc_order(0)) == VM_PAGE_NULL)
 			break;
 
-		pcursor += VM_PAGE_SIZE;
+		pmap_zero_page(paddr);
+		__vm_page_get_idx(__vm_page_lookup(paddr, NULL))->cached = 1;
+		pool->pages[pool->count++] = paddr;
+		added += 1;
 	}
-	vm_page_log("created %d pages (0x%lx-0x%lx)\n", i, membase, membase + memsize);
 
-	/* verify all pages were created */
-	if (i != page_count)
-		panic("error: not all pages were created: %d missing\n",
-			page_count - i);
+	pool->zeroed += added;
+	if (pool->count == VM_PAGE_ZERO_POOL_SIZE)
+		pool->low_water = pool->count;
 
-	/* mark the pages used by the kernel as allocated and mapped */
-	pcursor = membase;
-	kern_page_count = ((kernsize + vm_page_region_size) / VM_PAGE_SIZE) + 1;
-	for (i = 0; i < kern_page_count; i++) {
-		kern_page = __vm_page_get_idx(i);
+	return added;
+}
 
-		kern_page->state = VM_PAGE_STATE_ALLOC;
-		kern_page->mapped = VM_PAGE_IS_MAPPED;
+/*******************************************************************************
+ * Name:	vm_page_zero_pool_drain
+ * Desc:	Return every page in the pre-zeroed page pool to the buddy allocator.
+*******************************************************************************/
+
+void vm_page_zero_pool_drain ()
+{
+	vm_page_zero_pool_t *pool = &vm_page_zero_pool;
+	phys_addr_t paddr;
 
-		pcursor += VM_PAGE_SIZE;
+	while (pool->count) {
+		paddr = pool->pages[--pool->count];
+		__vm_page_get_idx(__vm_page_lookup(paddr, NULL))->cached = 0;
+		vm_page_free_order(paddr, 0);
 	}
-	vm_page_log("modified %d kernel pages\n");
+	pool->low_water = 0;
+}
 
-#if VM_PAGE_DEBUG_LOGGING
-	/* testing: check that first->prev = last, and last->next = first */
-	for (int j = 0; j < page_count; j++) {
-		vm_page_t *tmp = __vm_page_get_idx(j);
-//		if (j == 0 || j == page_count - 1)
-//			vm_page_log ("tmp[%d]: tmp: 0x%llx next: 0x%llx, prev: 0x%llx, state: %d\n",
-//				tmp->idx, tmp, tmp->next, tmp->prev, tmp->state);
+/*******************************************************************************
+ * Name:	vm_page_zero_pool_stats
+ * Desc:	Fetch the current and lowest depth of the pre-zeroed page pool, along
+ * 			with its hit and miss counters.
+*******************************************************************************/
+
+void vm_page_zero_pool_stats (uint64_t *depth, uint64_t *low_water,
+							uint64_t *hits, uint64_t *misses)
+{
+	*depth = vm_page_zero_pool.count;
+	*low_water = vm_page_zero_pool.low_water;
+	*hits = vm_page_zero_pool.hits;
+	*misses = vm_page_zero_pool.misses;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_dump_zero_pool
+ * Desc:	Print the state and statistics of the pre-zeroed page pool.
+*******************************************************************************/
+
+void vm_page_dump_zero_pool ()
+{
+	vm_page_zero_pool_t *pool = &vm_page_zero_pool;
+	uint64_t allocs;
+
+	allocs = pool->hits + pool->misses;
+
+	vm_page_log("zero page pool:\n");
+	kprintf("  depth: %d/%d pages, low water: %d, average: %d\n",
+		pool->count, VM_PAGE_ZERO_POOL_SIZE, pool->low_water,
+		(allocs) ? pool->depth_sum / allocs : pool->count);
+	kprintf("  hits: %d, misses: %d, zeroed: %d\n",
+		pool->hits, pool->misses, pool->zeroed);
+}
+
+/*******************************************************************************
+ * Name:	vm_page_set_reclaim
+ * Desc:	Set the callback used to reclaim memory from the rest of the kernel
+ * 			when the allocator runs out of free pages.
+*******************************************************************************/
+
+void vm_page_set_reclaim (vm_page_reclaim_t reclaim)
+{
+	vm_page_reclaim = reclaim;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_free_count
+ * Desc:	Return the number of free pages, including those held in the per-cpu
+ * 			caches and the zero pool, but not those yet to be initialised.
+*******************************************************************************/
+
+uint64_t vm_page_free_count ()
+{
+	vm_page_segment_t *seg;
+	uint64_t total;
+
+	total = vm_page_zero_pool.count;
+	for (int i = 0; i < DEFAULTS_MACHINE_MAX_CPUS; i++)
+		total += vm_page_cpu_caches[i].count;
+
+	for (unsigned int s = 0; s < vm_page_nsegments; s++) {
+		seg = &vm_page_segments[s];
+		for (unsigned int i = 0; i < VM_PAGE_MAX_ORDER; i++)
+			total += seg->free_areas[i].nr_free * VM_PAGE_ORDER_PAGES(i);
+	}
+	return total;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_dump_free_areas
+ * Desc:	Print the number of free blocks in each buddy allocator free area,
+ * 			for every physical memory segment.
+*******************************************************************************/
+
+void vm_page_dump_free_areas ()
+{
+	vm_page_segment_t *seg;
+	uint64_t total = 0;
+
+	vm_page_log("free areas:\n");
+	for (unsigned int s = 0; s < vm_page_nsegments; s++) {
+		seg = &vm_page_segments[s];
+		kprintf("  segment %d: 0x%lx-0x%lx, node %d, %d/%d pages initialised\n",
+			s, seg->base, seg->base + (seg->npages * VM_PAGE_SIZE), seg->node,
+			seg->init_idx - seg->first_idx, seg->npages);
+
+		for (unsigned int i = 0; i < VM_PAGE_MAX_ORDER; i++) {
+			kprintf("    order %2d: %d free blocks\n", i,
+				seg->free_areas[i].nr_free);
+			total += seg->free_areas[i].nr_free * VM_PAGE_ORDER_PAGES(i);
+		}
+	}
+	kprintf("  total: %d free pages\n", total);
+}
+
+/*******************************************************************************
+ * Deferred page initialisation
+ *
+ * Initialising the metadata for every page during boot takes time proportional
+ * to the size of physical memory, so only the pages needed to finish booting
+ * are initialised by vm_page_bootstrap(). Each segment is then initialised
+ * from its base upwards, one chunk at a time, either when an allocation can't
+ * be satisfied from the pages already initialised, or by vm_page_deferred_init()
+ * while the kernel is idle. Pages above a segment's init_idx are treated as if
+ * they don't exist.
+*******************************************************************************/
+
+/* the kernel, and the page region which follows it, must not be freed */
+static phys_addr_t			vm_page_kern_base;
+static phys_addr_t			vm_page_kern_end;
+
+/* reserved memory ranges from the device tree */
+static platform_memory_range_t	vm_page_reserved[PLATFORM_RESERVED_RANGES_MAX];
+static unsigned int				vm_page_nreserved;
+
+/* pages left to initialise, and the time spent initialising them */
+static uint64_t				vm_page_deferred_pages;
+static uint64_t				vm_page_deferred_ticks;
+
+/* mark the pages between indexes 'start' and 'end' which overlap [rbase, rend) as reserved */
+static void __vm_page_reserve_range (vm_page_segment_t *seg, uint64_t start,
+									uint64_t end, phys_addr_t rbase,
+									phys_addr_t rend, int mapped)
+{
+	phys_addr_t lo, hi;
+
+	lo = __vm_page_idx_to_paddr(seg, start);
+	hi = __vm_page_idx_to_paddr(seg, end);
+
+	rbase = (rbase < lo) ? lo : (rbase & ~(VM_PAGE_SIZE - 1));
+	rend = (rend > hi) ? hi : rend;
+
+	for (; rbase < rend; rbase += VM_PAGE_SIZE) {
+		bitmap_clear(vm_page_free_map, __vm_page_paddr_to_idx(seg, rbase));
+		if (mapped)
+			bitmap_set(vm_page_mapped_map, __vm_page_paddr_to_idx(seg, rbase));
+	}
+}
+
+/*******************************************************************************
+ * Name:	__vm_page_init_range
+ * Desc:	Initialise the next 'count' pages of a segment, and give every page
+ * 			which isn't reserved to the buddy allocator.
+*******************************************************************************/
+
+static void __vm_page_init_range (vm_page_segment_t *seg, uint64_t count)
+{
+	uint64_t start, end, idx, run;
+
+	start = seg->init_idx;
+	end = start + count;
+	if (end > seg->first_idx + seg->npages)
+		end = seg->first_idx + seg->npages;
+
+	/* page states start clear, links are only valid once a page heads a free block */
+	memset(&vm_page_region[start], 0, (end - start) * sizeof (vm_page_t));
+	memset(&vm_page_refs[start], 0, (end - start) * sizeof (vm_page_ref_t));
+
+	/* start with every page free, and then remove the reserved ranges */
+	for (idx = start; idx < end; idx++)
+		bitmap_set(vm_page_free_map, idx);
+
+	/**
+	 * the kernel is mapped, and memory below it in the same segment holds
+	 * data left by the bootloader, so neither are used.
+	*/
+	if (vm_page_kern_base >= seg->base &&
+		vm_page_kern_base < seg->base + (seg->npages * VM_PAGE_SIZE)) {
+		__vm_page_reserve_range(seg, start, end, seg->base,
+			vm_page_kern_base, 0);
+		__vm_page_reserve_range(seg, start, end, vm_page_kern_base,
+			vm_page_kern_end, 1);
+	}
+
+	for (unsigned int i = 0; i < vm_page_nreserved; i++)
+		__vm_page_reserve_range(seg, start, end, vm_page_reserved[i].base,
+			vm_page_reserved[i].base + vm_page_reserved[i].size, 0);
+
+	/* the new pages can now be merged with, so update the segment first */
+	seg->init_idx = end;
+
+	/* hand each run of free pages to the buddy allocator */
+	idx = start;
+	while (idx < end) {
+		if (!bitmap_test(vm_page_free_map, idx)) {
+			idx += 1;
+			continue;
+		}
+
+		run = idx;
+		while (idx < end && bitmap_test(vm_page_free_map, idx))
+			idx += 1;
+		__vm_page_free_range(seg, run, idx - run);
+	}
+
+	vm_page_deferred_pages -= end - start;
+}
+
+/*******************************************************************************
+ * Name:	__vm_page_deferred_init_chunk
+ * Desc:	Initialise the next chunk of pages, preferring a segment on 'node'.
+ * 			Returns zero once every page has been initialised.
+*******************************************************************************/
+
+static int __vm_page_deferred_init_chunk (unsigned int node)
+{
+	vm_page_segment_t *seg;
+	unsigned int pass, i;
+	uint64_t start;
+
+	if (vm_page_deferred_pages == 0)
+		return 0;
+
+	for_each_segment_by_node(seg, node, pass, i) {
+		if (seg->init_idx == seg->first_idx + seg->npages)
+			continue;
+
+		start = machine_timer_get_ticks();
+		__vm_page_init_range(seg, VM_PAGE_INIT_CHUNK);
+		vm_page_deferred_ticks += machine_timer_get_ticks() - start;
+
+		if (vm_page_deferred_pages == 0)
+			vm_page_log("deferred page initialisation complete in %dus\n",
+				machine_timer_ticks_to_us(vm_page_deferred_ticks));
+		return 1;
 	}
+	return 0;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_deferred_init
+ * Desc:	Initialise up to 'budget' chunks of pages, and return the number of
+ * 			chunks initialised. This should be called while the kernel is idle
+ * 			until it returns zero.
+*******************************************************************************/
+
+uint32_t vm_page_deferred_init (uint32_t budget)
+{
+	uint32_t done = 0;
+
+	while (done < budget && __vm_page_deferred_init_chunk(VM_PAGE_NODE_ANY))
+		done += 1;
+
+	return done;
+}
+
+/*******************************************************************************
+ * Name:	vm_page_bootstrap
+ * Desc:	Bootstrap the kernel page allocator. Create a segment for each of
+ * 			the provided physical memory ranges, and initialise enough pages
+ * 			after the kernel to finish booting. The remaining pages are
+ * 			initialised later, see vm_page_deferred_init().
+*******************************************************************************/
+
+void vm_page_bootstrap (const platform_memory_range_t *ranges,
+						unsigned int nranges,
+						const platform_memory_range_t *reserved,
+						unsigned int nreserved,
+						phys_addr_t kernbase, phys_size_t kernsize)
+{
+	uint64_t page_count, kern_page_count, boot_pages, start_ticks, i, j;
+	vm_page_segment_t *seg;
+	phys_addr_t base, end;
+	vm_address_t cursor;
+
+	vm_page_log ("starting vm_page_bootstrap\n");
+	start_ticks = machine_timer_get_ticks();
+
+	/* create a segment for each page aligned memory range, sorted by base */
+	vm_page_nsegments = 0;
+	for (i = 0; i < nranges; i++) {
+		base = (ranges[i].base + VM_PAGE_SIZE - 1) & ~(VM_PAGE_SIZE - 1);
+		end = (ranges[i].base + ranges[i].size) & ~(VM_PAGE_SIZE - 1);
+		if (end <= base)
+			continue;
+
+		if (vm_page_nsegments == VM_PAGE_MAX_SEGMENTS) {
+			vm_page_log("warning: ignoring memory range 0x%lx-0x%lx\n",
+				base, end);
+			continue;
+		}
+
+		for (j = vm_page_nsegments; j > 0 && vm_page_segments[j - 1].base > base; j--)
+			vm_page_segments[j] = vm_page_segments[j - 1];
+
+		seg = &vm_page_segments[j];
+		seg->base = base;
+		seg->npages = (end - base) / VM_PAGE_SIZE;
+		seg->node = ranges[i].node;
+		vm_page_nsegments += 1;
+	}
+	if (vm_page_nsegments == 0)
+		panic("error: no usable physical memory\n");
+
+	/* give each segment its range of page indexes, and empty free areas */
+	page_count = 0;
+	for (i = 0; i < vm_page_nsegments; i++) {
+		seg = &vm_page_segments[i];
+		seg->first_idx = page_count;
+		seg->init_idx = page_count;
+		page_count += seg->npages;
+
+		for (j = 0; j < VM_PAGE_MAX_ORDER; j++) {
+			seg->free_areas[j].head = VM_PAGE_IDX_NONE;
+			seg->free_areas[j].nr_free = 0;
+		}
+
+		vm_page_log("segment %d: 0x%lx-0x%lx (%d pages), node %d\n", i,
+			seg->base, seg->base + (seg->npages * VM_PAGE_SIZE), seg->npages,
+			seg->node);
+	}
+
+	/* keep the reserved ranges for when the rest of memory is initialised */
+	vm_page_nreserved = 0;
+	for (i = 0; i < nreserved && i < PLATFORM_RESERVED_RANGES_MAX; i++)
+		vm_page_reserved[vm_page_nreserved++] = reserved[i];
+
+	/* links, the free and mapped bitmaps, reference counts, then page states */
+	vm_page_region_size = (vm_size_t) page_count * sizeof (vm_page_link_t) +
+		(2 * BITMAP_SIZE(page_count)) + page_count * sizeof (vm_page_ref_t) +
+		page_count * sizeof (vm_page_t);
+
+	vm_page_log ("page count: %d, size required (%dKB)\n",
+		page_count, vm_page_region_size / 1024);
+
+	/* initialise the .vm page region */
+	cursor = (vm_address_t) &vm_page_region_lower_bound;
+	vm_page_region_upper_bound = cursor + vm_page_region_size;
+
+	vm_page_links = (vm_page_link_t *) cursor;
+	cursor += page_count * sizeof (vm_page_link_t);
+
+	/* no pages are free until they're given to the buddy allocator */
+	vm_page_free_map = (bitmap_t *) cursor;
+	bitmap_zero(vm_page_free_map, page_count);
+	cursor += BITMAP_SIZE(page_count);
+
+	vm_page_mapped_map = (bitmap_t *) cursor;
+	bitmap_zero(vm_page_mapped_map, page_count);
+	cursor += BITMAP_SIZE(page_count);
+
+	vm_page_refs = (vm_page_ref_t *) cursor;
+	cursor += page_count * sizeof (vm_page_ref_t);
+
+	vm_page_region = (vm_page_t *) cursor;
+	vm_page_idx = page_count;
+	vm_page_deferred_pages = page_count;
+
+	vm_page_log ("initialised page region: 0x%lx-0x%lx\n",
+		&vm_page_region_lower_bound, vm_page_region_upper_bound);
+
+	/* the kernel is followed in memory by the page region */
+	kern_page_count = ((kernsize + vm_page_region_size) / VM_PAGE_SIZE) + 1;
+	vm_page_kern_base = kernbase;
+	vm_page_kern_end = kernbase + (kern_page_count * VM_PAGE_SIZE);
+	vm_page_log("reserved %d kernel pages\n", kern_page_count);
+
+	/**
+	 * initialise the segment containing the kernel up to VM_PAGE_BOOT_INIT_PAGES
+	 * past the end of the kernel, or the first segment if the kernel isn't in
+	 * any of them.
+	*/
+	seg = &vm_page_segments[0];
+	boot_pages = VM_PAGE_BOOT_INIT_PAGES;
+	for (i = 0; i < vm_page_nsegments; i++) {
+		if (kernbase >= vm_page_segments[i].base && kernbase <
+			vm_page_segments[i].base + (vm_page_segments[i].npages * VM_PAGE_SIZE)) {
+			seg = &vm_page_segments[i];
+			boot_pages += (vm_page_kern_end - seg->base) / VM_PAGE_SIZE;
+			break;
+		}
+	}
+	while (boot_pages && seg->init_idx < seg->first_idx + seg->npages) {
+		__vm_page_init_range(seg, VM_PAGE_INIT_CHUNK);
+		boot_pages -= (boot_pages > VM_PAGE_INIT_CHUNK) ?
+			VM_PAGE_INIT_CHUNK : boot_pages;
+	}
+
+	vm_page_log("initialised %d pages in %dus, %d pages deferred\n",
+		page_count - vm_page_deferred_pages,
+		machine_timer_ticks_to_us(machine_timer_get_ticks() - start_ticks),
+		vm_page_deferred_pages);
+
+#if VM_PAGE_DEBUG_LOGGING
+	vm_page_dump_free_areas();
 #endif
-}
\ No newline at end of file
+}
@@ -33,8 +33,9 @@
 #include <kern/defaults.h>
 #include <kern/vm/pmap.h>
 #include <kern/vm/vm.h>
+#include <kern/cpu.h>
 
-#include <libkern/list.h>
+#include <platform/platform.h>
 
 /* interface logger */
 #define vm_page_log(fmt, ...)		interface_log("vm_page", fmt, ##__VA_ARGS__)
@@ -44,51 +45,238 @@
 
 /* Page size */
 #define VM_PAGE_SIZE				DEFAULTS_KERNEL_VM_PAGE_SIZE
-#define VM_PAGE_STRUCT_SIZE			sizeof(vm_page_t)
+
+/* Round a size or address up to a page boundary */
+#define VM_PAGE_ROUND(_x)			(((_x) + VM_PAGE_SIZE - 1) & ~(VM_PAGE_SIZE - 1))
 
 /* Guard page */
 #define VM_PAGE_GUARD_MAGIC			0xefbeaddeefbeadde
 
+/* Buddy allocator orders, the largest block is 2^(VM_PAGE_MAX_ORDER - 1) pages */
+#define VM_PAGE_MAX_ORDER			UL(11)
+#define VM_PAGE_ORDER_PAGES(__o)	(UL(1) << (__o))
+
+/* Huge pages are mapped with a single level 2 block entry */
+#define VM_PAGE_HUGE_ORDER			(TT_L2_SHIFT - TT_L3_SHIFT)
+#define VM_PAGE_HUGE_PAGES			VM_PAGE_ORDER_PAGES(VM_PAGE_HUGE_ORDER)
+#define VM_PAGE_HUGE_SIZE			(VM_PAGE_HUGE_PAGES * VM_PAGE_SIZE)
+
+/* Returned when no physical page could be allocated */
+#define VM_PAGE_NULL				((phys_addr_t) 0x0)
+
+/* Per-CPU page cache size, and the number of pages moved per refill/drain */
+#define VM_PAGE_CPU_CACHE_SIZE		UL(64)
+#define VM_PAGE_CPU_CACHE_BATCH_ORDER	UL(4)
+#define VM_PAGE_CPU_CACHE_BATCH		VM_PAGE_ORDER_PAGES(VM_PAGE_CPU_CACHE_BATCH_ORDER)
+
+/* Maximum number of physical memory segments, and the "no preference" node */
+#define VM_PAGE_MAX_SEGMENTS		PLATFORM_MEMORY_RANGES_MAX
+#define VM_PAGE_NODE_ANY			((unsigned int) -1)
+
+/**
+ * Page metadata is initialised in chunks of VM_PAGE_INIT_CHUNK pages. Only
+ * VM_PAGE_BOOT_INIT_PAGES after the kernel are initialised during boot, and the
+ * rest are initialised when the allocator runs out, or while the kernel is idle.
+*/
+#define VM_PAGE_INIT_CHUNK			VM_PAGE_ORDER_PAGES(VM_PAGE_MAX_ORDER - 1)
+#define VM_PAGE_BOOT_INIT_PAGES		UL(8192)
+
+/* Pre-zeroed page pool size, and the number of pages zeroed per idle pass */
+#define VM_PAGE_ZERO_POOL_SIZE		UL(64)
+#define VM_PAGE_ZERO_POOL_BATCH		UL(8)
+
+/* Page allocation and mapping states */
+#define VM_PAGE_STATE_ALLOC			UL(0x1)
+#define VM_PAGE_STATE_FREE			UL(0x0)
+
+#define VM_PAGE_IS_MAPPED			UL(0x1)
+#define VM_PAGE_IS_NOT_MAPPED		UL(0x0)
+
+/**
+ * Reclaim callback, called when the allocator runs out of free pages so that
+ * memory cached elsewhere in the kernel (e.g. empty zone pages) can be returned.
+ * Returns the number of pages freed.
+*/
+typedef uint64_t (*vm_page_reclaim_t) (void);
+
+/* Page reference count type, stored less one, and the largest count */
+typedef uint16_t					vm_page_ref_t;
+#define VM_PAGE_REF_MAX				((uint32_t) 0xffff + 1)
+
+/* Page index type, and the index used to terminate a free list */
+typedef uint32_t					vm_page_idx_t;
+#define VM_PAGE_IDX_NONE			((vm_page_idx_t) 0xffffffff)
+
 /**
  * Virtual Memory Physical Page
- * 
+ *
+ * Page metadata is kept as a set of parallel arrays, indexed by the page's
+ * offset from the start of physical memory, rather than as one large structure
+ * per page. The physical address and index of a page are calculated from its
+ * position, so only the following are stored:
+ *
+ * 		1) A packed state byte for each page (vm_page_t) with the buddy
+ * 		   allocator state.
+ * 		2) A free list link for each page (vm_page_link_t), which is only used
+ * 		   while the page is the head of a free block.
+ * 		3) A bitmap of free pages, used for the allocation state.
+ * 		4) A bitmap of mapped pages, used for the mapping state.
+ * 		5) A reference count for each page (vm_page_ref_t), for pages which
+ * 		   are shared, for example copy-on-write pages.
+ *
  * Information on how the vm_page functions can be found in
  * docs/memory-management.txt
 */
 typedef struct vm_page				vm_page_t;
 struct vm_page {
+	uint8_t
+		/* page is the head of a free block in a free area */
+					buddy:1,
 
-	/* Physical memory address of the page */
-	phys_addr_t		paddr;
+		/* order of the free block, only valid when 'buddy' is set */
+					order:5,
 
-	list_node_t		siblings;
+		/* page is held in a per-cpu page cache */
+					cached:1,
 
-	/* Page index */
-	uint64_t		idx;
+		/* unused bits */
+					__unused_bits:1;
+};
 
-	/* Page flags */
-	unsigned int
-		/* current page alloc state */
-					state:1,
-#define VM_PAGE_STATE_ALLOC		UL(0x1)
-#define VM_PAGE_STATE_FREE		UL(0x0)
+/**
+ * Free list links, stored as page indexes instead of pointers to halve their
+ * size. Terminated with VM_PAGE_IDX_NONE.
+*/
+typedef struct vm_page_link {
+	vm_page_idx_t	next;
+	vm_page_idx_t	prev;
+} vm_page_link_t;
 
-		/* current page mapping state */
-					mapped:1,
-#define VM_PAGE_IS_MAPPED		UL(0x1)
-#define VM_PAGE_IS_NOT_MAPPED	UL(0x0)
+/* Size of the page metadata for each physical page, excluding the bitmaps */
+#define VM_PAGE_STRUCT_SIZE			(sizeof(vm_page_t) + sizeof(vm_page_link_t) + \
+									sizeof(vm_page_ref_t))
 
-		/* unused bits */
-					__unused_bits:30;
+/**
+ * Buddy allocator free area. There is one free area for each order, holding the
+ * head page of every free block of 2^order pages.
+*/
+typedef struct vm_page_free_area {
+	vm_page_idx_t	head;
+	uint64_t		nr_free;
+} vm_page_free_area_t;
 
-};
+/**
+ * Physical memory segment
+ *
+ * Each range of physical memory is managed as a separate segment, with its own
+ * buddy allocator free areas so that blocks are never merged across a hole.
+ * The page metadata arrays are shared, with each segment taking the indexes
+ * first_idx to first_idx + npages.
+*/
+typedef struct vm_page_segment {
+	phys_addr_t			base;		/* physical base address, page aligned */
+	uint64_t			npages;		/* number of pages in the segment */
+	uint64_t			first_idx;	/* index of the first page in the arrays */
+	uint64_t			init_idx;	/* pages below this index are initialised */
+	unsigned int		node;		/* numa node of the segment */
+
+	vm_page_free_area_t	free_areas[VM_PAGE_MAX_ORDER];
+} vm_page_segment_t;
+
+/**
+ * Per-CPU page cache
+ *
+ * Each CPU keeps a small stack of free order-0 pages in front of the buddy
+ * allocator, so single page allocations and frees don't touch the global free
+ * areas. The cache is refilled and drained in batches of VM_PAGE_CPU_CACHE_BATCH
+ * pages. Pages in a cache are still marked as allocated in the free bitmap.
+*/
+typedef struct vm_page_cpu_cache {
+	phys_addr_t		pages[VM_PAGE_CPU_CACHE_SIZE];
+	uint32_t		count;
+
+	/* statistics */
+	uint64_t		hits;		/* allocations served from the cache */
+	uint64_t		misses;		/* allocations which needed a refill */
+	uint64_t		refills;	/* number of batch refills */
+	uint64_t		drains;		/* number of batch drains */
+} vm_page_cpu_cache_t;
+
+/**
+ * Pre-zeroed page pool
+ *
+ * A stack of order-0 pages which have already been zeroed, so that
+ * vm_page_alloc_zeroed() doesn't need to clear a page on the allocation path.
+ * The pool is topped up while the kernel is idle by vm_page_zero_pool_refill().
+*/
+typedef struct vm_page_zero_pool {
+	phys_addr_t		pages[VM_PAGE_ZERO_POOL_SIZE];
+	uint32_t		count;
+
+	/* statistics */
+	uint32_t		low_water;	/* lowest depth since the pool was last full */
+	uint64_t		hits;		/* allocations served from the pool */
+	uint64_t		misses;		/* allocations zeroed synchronously */
+	uint64_t		zeroed;		/* pages zeroed by the idle worker */
+	uint64_t		depth_sum;	/* sum of the depth at each allocation */
+} vm_page_zero_pool_t;
 
 /* initialise pages */
-extern void vm_page_bootstrap (phys_addr_t membase, phys_size_t memsize,
-							phys_size_t kernsize);
+extern void vm_page_bootstrap (const platform_memory_range_t *ranges,
+							unsigned int nranges,
+							const platform_memory_range_t *reserved,
+							unsigned int nreserved,
+							phys_addr_t kernbase, phys_size_t kernsize);
+
+/* buddy allocator */
+extern phys_addr_t vm_page_alloc_order (unsigned int order);
+extern phys_addr_t vm_page_alloc_order_node (unsigned int order,
+							unsigned int node);
+extern phys_addr_t vm_page_try_alloc_order (unsigned int order);
+extern void vm_page_free_order (phys_addr_t paddr, unsigned int order);
 
+/* physically contiguous allocation */
+extern phys_addr_t vm_page_alloc_contig (uint64_t npages, uint64_t align);
+extern void vm_page_free_contig (phys_addr_t paddr, uint64_t npages);
+
+/* huge page allocation */
+extern phys_addr_t vm_page_alloc_huge ();
+extern void vm_page_free_huge (phys_addr_t paddr);
+
+/* single page allocation, order-0 wrappers */
 extern phys_addr_t vm_page_alloc ();
 extern phys_addr_t vm_guard_page();
-extern void vm_page_free ();
+extern void vm_page_free (phys_addr_t paddr);
+
+/* page state */
+extern int vm_page_get_state (phys_addr_t paddr);
+extern int vm_page_get_mapped (phys_addr_t paddr);
+extern void vm_page_set_mapped (phys_addr_t paddr, int mapped);
+
+/* memory pressure */
+extern void vm_page_set_reclaim (vm_page_reclaim_t reclaim);
+extern uint64_t vm_page_free_count ();
+
+/* page reference counts */
+extern uint32_t vm_page_ref_get (phys_addr_t paddr);
+extern uint32_t vm_page_ref_put (phys_addr_t paddr);
+extern uint32_t vm_page_ref_count (phys_addr_t paddr);
+
+/* deferred page initialisation */
+extern uint32_t vm_page_deferred_init (uint32_t budget);
+
+/* per-cpu page caches */
+extern void vm_page_cpu_cache_drain_all ();
+extern void vm_page_cpu_cache_stats (cpu_number_t cpu, uint64_t *hits,
+							uint64_t *misses);
+extern void vm_page_dump_cpu_caches ();
+
+/* pre-zeroed pages */
+extern phys_addr_t vm_page_alloc_zeroed ();
+extern uint32_t vm_page_zero_pool_refill (uint32_t budget);
+extern void vm_page_zero_pool_drain ();
+extern void vm_page_zero_pool_stats (uint64_t *depth, uint64_t *low_water,
+							uint64_t *hits, uint64_t *misses);
+extern void vm_page_dump_zero_pool ();
 
 #endif /* __kern_vm_page_h__ */
\ No newline at end of file
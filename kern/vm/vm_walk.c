@@ -41,7 +41,7 @@ static void _vm_pagetable_walk(tt_table_t *table_base, int level, int padding)
 
 		/* table entry */
 		if (type == TTE_TYPE_TABLE && level < 3) {
-			vm_address_t table_address = ptokva(entry & TT_TABLE_MASK);
+			vm_address_t table_address = (vm_address_t) pmap_tt_ptokva(entry & TT_TABLE_MASK);
 			PRINT_PADDING(padding);
 			kprintf("Level %d [%d]: Table descriptor @ 0x%lx:\n",
 				level, idx, (entry & TT_TABLE_MASK));
@@ -0,0 +1,617 @@
+//===----------------------------------------------------------------------===//
+//
+//                                  tinyOS
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//	Copyright (C) 2024, Harry Moulton <me@h3adsh0tzz.com>
+//
+//===----------------------------------------------------------------------===//
+
+#include <kern/vm/vmem.h>
+#include <kern/vm/vm_page.h>
+#include <kern/mm/zalloc.h>
+#include <kern/kprintf.h>
+
+#include <libkern/panic.h>
+#include <tinylibc/string.h>
+
+/**
+ * Segments used before the segment zone exists, and the pool of unused ones.
+ * Arenas are first created during arm_vm_init, so these are kept in .data.
+*/
+static vmem_seg_t	vmem_boot_segs[VMEM_BOOT_SEGS] __attribute__((section(".data")));
+static uint32_t		vmem_boot_segs_used __attribute__((section(".data")));
+static LIST_HEAD(vmem_seg_pool);
+static uint32_t		vmem_seg_pool_count __attribute__((section(".data")));
+
+/* zone of segments, and whether a segment is being allocated from it */
+static zone_t		*vmem_seg_zone __attribute__((section(".data")));
+static int			vmem_seg_zone_busy __attribute__((section(".data")));
+
+#define __vmem_round(_size, _quantum)	(((_size) + (_quantum) - 1) & ~((_quantum) - 1))
+
+/* segment following, or preceding, another in the arena's segment list */
+#define __vmem_seg_next(_seg)	list_entry((_seg)->seglist.next, vmem_seg_t, seglist)
+#define __vmem_seg_prev(_seg)	list_entry((_seg)->seglist.prev, vmem_seg_t, seglist)
+
+/*******************************************************************************
+ * Name:	vmem_init
+ * Desc:	Create the zone that arena segments are allocated from. Until then,
+ * 			segments come from a static pool.
+*******************************************************************************/
+
+void vmem_init (void)
+{
+	vmem_seg_zone = zone_create(sizeof(vmem_seg_t), VMEM_SEG_ZONE_MAX_SIZE,
+		"vmem.segs");
+	if (vmem_seg_zone == NULL)
+		panic("vmem: failed to create segment zone\n");
+}
+
+/*******************************************************************************
+ * Name:	__vmem_seg_get
+ * Desc:	Take an unused segment from the pool, or the boot segments. Arena
+ * 			operations never allocate from the segment zone themselves, so they
+ * 			can't be re-entered part way through.
+*******************************************************************************/
+
+static vmem_seg_t *__vmem_seg_get (void)
+{
+	vmem_seg_t *seg;
+
+	if (!list_empty(&vmem_seg_pool)) {
+		seg = list_first_entry(&vmem_seg_pool, vmem_seg_t, link);
+		list_del(&seg->link);
+		vmem_seg_pool_count -= 1;
+	} else if (vmem_boot_segs_used < VMEM_BOOT_SEGS) {
+		seg = &vmem_boot_segs[vmem_boot_segs_used++];
+	} else {
+		panic("vmem: out of segments\n");
+	}
+
+	memset(seg, '\0', sizeof(vmem_seg_t));
+	return seg;
+}
+
+/* return a segment to the pool */
+static void __vmem_seg_put (vmem_seg_t *seg)
+{
+	list_add(&seg->link, &vmem_seg_pool);
+	vmem_seg_pool_count += 1;
+}
+
+/*******************************************************************************
+ * Name:	__vmem_populate
+ * Desc:	Top up the pool of unused segments before an arena is changed. The
+ * 			segment zone may need to grow, which allocates from the kernel heap
+ * 			arena, so while that happens segments are taken from the pool only.
+*******************************************************************************/
+
+static void __vmem_populate (void)
+{
+	vmem_seg_t *seg;
+
+	if (vmem_seg_zone == NULL || vmem_seg_zone_busy)
+		return;
+
+	while (vmem_seg_pool_count + (VMEM_BOOT_SEGS - vmem_boot_segs_used) <
+		VMEM_SEGS_MIN) {
+
+		vmem_seg_zone_busy = 1;
+		seg = (vmem_seg_t *) zalloc(vmem_seg_zone);
+		vmem_seg_zone_busy = 0;
+
+		if (seg == NULL)
+			return;
+		__vmem_seg_put(seg);
+	}
+}
+
+/* free list that a segment of a given size belongs on */
+static inline int __vmem_freelist_index (vm_size_t size)
+{
+	return 63 - __builtin_clzl(size);
+}
+
+static void __vmem_freelist_insert (vmem_t *vmp, vmem_seg_t *seg)
+{
+	int idx = __vmem_freelist_index(seg->size);
+
+	list_add(&seg->link, &vmp->freelist[idx]);
+	vmp->freemap |= (1UL << idx);
+}
+
+/* must be called before the segment's size changes */
+static void __vmem_freelist_remove (vmem_t *vmp, vmem_seg_t *seg)
+{
+	int idx = __vmem_freelist_index(seg->size);
+
+	list_del(&seg->link);
+	if (list_empty(&vmp->freelist[idx]))
+		vmp->freemap &= ~(1UL << idx);
+}
+
+static void __vmem_alloc_tree_insert (vmem_t *vmp, vmem_seg_t *seg)
+{
+	rb_node_t **link = &vmp->alloc_tree.node, *parent = NULL;
+	vmem_seg_t *cur;
+
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, vmem_seg_t, rb_node);
+		link = (seg->base < cur->base) ? &parent->left : &parent->right;
+	}
+	rb_link_node(&seg->rb_node, parent, link);
+	rb_insert_colour(&seg->rb_node, &vmp->alloc_tree);
+}
+
+/* find the allocated segment containing an address */
+static vmem_seg_t *__vmem_alloc_tree_lookup (vmem_t *vmp, vm_address_t addr)
+{
+	rb_node_t *node = vmp->alloc_tree.node;
+	vmem_seg_t *seg;
+
+	while (node) {
+		seg = rb_entry(node, vmem_seg_t, rb_node);
+		if (addr < seg->base)
+			node = node->left;
+		else if (addr >= seg->base + seg->size)
+			node = node->right;
+		else
+			return seg;
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+ * Name:	__vmem_span_add
+ * Desc:	Add a span to an arena, in address order with its other spans, and
+ * 			return the free segment covering it. Returns NULL if the span
+ * 			overlaps one the arena already has.
+*******************************************************************************/
+
+static vmem_seg_t *__vmem_span_add (vmem_t *vmp, vm_address_t base,
+							vm_size_t size, int imported)
+{
+	list_node_t *pos = &vmp->segs;
+	vmem_seg_t *span, *seg, *cur;
+
+	list_for_each_entry(cur, &vmp->segs, seglist) {
+		if (cur->type != VMEM_SEG_SPAN)
+			continue;
+
+		if (base < cur->base + cur->size && cur->base < base + size)
+			return NULL;
+		if (cur->base > base) {
+			pos = &cur->seglist;
+			break;
+		}
+	}
+
+	span = __vmem_seg_get();
+	span->base = base;
+	span->size = size;
+	span->type = VMEM_SEG_SPAN;
+	span->imported = imported;
+	list_add_tail(&span->seglist, pos);
+
+	seg = __vmem_seg_get();
+	seg->base = base;
+	seg->size = size;
+	seg->type = VMEM_SEG_FREE;
+	list_add(&seg->seglist, &span->seglist);
+	__vmem_freelist_insert(vmp, seg);
+
+	vmp->size += size;
+	return seg;
+}
+
+/*******************************************************************************
+ * Name:	__vmem_seg_alloc
+ * Desc:	Allocate a range from within a free segment. Whatever is left either
+ * 			side of the range is returned to the free lists.
+*******************************************************************************/
+
+static vm_address_t __vmem_seg_alloc (vmem_t *vmp, vmem_seg_t *seg,
+							vm_address_t addr, vm_size_t size)
+{
+	vmem_seg_t *rest;
+
+	__vmem_freelist_remove(vmp, seg);
+
+	if (addr > seg->base) {
+		rest = __vmem_seg_get();
+		rest->base = seg->base;
+		rest->size = addr - seg->base;
+		rest->type = VMEM_SEG_FREE;
+		list_add_tail(&rest->seglist, &seg->seglist);
+		__vmem_freelist_insert(vmp, rest);
+	}
+
+	if (addr + size < seg->base + seg->size) {
+		rest = __vmem_seg_get();
+		rest->base = addr + size;
+		rest->size = (seg->base + seg->size) - (addr + size);
+		rest->type = VMEM_SEG_FREE;
+		list_add(&rest->seglist, &seg->seglist);
+		__vmem_freelist_insert(vmp, rest);
+	}
+
+	seg->base = addr;
+	seg->size = size;
+	seg->type = VMEM_SEG_ALLOC;
+	__vmem_alloc_tree_insert(vmp, seg);
+
+	vmp->inuse += size;
+	return addr;
+}
+
+/*******************************************************************************
+ * Name:	__vmem_find_fit
+ * Desc:	Find a free segment large enough for a size. Every segment on a list
+ * 			above the size's own holds at least the next power of two, so the
+ * 			first of those fits without searching. Only if there are none is
+ * 			the size's own list searched.
+*******************************************************************************/
+
+static vmem_seg_t *__vmem_find_fit (vmem_t *vmp, vm_size_t size)
+{
+	vmem_seg_t *seg;
+	uint64_t mask = 0;
+	int idx, first;
+
+	idx = __vmem_freelist_index(size);
+	first = (size & (size - 1)) ? idx + 1 : idx;
+
+	if (first < VMEM_FREELISTS)
+		mask = vmp->freemap & (~0UL << first);
+	if (mask)
+		return list_first_entry(&vmp->freelist[__builtin_ctzl(mask)],
+			vmem_seg_t, link);
+
+	if (first != idx && (vmp->freemap & (1UL << idx))) {
+		list_for_each_entry(seg, &vmp->freelist[idx], link) {
+			if (seg->size >= size)
+				return seg;
+		}
+	}
+	return NULL;
+}
+
+static vm_address_t __vmem_alloc (vmem_t *vmp, vm_size_t size);
+static vm_address_t __vmem_xalloc (vmem_t *vmp, vm_size_t size, vm_address_t addr);
+static void __vmem_free (vmem_t *vmp, vm_address_t addr, vm_size_t size);
+static void __vmem_qcache_purge (vmem_t *vmp, vm_address_t addr, vm_size_t size);
+
+/*******************************************************************************
+ * Name:	__vmem_import
+ * Desc:	Import a span from the arena's source and return its free segment.
+ * 			Imports are rounded up to the arena's import size, unless a fixed
+ * 			address is being allocated, in which case just that range is taken.
+*******************************************************************************/
+
+static vmem_seg_t *__vmem_import (vmem_t *vmp, vm_size_t size, vm_address_t addr)
+{
+	vm_address_t base;
+	vmem_seg_t *seg;
+
+	if (vmp->source == NULL)
+		return NULL;
+
+	if (addr != VMEM_NULL) {
+		base = __vmem_xalloc(vmp->source, size, addr);
+	} else {
+		if (vmp->import_size)
+			size = __vmem_round(size, vmp->import_size);
+		base = __vmem_alloc(vmp->source, size);
+	}
+	if (base == VMEM_NULL)
+		return NULL;
+
+	seg = __vmem_span_add(vmp, base, size, 1);
+	if (seg == NULL)
+		panic("vmem: %s: span 0x%lx imported from %s is already present\n",
+			vmp->name, base, vmp->source->name);
+
+	vmp->imports += 1;
+	return seg;
+}
+
+static vm_address_t __vmem_alloc (vmem_t *vmp, vm_size_t size)
+{
+	vmem_qcache_t *qc;
+	vmem_seg_t *seg;
+
+	size = __vmem_round(size, vmp->quantum);
+	if (size == 0)
+		return VMEM_NULL;
+
+	if (size <= vmp->qcache_max) {
+		qc = &vmp->qcache[(size / vmp->quantum) - 1];
+		if (qc->count)
+			return qc->addrs[--qc->count];
+	}
+
+	if ((seg = __vmem_find_fit(vmp, size)) == NULL &&
+		(seg = __vmem_import(vmp, size, VMEM_NULL)) == NULL) {
+		vmem_log("error: %s: no space for 0x%lx bytes\n", vmp->name, size);
+		return VMEM_NULL;
+	}
+	return __vmem_seg_alloc(vmp, seg, seg->base, size);
+}
+
+static vm_address_t __vmem_xalloc (vmem_t *vmp, vm_size_t size, vm_address_t addr)
+{
+	vmem_seg_t *seg;
+
+	size = __vmem_round(size, vmp->quantum);
+	if (size == 0 || (addr & (vmp->quantum - 1)))
+		return VMEM_NULL;
+
+	/* cached ranges are still allocated, so give back any in the way first */
+	__vmem_qcache_purge(vmp, addr, size);
+
+	list_for_each_entry(seg, &vmp->segs, seglist) {
+		if (seg->type == VMEM_SEG_FREE && addr >= seg->base &&
+			addr + size <= seg->base + seg->size)
+			return __vmem_seg_alloc(vmp, seg, addr, size);
+	}
+
+	if ((seg = __vmem_import(vmp, size, addr)) != NULL)
+		return __vmem_seg_alloc(vmp, seg, addr, size);
+	return VMEM_NULL;
+}
+
+/*******************************************************************************
+ * Name:	__vmem_release
+ * Desc:	Return an allocated range, rounded to the quantum, to the arena's
+ * 			free segments, bypassing the quantum caches.
+*******************************************************************************/
+
+static void __vmem_release (vmem_t *vmp, vm_address_t addr, vm_size_t size)
+{
+	vmem_seg_t *seg, *rest, *span;
+
+	seg = __vmem_alloc_tree_lookup(vmp, addr);
+	if (seg == NULL || addr + size > seg->base + seg->size) {
+		vmem_log("error: %s: 0x%lx-0x%lx is not allocated\n", vmp->name,
+			addr, addr + size);
+		return;
+	}
+	rb_erase(&seg->rb_node, &vmp->alloc_tree);
+
+	/* whatever of the segment is outside the range stays allocated */
+	if (addr > seg->base) {
+		rest = __vmem_seg_get();
+		rest->base = seg->base;
+		rest->size = addr - seg->base;
+		rest->type = VMEM_SEG_ALLOC;
+		list_add_tail(&rest->seglist, &seg->seglist);
+		__vmem_alloc_tree_insert(vmp, rest);
+	}
+
+	if (addr + size < seg->base + seg->size) {
+		rest = __vmem_seg_get();
+		rest->base = addr + size;
+		rest->size = (seg->base + seg->size) - (addr + size);
+		rest->type = VMEM_SEG_ALLOC;
+		list_add(&rest->seglist, &seg->seglist);
+		__vmem_alloc_tree_insert(vmp, rest);
+	}
+
+	seg->base = addr;
+	seg->size = size;
+	seg->type = VMEM_SEG_FREE;
+	vmp->inuse -= size;
+
+	/* coalesce with free neighbours. a span always precedes its segments */
+	rest = __vmem_seg_prev(seg);
+	if (rest->type == VMEM_SEG_FREE) {
+		__vmem_freelist_remove(vmp, rest);
+		seg->base = rest->base;
+		seg->size += rest->size;
+		list_del(&rest->seglist);
+		__vmem_seg_put(rest);
+	}
+
+	rest = __vmem_seg_next(seg);
+	if (&rest->seglist != &vmp->segs && rest->type == VMEM_SEG_FREE) {
+		__vmem_freelist_remove(vmp, rest);
+		seg->size += rest->size;
+		list_del(&rest->seglist);
+		__vmem_seg_put(rest);
+	}
+
+	/* give an imported span back to its source once it's entirely free */
+	span = __vmem_seg_prev(seg);
+	if (span->imported && span->size == seg->size) {
+		list_del(&seg->seglist);
+		list_del(&span->seglist);
+		vmp->size -= span->size;
+
+		__vmem_free(vmp->source, span->base, span->size);
+		__vmem_seg_put(seg);
+		__vmem_seg_put(span);
+		return;
+	}
+
+	__vmem_freelist_insert(vmp, seg);
+}
+
+static void __vmem_free (vmem_t *vmp, vm_address_t addr, vm_size_t size)
+{
+	vmem_qcache_t *qc;
+
+	size = __vmem_round(size, vmp->quantum);
+	if (size == 0)
+		return;
+
+	/* cached ranges stay allocated in the arena */
+	if (size <= vmp->qcache_max) {
+		qc = &vmp->qcache[(size / vmp->quantum) - 1];
+		if (qc->count < VMEM_QCACHE_DEPTH) {
+			qc->addrs[qc->count++] = addr;
+			return;
+		}
+	}
+
+	__vmem_release(vmp, addr, size);
+}
+
+/*******************************************************************************
+ * Name:	__vmem_qcache_purge
+ * Desc:	Release any cached ranges which overlap a range, so it can be
+ * 			allocated at a fixed address.
+*******************************************************************************/
+
+static void __vmem_qcache_purge (vmem_t *vmp, vm_address_t addr, vm_size_t size)
+{
+	vm_address_t base;
+	vm_size_t csize;
+	vmem_qcache_t *qc;
+	uint32_t j;
+
+	for (int i = 0; i < VMEM_QCACHE_MAX; i++) {
+		qc = &vmp->qcache[i];
+		csize = (i + 1) * vmp->quantum;
+
+		for (j = 0; j < qc->count;) {
+			base = qc->addrs[j];
+			if (base >= addr + size || base + csize <= addr) {
+				j++;
+				continue;
+			}
+			qc->addrs[j] = qc->addrs[--qc->count];
+			__vmem_release(vmp, base, csize);
+		}
+	}
+}
+
+/*******************************************************************************
+ * Name:	vmem_create
+ * Desc:	Initialise an arena, optionally with an initial span. An arena with
+ * 			a source imports spans from it, in multiples of import_size, when
+ * 			it has no space left. Allocations up to qcache_max are cached.
+*******************************************************************************/
+
+void vmem_create (vmem_t *vmp, const char *name, vm_address_t base,
+				vm_size_t size, vm_size_t quantum, vmem_t *source,
+				vm_size_t import_size, vm_size_t qcache_max)
+{
+	int i;
+
+	memset(vmp, '\0', sizeof(vmem_t));
+	vmp->name = name;
+	vmp->quantum = quantum;
+	vmp->source = source;
+	vmp->import_size = import_size;
+
+	vmp->qcache_max = qcache_max & ~(quantum - 1);
+	if (vmp->qcache_max > VMEM_QCACHE_MAX * quantum)
+		vmp->qcache_max = VMEM_QCACHE_MAX * quantum;
+
+	INIT_LIST_HEAD(&vmp->segs);
+	for (i = 0; i < VMEM_FREELISTS; i++)
+		INIT_LIST_HEAD(&vmp->freelist[i]);
+	INIT_RB_ROOT(&vmp->alloc_tree);
+
+	if (size && vmem_add(vmp, base, size) != KERN_RETURN_SUCCESS)
+		panic("vmem: %s: failed to add initial span\n", name);
+
+	vmem_log("created arena '%s': 0x%lx-0x%lx, quantum: 0x%lx\n", name, base,
+		base + size, quantum);
+}
+
+/*******************************************************************************
+ * Name:	vmem_add
+ * Desc:	Add a span to an arena. The span must be aligned to the quantum,
+ * 			and not overlap any span already in the arena.
+*******************************************************************************/
+
+kern_return_t vmem_add (vmem_t *vmp, vm_address_t base, vm_size_t size)
+{
+	if (size == 0 || ((base | size) & (vmp->quantum - 1)))
+		return KERN_RETURN_FAIL;
+
+	__vmem_populate();
+	if (__vmem_span_add(vmp, base, size, 0) == NULL) {
+		vmem_log("error: %s: span 0x%lx-0x%lx overlaps the arena\n", vmp->name,
+			base, base + size);
+		return KERN_RETURN_FAIL;
+	}
+	return KERN_RETURN_SUCCESS;
+}
+
+/*******************************************************************************
+ * Name:	vmem_alloc
+ * Desc:	Allocate a range of an arena, rounded up to its quantum. Returns
+ * 			VMEM_NULL if neither the arena nor its source have the space.
+*******************************************************************************/
+
+vm_address_t vmem_alloc (vmem_t *vmp, vm_size_t size)
+{
+	__vmem_populate();
+	return __vmem_alloc(vmp, size);
+}
+
+/*******************************************************************************
+ * Name:	vmem_xalloc
+ * Desc:	Allocate a range of an arena at a fixed address. Returns VMEM_NULL
+ * 			if any of the range is already allocated.
+*******************************************************************************/
+
+vm_address_t vmem_xalloc (vmem_t *vmp, vm_size_t size, vm_address_t addr)
+{
+	__vmem_populate();
+	return __vmem_xalloc(vmp, size, addr);
+}
+
+/*******************************************************************************
+ * Name:	vmem_free
+ * Desc:	Free a range returned by vmem_alloc or vmem_xalloc. Part of an
+ * 			allocation may be freed, leaving the rest allocated.
+*******************************************************************************/
+
+void vmem_free (vmem_t *vmp, vm_address_t addr, vm_size_t size)
+{
+	__vmem_populate();
+	__vmem_free(vmp, addr, size);
+}
+
+/*******************************************************************************
+ * Name:	vmem_dump
+ * Desc:	Dump the statistics and segments of an arena.
+*******************************************************************************/
+
+void vmem_dump (vmem_t *vmp)
+{
+	vmem_seg_t *seg;
+	uint32_t cached = 0;
+	int i;
+
+	for (i = 0; i < VMEM_QCACHE_MAX; i++)
+		cached += vmp->qcache[i].count;
+
+	kprintf("vmem: '%s', size: 0x%lx, in use: 0x%lx, imports: %d, cached: %d\n",
+		vmp->name, vmp->size, vmp->inuse, vmp->imports, cached);
+
+	list_for_each_entry(seg, &vmp->segs, seglist) {
+		kprintf("  %s 0x%lx-0x%lx%s\n",
+			(seg->type == VMEM_SEG_SPAN) ? "span " :
+			(seg->type == VMEM_SEG_FREE) ? "  free" : "  alloc",
+			seg->base, seg->base + seg->size,
+			(seg->type == VMEM_SEG_SPAN && seg->imported) ? " (imported)" : "");
+	}
+}
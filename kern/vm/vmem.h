@@ -0,0 +1,132 @@
+//===----------------------------------------------------------------------===//
+//
+//                                  tinyOS
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//	Copyright (C) 2024, Harry Moulton <me@h3adsh0tzz.com>
+//
+//===----------------------------------------------------------------------===//
+
+/**
+ * Name:	vmem.h
+ * Desc:	Virtual address arena allocator, after Bonwick's vmem. An arena
+ * 			hands out ranges of an address space in multiples of its quantum,
+ * 			and can import its spans from a parent arena.
+*/
+
+#ifndef __KERN_VM_VMEM_H__
+#define __KERN_VM_VMEM_H__
+
+#include <tinylibc/stdint.h>
+
+#include <libkern/types.h>
+#include <libkern/list.h>
+#include <libkern/rbtree.h>
+
+#include <kern/vm/vm_types.h>
+
+/* interface logger */
+#define vmem_log(fmt, ...)			interface_log("vmem", fmt, ##__VA_ARGS__)
+
+/**
+ * Free segments are kept on one list for each power of two, so any segment on
+ * a list above the one for a size fits it, and allocation is a bitmap lookup.
+*/
+#define VMEM_FREELISTS				64
+
+/* Quantum caches, for allocations up to VMEM_QCACHE_MAX quanta */
+#define VMEM_QCACHE_MAX				8
+#define VMEM_QCACHE_DEPTH			16
+
+/* Segments available before the segment zone is created, and kept spare */
+#define VMEM_BOOT_SEGS				128
+#define VMEM_SEGS_MIN				16
+#define VMEM_SEG_ZONE_MAX_SIZE		(256 * VM_PAGE_SIZE)
+
+/* Returned when an allocation fails */
+#define VMEM_NULL					(0x0)
+
+/* Segment types */
+#define VMEM_SEG_SPAN				0
+#define VMEM_SEG_FREE				1
+#define VMEM_SEG_ALLOC				2
+
+/**
+ * Boundary tag for a range of an arena. A span is a range added to the arena,
+ * and is followed in the segment list by the free and allocated segments
+ * covering it. Allocated segments are also indexed by base address.
+*/
+typedef struct vmem_seg {
+	vm_address_t		base;
+	vm_size_t			size;
+
+	uint32_t			type		:2,
+						imported	:1,
+						__unused_bits:29;
+
+	/* All segments, in address order */
+	list_node_t			seglist;
+
+	/* Free list, or the pool of unused segments */
+	list_node_t			link;
+
+	/* Node in the arena's tree of allocated segments */
+	rb_node_t			rb_node;
+} vmem_seg_t;
+
+/* Cached ranges of a single size */
+typedef struct vmem_qcache {
+	uint32_t			count;
+	vm_address_t		addrs[VMEM_QCACHE_DEPTH];
+} vmem_qcache_t;
+
+typedef struct vmem {
+	const char			*name;
+	vm_size_t			quantum;
+
+	/* Segments, free lists and allocated segments */
+	list_t				segs;
+	list_t				freelist[VMEM_FREELISTS];
+	uint64_t			freemap;
+	rb_root_t			alloc_tree;
+
+	/* Arena that spans are imported from, and the smallest import */
+	struct vmem			*source;
+	vm_size_t			import_size;
+
+	/* Quantum caches, for each size up to qcache_max */
+	vm_size_t			qcache_max;
+	vmem_qcache_t		qcache[VMEM_QCACHE_MAX];
+
+	/* Statistics */
+	vm_size_t			size;
+	vm_size_t			inuse;
+	uint64_t			imports;
+} vmem_t;
+
+extern void vmem_init (void);
+extern void vmem_create (vmem_t *vmp, const char *name, vm_address_t base,
+						vm_size_t size, vm_size_t quantum, vmem_t *source,
+						vm_size_t import_size, vm_size_t qcache_max);
+extern kern_return_t vmem_add (vmem_t *vmp, vm_address_t base, vm_size_t size);
+
+extern vm_address_t vmem_alloc (vmem_t *vmp, vm_size_t size);
+extern vm_address_t vmem_xalloc (vmem_t *vmp, vm_size_t size,
+						vm_address_t addr);
+extern void vmem_free (vmem_t *vmp, vm_address_t addr, vm_size_t size);
+
+extern void vmem_dump (vmem_t *vmp);
+
+#endif /* __kern_vm_vmem_h__ */
@@ -19,7 +19,7 @@ typedef unsigned int			uint_t;
 
 #define bit_set(x, b)				((x) |= BIT(b))
 #define bit_clear(x, b)				((x) &= ~BIT(b))
-#define bit_test(x, b)				((bool)((x) & BIT(b)))
+#define bit_test(x, b)				((bool)(((x) & BIT(b)) != 0))
 
 /* Returns the most significant '1' bit, or -1 if all zeros */
 inline static int
@@ -19,4 +19,5 @@
 #
 #===-----------------------------------------------------------------------===//
 
-KERNEL_SOURCES	+=	libkern/panic.o
+KERNEL_SOURCES	+=	libkern/panic.o		\
+					libkern/rbtree.o
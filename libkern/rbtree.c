@@ -0,0 +1,413 @@
+//===----------------------------------------------------------------------===//
+//
+//                                  tinyOS
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//	Copyright (C) 2024, Harry Moulton <me@h3adsh0tzz.com>
+//
+//===----------------------------------------------------------------------===//
+
+#include <libkern/rbtree.h>
+
+/* a missing child counts as black */
+#define __rb_is_red(_node)		((_node) != NULL && (_node)->colour == RB_RED)
+#define __rb_is_black(_node)	(!__rb_is_red(_node))
+
+/* point whatever referenced 'old' (its parent, or the root) at 'new' */
+static inline void __rb_replace_child(struct rb_node *old, struct rb_node *new,
+								struct rb_node *parent, struct rb_root *root)
+{
+	if (parent == NULL)
+		root->node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+/**
+ * Rotate 'node' down to the left, so its right child takes its place.
+*/
+static void __rb_rotate_left(struct rb_node *node, struct rb_root *root,
+							rb_augment_t augment)
+{
+	struct rb_node *right = node->right;
+
+	node->right = right->left;
+	if (right->left)
+		right->left->parent = node;
+
+	right->parent = node->parent;
+	__rb_replace_child(node, right, node->parent, root);
+
+	right->left = node;
+	node->parent = right;
+
+	/* 'node' is now below 'right', so must be updated first */
+	if (augment) {
+		augment(node);
+		augment(right);
+	}
+}
+
+/**
+ * Rotate 'node' down to the right, so its left child takes its place.
+*/
+static void __rb_rotate_right(struct rb_node *node, struct rb_root *root,
+							rb_augment_t augment)
+{
+	struct rb_node *left = node->left;
+
+	node->left = left->right;
+	if (left->right)
+		left->right->parent = node;
+
+	left->parent = node->parent;
+	__rb_replace_child(node, left, node->parent, root);
+
+	left->right = node;
+	node->parent = left;
+
+	if (augment) {
+		augment(node);
+		augment(left);
+	}
+}
+
+/**
+ * Restore the red-black properties after a node has been linked with
+ * rb_link_node. At most two rotations are made.
+*/
+static void __rb_insert(struct rb_node *node, struct rb_root *root,
+						rb_augment_t augment)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	while ((parent = node->parent) != NULL && parent->colour == RB_RED) {
+		gparent = parent->parent;
+
+		if (parent == gparent->left) {
+			uncle = gparent->right;
+			if (__rb_is_red(uncle)) {
+				/* recolour, and continue from the grandparent */
+				uncle->colour = parent->colour = RB_BLACK;
+				gparent->colour = RB_RED;
+				node = gparent;
+				continue;
+			}
+
+			if (node == parent->right) {
+				__rb_rotate_left(parent, root, augment);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->colour = RB_BLACK;
+			gparent->colour = RB_RED;
+			__rb_rotate_right(gparent, root, augment);
+		} else {
+			uncle = gparent->left;
+			if (__rb_is_red(uncle)) {
+				uncle->colour = parent->colour = RB_BLACK;
+				gparent->colour = RB_RED;
+				node = gparent;
+				continue;
+			}
+
+			if (node == parent->left) {
+				__rb_rotate_right(parent, root, augment);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->colour = RB_BLACK;
+			gparent->colour = RB_RED;
+			__rb_rotate_left(gparent, root, augment);
+		}
+	}
+	root->node->colour = RB_BLACK;
+}
+
+/**
+ * Rebalance after removing a black node, where 'node' (possibly NULL) has taken
+ * its place under 'parent' and is one black node short.
+*/
+static void __rb_erase_colour(struct rb_node *node, struct rb_node *parent,
+							struct rb_root *root, rb_augment_t augment)
+{
+	struct rb_node *sibling;
+
+	while (node != root->node && __rb_is_black(node)) {
+		if (node == parent->left) {
+			sibling = parent->right;
+			if (__rb_is_red(sibling)) {
+				sibling->colour = RB_BLACK;
+				parent->colour = RB_RED;
+				__rb_rotate_left(parent, root, augment);
+				sibling = parent->right;
+			}
+
+			if (__rb_is_black(sibling->left) && __rb_is_black(sibling->right)) {
+				sibling->colour = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if (__rb_is_black(sibling->right)) {
+				sibling->left->colour = RB_BLACK;
+				sibling->colour = RB_RED;
+				__rb_rotate_right(sibling, root, augment);
+				sibling = parent->right;
+			}
+			sibling->colour = parent->colour;
+			parent->colour = RB_BLACK;
+			sibling->right->colour = RB_BLACK;
+			__rb_rotate_left(parent, root, augment);
+		} else {
+			sibling = parent->left;
+			if (__rb_is_red(sibling)) {
+				sibling->colour = RB_BLACK;
+				parent->colour = RB_RED;
+				__rb_rotate_right(parent, root, augment);
+				sibling = parent->left;
+			}
+
+			if (__rb_is_black(sibling->left) && __rb_is_black(sibling->right)) {
+				sibling->colour = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if (__rb_is_black(sibling->left)) {
+				sibling->right->colour = RB_BLACK;
+				sibling->colour = RB_RED;
+				__rb_rotate_left(sibling, root, augment);
+				sibling = parent->left;
+			}
+			sibling->colour = parent->colour;
+			parent->colour = RB_BLACK;
+			sibling->left->colour = RB_BLACK;
+			__rb_rotate_right(parent, root, augment);
+		}
+		node = root->node;
+	}
+
+	if (node)
+		node->colour = RB_BLACK;
+}
+
+/**
+ * Remove a node from the tree and rebalance it. The node itself is left
+ * untouched, so it may be freed or linked into another tree afterwards.
+*/
+static void __rb_erase(struct rb_node *node, struct rb_root *root,
+						rb_augment_t augment)
+{
+	struct rb_node *child, *parent, *next;
+	unsigned int colour;
+
+	if (node->left == NULL || node->right == NULL) {
+		/* at most one child, which simply takes the node's place */
+		child = (node->left) ? node->left : node->right;
+		parent = node->parent;
+		colour = node->colour;
+
+		if (child)
+			child->parent = parent;
+		__rb_replace_child(node, child, parent, root);
+	} else {
+		/* two children, so the in-order successor takes the node's place */
+		next = node->right;
+		while (next->left)
+			next = next->left;
+
+		child = next->right;
+		colour = next->colour;
+
+		if (next->parent == node) {
+			parent = next;
+		} else {
+			parent = next->parent;
+			parent->left = child;
+			if (child)
+				child->parent = parent;
+
+			next->right = node->right;
+			node->right->parent = next;
+		}
+
+		next->left = node->left;
+		node->left->parent = next;
+		next->parent = node->parent;
+		next->colour = node->colour;
+		__rb_replace_child(node, next, node->parent, root);
+	}
+
+	/* 'parent' is the lowest node whose subtree has changed */
+	if (augment && parent)
+		rb_augment_propagate(parent, augment);
+
+	if (colour == RB_BLACK)
+		__rb_erase_colour(child, parent, root, augment);
+}
+
+/**
+ * rb_insert_colour
+ *
+ * Restore the red-black properties after a node has been linked with
+ * rb_link_node. At most two rotations are made.
+*/
+void rb_insert_colour(struct rb_node *node, struct rb_root *root)
+{
+	__rb_insert(node, root, NULL);
+}
+
+/**
+ * rb_erase
+ *
+ * Remove a node from the tree and rebalance it. The node itself is left
+ * untouched, so it may be freed or linked into another tree afterwards.
+*/
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	__rb_erase(node, root, NULL);
+}
+
+/**
+ * rb_replace_node
+ *
+ * Put a new node in the place of an existing one, such as when the structure
+ * containing it is moved. The key, and any augmented value, must be the same.
+*/
+void rb_replace_node(struct rb_node *old, struct rb_node *new,
+					struct rb_root *root)
+{
+	*new = *old;
+	__rb_replace_child(old, new, old->parent, root);
+
+	if (old->left)
+		old->left->parent = new;
+	if (old->right)
+		old->right->parent = new;
+}
+
+/**
+ * rb_augment_propagate
+ *
+ * Recompute the augmented value of a node and every node above it.
+*/
+void rb_augment_propagate(struct rb_node *node, rb_augment_t augment)
+{
+	for (; node != NULL; node = node->parent)
+		augment(node);
+}
+
+/**
+ * rb_insert_augmented
+ *
+ * As rb_insert_colour, for a tree with augmented values. The new node's own
+ * value must be set before it's inserted.
+*/
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+						rb_augment_t augment)
+{
+	rb_augment_propagate(node, augment);
+	__rb_insert(node, root, augment);
+}
+
+/**
+ * rb_erase_augmented
+ *
+ * As rb_erase, for a tree with augmented values.
+*/
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+						rb_augment_t augment)
+{
+	__rb_erase(node, root, augment);
+}
+
+/**
+ * rb_first
+ *
+ * Return the node with the smallest key, or NULL if the tree is empty.
+*/
+struct rb_node *rb_first(const struct rb_root *root)
+{
+	struct rb_node *node = root->node;
+
+	if (node == NULL)
+		return NULL;
+	while (node->left)
+		node = node->left;
+	return node;
+}
+
+/**
+ * rb_last
+ *
+ * Return the node with the largest key, or NULL if the tree is empty.
+*/
+struct rb_node *rb_last(const struct rb_root *root)
+{
+	struct rb_node *node = root->node;
+
+	if (node == NULL)
+		return NULL;
+	while (node->right)
+		node = node->right;
+	return node;
+}
+
+/**
+ * rb_next
+ *
+ * Return the in-order successor of a node, or NULL if it's the last.
+*/
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->right) {
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return (struct rb_node *) node;
+	}
+
+	while ((parent = node->parent) != NULL && node == parent->right)
+		node = parent;
+	return parent;
+}
+
+/**
+ * rb_prev
+ *
+ * Return the in-order predecessor of a node, or NULL if it's the first.
+*/
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->left) {
+		node = node->left;
+		while (node->right)
+			node = node->right;
+		return (struct rb_node *) node;
+	}
+
+	while ((parent = node->parent) != NULL && node == parent->left)
+		node = parent;
+	return parent;
+}
@@ -0,0 +1,110 @@
+//===----------------------------------------------------------------------===//
+//
+//                                  tinyOS
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//	Copyright (C) 2024, Harry Moulton <me@h3adsh0tzz.com>
+//
+//===----------------------------------------------------------------------===//
+
+/**
+ * Name:	rbtree.h
+ * Desc:	Intrusive red-black tree implementation for tinyOS. Like list.h,
+ * 			nodes are embedded in the structure being indexed, and the caller
+ * 			walks the tree to find where a new node belongs before linking it
+ * 			with rb_link_node and rebalancing with rb_insert_colour.
+*/
+
+#ifndef __LIBKERN_RBTREE_H__
+#define __LIBKERN_RBTREE_H__
+
+#include <tinylibc/stdint.h>
+#include <libkern/list.h>
+
+#define RB_RED		0
+#define RB_BLACK	1
+
+typedef struct rb_node {
+	struct rb_node		*parent;
+	struct rb_node		*left, *right;
+	unsigned int		colour;
+} rb_node_t;
+
+typedef struct rb_root {
+	struct rb_node		*node;
+} rb_root_t;
+
+#define RB_ROOT_INIT		{ NULL }
+
+#define rb_entry(ptr, type, member)		container_of(ptr, type, member)
+
+static inline void INIT_RB_ROOT(struct rb_root *root)
+{
+	root->node = NULL;
+}
+
+static inline int rb_empty(const struct rb_root *root)
+{
+	return root->node == NULL;
+}
+
+/**
+ * rb_link_node
+ *
+ * Attach a new red node to the tree, in the position the caller found while
+ * searching for its key. rb_insert_colour must be called afterwards.
+ *
+ * @param node		the new node
+ * @param parent	the last node visited in the search, or NULL for an empty tree
+ * @param link		the parent's left or right pointer, or the root pointer
+ *
+ * @returns void
+*/
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+							struct rb_node **link)
+{
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->colour = RB_RED;
+	*link = node;
+}
+
+/* rebalancing after an insert, and removing a node */
+extern void rb_insert_colour(struct rb_node *node, struct rb_root *root);
+extern void rb_erase(struct rb_node *node, struct rb_root *root);
+extern void rb_replace_node(struct rb_node *old, struct rb_node *new,
+							struct rb_root *root);
+
+/**
+ * Augmented trees keep a value in each node that's computed from its subtree,
+ * such as the largest gap below it. The callback recomputes one node's value
+ * from its own and its children's, and is called wherever the tree changes
+ * shape. If a node's own value changes, rb_augment_propagate must be called.
+*/
+typedef void (*rb_augment_t)(struct rb_node *node);
+
+extern void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+							rb_augment_t augment);
+extern void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+							rb_augment_t augment);
+extern void rb_augment_propagate(struct rb_node *node, rb_augment_t augment);
+
+/* in-order traversal */
+extern struct rb_node *rb_first(const struct rb_root *root);
+extern struct rb_node *rb_last(const struct rb_root *root);
+extern struct rb_node *rb_next(const struct rb_node *node);
+extern struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif /* __libkern_rbtree_h__ */
@@ -330,34 +330,124 @@ DeviceTreeLookupReg (DTNode *node, uint32_t *reg)
 	return kDeviceTreeSuccess;
 }
 
+/**
+ * Read the `#address-cells` and `#size-cells` which apply to a nodes 'reg'
+ * field. These are taken from the nodes parent.
+*/
+static DTInteger
+node_offset_reg_cells (DTNodeOffset node_offset, int *address_cells,
+					   int *size_cells)
+{
+	int parent;
+
+	parent = fdt_parent_offset ((const void *) BootDeviceTree.base, node_offset);
+	if (parent < 0)
+		return kDeviceTreeFailure;
+
+	*address_cells = fdt_address_cells ((const void *) BootDeviceTree.base, parent);
+	*size_cells = fdt_size_cells ((const void *) BootDeviceTree.base, parent);
+	if (*address_cells < 0 || *address_cells > 2 ||
+		*size_cells < 0 || *size_cells > 2)
+		return kDeviceTreeFailure;
+
+	return kDeviceTreeSuccess;
+}
+
+/**
+ * Reconstruct a value from `count` big-endian 32-bit cells.
+*/
+static uint64_t
+reg_read_cells (const uint32_t *cells, int count)
+{
+	uint64_t value = 0;
+
+	for (int i = 0; i < count; i++)
+		value = (value << 32) | bswap_32 (cells[i]);
+	return value;
+}
+
 DTInteger
-DeviceTreeLookupRegValue (DTNode *node, uint64_t *addr, uint64_t *size)
+DeviceTreeLookupRegCount (DTNode *node)
 {
-	int res, cell_size;
-	uint32_t *reg, *cells;
+	int len, address_cells, size_cells;
+
+	if (fdt_getprop ((const void *) BootDeviceTree.base, node->offset, "reg", &len) == NULL)
+		return -1;
+
+	if (node_offset_reg_cells (node->offset, &address_cells, &size_cells))
+		return -1;
+
+	return len / ((address_cells + size_cells) * sizeof (uint32_t));
+}
+
+DTInteger
+DeviceTreeLookupRegValueAtIndex (DTNode *node, DTInteger index, uint64_t *addr,
+								 uint64_t *size)
+{
+	int res, address_cells, size_cells, stride;
+	const uint32_t *reg;
 
 	reg = fdt_getprop ((const void *) BootDeviceTree.base, node->offset, "reg", &res);
 	if (res < 0) {
-		kprintf ("DeviceTreeLookupRegValue: ERROR: failed to get prop 'reg' from node '%s': 0x%llx\n",
+		kprintf ("DeviceTreeLookupRegValueAtIndex: ERROR: failed to get prop 'reg' from node '%s': 0x%llx\n",
 			node->name, res);
 		return kDeviceTreeFailure;
 	}
 
-	/**
-	 * The cell size is fixed and defined in defaults.h. For now, until this is
-	 * changed, there is no need to discover the cell size.
-	*/
-	cell_size = DEFAULTS_PLAT_DEVICETREE_CELL_SIZE;
-	cells = &reg[0];
+	if (node_offset_reg_cells (node->offset, &address_cells, &size_cells)) {
+		kprintf ("DeviceTreeLookupRegValueAtIndex: ERROR: invalid cell sizes for node '%s'\n",
+			node->name);
+		return kDeviceTreeFailure;
+	}
 
-	for (int i = 0; i < cell_size * 2; i++)
-		cells[i] = bswap_32 (cells[i]);
+	/* check the requested pair is within the property */
+	stride = address_cells + size_cells;
+	if (index < 0 || (index + 1) * stride * sizeof (uint32_t) > res)
+		return kDeviceTreeFailure;
 
 	/**
-	 * The address and size values are split into two 32-bit integers. Reconstruct
-	 * this 64-bit value and write it into `addr` and `size`.
+	 * The address and size values are split into one or two 32-bit cells each.
+	 * Reconstruct these values and write them into `addr` and `size`.
 	*/
-	*addr = ((uint64_t) cells[0] << 32) + cells[1];
-	*size = ((uint64_t) cells[2] << 32) + cells[3];
+	reg += index * stride;
+	*addr = reg_read_cells (&reg[0], address_cells);
+	*size = reg_read_cells (&reg[address_cells], size_cells);
+
+	return kDeviceTreeSuccess;
 }
 
+DTInteger
+DeviceTreeLookupRegValue (DTNode *node, uint64_t *addr, uint64_t *size)
+{
+	return DeviceTreeLookupRegValueAtIndex (node, 0, addr, size);
+}
+
+DTInteger
+DeviceTreeLookupPropertyU32 (DTNode node, const char *propName, uint32_t *value)
+{
+	const uint32_t *prop;
+	int len;
+
+	prop = fdt_getprop ((const void *) BootDeviceTree.base, node.offset, propName, &len);
+	if (len != sizeof (uint32_t))
+		return kDeviceTreeFailure;
+
+	*value = bswap_32 (*prop);
+	return kDeviceTreeSuccess;
+}
+
+DTInteger
+DeviceTreeGetMemReserveCount ()
+{
+	int res;
+
+	res = fdt_num_mem_rsv ((const void *) BootDeviceTree.base);
+	return (res < 0) ? 0 : res;
+}
+
+DTInteger
+DeviceTreeGetMemReserve (DTInteger index, uint64_t *addr, uint64_t *size)
+{
+	return (fdt_get_mem_rsv ((const void *) BootDeviceTree.base, index, addr, size)) ?
+		kDeviceTreeFailure : kDeviceTreeSuccess;
+}
@@ -113,6 +113,19 @@ DeviceTreeVerify ();
 extern DTInteger
 DeviceTreeLookupNode (const char *lookup, DTNode *node);
 
+/**
+ * DeviceTreeNodeExists
+ * 
+ * Check whether a node with the given path exists, without logging an error
+ * if it does not.
+ * 
+ * @param	name		Path of the node to search for.
+ * 
+ * @returns		kDeviceTreeSuccess or kDeviceTreeFailure
+*/
+extern DTInteger
+DeviceTreeNodeExists (const char *name);
+
 /**
  * DeviceTreeLookupNodeByOffset
  * 
@@ -204,6 +217,74 @@ DeviceTreeLookupPropertyValue (DTNode node, const char *propName,
 extern DTInteger
 DeviceTreeLookupRegValue (DTNode *node, uint64_t *addr, uint64_t *size);
 
+/**
+ * DeviceTreeLookupRegCount
+ * 
+ * Count the number of Address and Size pairs in a nodes 'reg' field, using the
+ * `#address-cells` and `#size-cells` of the nodes parent.
+ * 
+ * @param	node		Node containg a `reg` field.
+ * 
+ * @returns		Number of pairs, or -1 if the node has no `reg` field.
+*/
+extern DTInteger
+DeviceTreeLookupRegCount (DTNode *node);
+
+/**
+ * DeviceTreeLookupRegValueAtIndex
+ * 
+ * Lookup the Address and Size value of the `index`th pair in a nodes 'reg'
+ * field, using the `#address-cells` and `#size-cells` of the nodes parent.
+ * 
+ * @param	node		Node containg a `reg` field.
+ * @param	index		Index of the Address and Size pair.
+ * @param	addr		Pointer to store the Address value in.
+ * @param	size		Poitner to store the Size value in.
+ * 
+ * @returns		kDeviceTreeSuccess or kDeviceTreeFailure
+*/
+extern DTInteger
+DeviceTreeLookupRegValueAtIndex (DTNode *node, DTInteger index, uint64_t *addr,
+								 uint64_t *size);
+
+/**
+ * DeviceTreeLookupPropertyU32
+ * 
+ * Lookup a single 32-bit cell property value. Unlike the other lookups, this
+ * does not log an error if the property is missing, so it can be used for
+ * optional properties.
+ * 
+ * @param	node		Node containing the property.
+ * @param	propName	Name of the property.
+ * @param	value		Pointer to store the value in.
+ * 
+ * @returns		kDeviceTreeSuccess or kDeviceTreeFailure
+*/
+extern DTInteger
+DeviceTreeLookupPropertyU32 (DTNode node, const char *propName, uint32_t *value);
+
+/**
+ * DeviceTreeGetMemReserveCount
+ * 
+ * Return the number of entries in the device tree memory reservation block.
+*/
+extern DTInteger
+DeviceTreeGetMemReserveCount ();
+
+/**
+ * DeviceTreeGetMemReserve
+ * 
+ * Lookup an entry in the device tree memory reservation block.
+ * 
+ * @param	index		Index of the reservation entry.
+ * @param	addr		Pointer to store the Address value in.
+ * @param	size		Poitner to store the Size value in.
+ * 
+ * @returns		kDeviceTreeSuccess or kDeviceTreeFailure
+*/
+extern DTInteger
+DeviceTreeGetMemReserve (DTInteger index, uint64_t *addr, uint64_t *size);
+
 /*******************************************************************************
  *  Device Tree Node Iterator
  ******************************************************************************/
@@ -24,20 +24,148 @@
 
 #include <libkern/assert.h>
 
-kern_return_t platform_get_memory (phys_addr_t *membase, phys_size_t *mmesize)
+/**
+ * Device tree node names, for example "memory@40000000", are compared up to the
+ * unit address.
+*/
+static int platform_node_name_is (const char *name, const char *base)
+{
+	while (*base && *name == *base) {
+		name++;
+		base++;
+	}
+	return (*base == '\0' && (*name == '\0' || *name == '@'));
+}
+
+/*******************************************************************************
+ * Name:	platform_get_memory_ranges
+ * Desc:	Read every `reg` range from every `/memory` node in the device tree.
+ * 			At most 'count' ranges are written to 'ranges', and 'count' is
+ * 			updated with the number found.
+*******************************************************************************/
+
+kern_return_t platform_get_memory_ranges (platform_memory_range_t *ranges,
+							unsigned int *count)
 {
+	DeviceTreeIterator iter;
+	unsigned int found = 0;
+	uint32_t node_id;
 	phys_addr_t addr;
 	phys_size_t size;
-	DTNode mem_node;
-	int res;
+	DTNode node;
+	int nregs;
+
+	/**
+	 * memory nodes are direct children of the root node, iterate over them
+	 * rather than looking up each path (see DEFAULTS_MACHINE_LIBFDT_WORKAROUND)
+	*/
+	DeviceTreeIteratorInit (NULL, &iter);
+	while (DeviceTreeIterateNodes (&iter, &node) == kDeviceTreeSuccess) {
+		if (!platform_node_name_is (node.name, "memory"))
+			continue;
+
+		if (DeviceTreeLookupPropertyU32 (node, "numa-node-id", &node_id))
+			node_id = 0;
+
+		nregs = DeviceTreeLookupRegCount (&node);
+		for (int i = 0; i < nregs; i++) {
+			if (DeviceTreeLookupRegValueAtIndex (&node, i, &addr, &size) ||
+				size == 0)
+				continue;
+
+			if (found == *count) {
+				kprintf ("platform: WARNING: ignoring memory range 0x%lx-0x%lx\n",
+					addr, addr + size);
+				continue;
+			}
+
+			ranges[found].base = addr;
+			ranges[found].size = size;
+			ranges[found].node = node_id;
+			found += 1;
+		}
+	}
+
+	*count = found;
+	return (found) ? KERN_RETURN_SUCCESS : KERN_RETURN_FAIL;
+}
+
+/*******************************************************************************
+ * Name:	platform_get_reserved_memory
+ * Desc:	Read the ranges of memory which must not be used by the kernel, from
+ * 			the `/reserved-memory` node and the memory reservation block.
+*******************************************************************************/
+
+kern_return_t platform_get_reserved_memory (platform_memory_range_t *ranges,
+							unsigned int *count)
+{
+	DeviceTreeIterator iter;
+	unsigned int found = 0;
+	phys_addr_t addr;
+	phys_size_t size;
+	DTNode parent, node;
+	int nregs;
+
+	/* entries in the memory reservation block (/memreserve/) */
+	for (int i = 0; i < DeviceTreeGetMemReserveCount () && found < *count; i++) {
+		if (DeviceTreeGetMemReserve (i, &addr, &size) || size == 0)
+			continue;
+
+		ranges[found].base = addr;
+		ranges[found].size = size;
+		ranges[found].node = 0;
+		found += 1;
+	}
+
+	/* statically placed regions under /reserved-memory */
+	if (DeviceTreeNodeExists ("/reserved-memory") == kDeviceTreeSuccess &&
+		DeviceTreeLookupNode ("/reserved-memory", &parent) == kDeviceTreeSuccess) {
+
+		DeviceTreeIteratorInit (&parent, &iter);
+		while (DeviceTreeIterateNodes (&iter, &node) == kDeviceTreeSuccess) {
+
+			/* dynamically placed regions (size/alloc-ranges) have no reg */
+			nregs = DeviceTreeLookupRegCount (&node);
+			for (int i = 0; i < nregs && found < *count; i++) {
+				if (DeviceTreeLookupRegValueAtIndex (&node, i, &addr, &size) ||
+					size == 0)
+					continue;
+
+				ranges[found].base = addr;
+				ranges[found].size = size;
+				ranges[found].node = 0;
+				found += 1;
+			}
+		}
+	}
+
+	*count = found;
+	return KERN_RETURN_SUCCESS;
+}
+
+/*******************************************************************************
+ * Name:	platform_get_memory
+ * Desc:	Fetch the physical memory range with the lowest base, used to set up
+ * 			the initial kernel mappings before the rest of memory is
+ * 			discovered. The device tree doesn't list ranges in any order.
+*******************************************************************************/
+
+kern_return_t platform_get_memory (phys_addr_t *membase, phys_size_t *mmesize)
+{
+	platform_memory_range_t ranges[PLATFORM_MEMORY_RANGES_MAX];
+	unsigned int count = PLATFORM_MEMORY_RANGES_MAX;
+	unsigned int lowest = 0;
+	kern_return_t res;
 
-	res = DeviceTreeLookupNode ("/memory", &mem_node);
-	assert (res == kDeviceTreeSuccess);
+	res = platform_get_memory_ranges (ranges, &count);
+	assert (res == KERN_RETURN_SUCCESS && count > 0);
 
-	DeviceTreeLookupRegValue (&mem_node, &addr, &size);
+	for (unsigned int i = 1; i < count; i++)
+		if (ranges[i].base < ranges[lowest].base)
+			lowest = i;
 
-	*mmesize = size;
-	*membase = addr;
+	*mmesize = ranges[lowest].size;
+	*membase = ranges[lowest].base;
 
 	return KERN_RETURN_SUCCESS;
-}
\ No newline at end of file
+}
@@ -31,8 +31,27 @@
 #include <kern/vm/pmap.h>
 #include <kern/vm/vm.h>
 
+/**
+ * Physical memory range, as described by a `/memory` or `/reserved-memory`
+ * node in the device tree. 'node' is the NUMA node the range belongs to, from
+ * the optional `numa-node-id` property.
+*/
+typedef struct platform_memory_range {
+	phys_addr_t		base;
+	phys_size_t		size;
+	unsigned int	node;
+} platform_memory_range_t;
+
+/* Maximum number of memory and reserved memory ranges */
+#define PLATFORM_MEMORY_RANGES_MAX		UL(8)
+#define PLATFORM_RESERVED_RANGES_MAX	UL(16)
+
 /* platform memory layout */
 kern_return_t platform_get_memory (phys_addr_t *membase, phys_size_t *memsize);
+kern_return_t platform_get_memory_ranges (platform_memory_range_t *ranges,
+							unsigned int *count);
+kern_return_t platform_get_reserved_memory (platform_memory_range_t *ranges,
+							unsigned int *count);
 
 /* interrupt controller */
 kern_return_t platform_get_gicv3 (void);